@@ -0,0 +1,386 @@
+#ifndef IRODS_SMB_BLOCK_CACHE_HPP
+#define IRODS_SMB_BLOCK_CACHE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+namespace irods::smb
+{
+    // An on-disk cache of fixed-size blocks of data object content.
+    //
+    // Blocks are keyed by (data id, replica number, modify time, size, checksum,
+    // block index), so a block never has to be invalidated. Once the object
+    // changes, the old blocks simply stop being referenced. The size and checksum
+    // tell apart rewrites within the same second. Old blocks age out through LRU
+    // eviction once the cache exceeds its size cap.
+    //
+    // Only content that cannot change while cached may be stored, i.e. replicas
+    // opened read-only.
+    //
+    // Every block is a file in the cache directory. Files are written under a
+    // temporary name and linked into place, so processes sharing the directory
+    // never see partial blocks.
+    //
+    // The size cap applies to the directory, not to a process. Its total size is
+    // kept in a counter mapped from the directory by every process using it. Each
+    // process evicts from the blocks it knows about: those it used and those it
+    // found by scanning the directory in the background.
+    class block_cache
+    {
+    public:
+        struct key_type
+        {
+            std::string data_id;
+            int replica_number;
+            std::string modify_time;
+            std::int64_t size;
+            std::uint64_t checksum; // See checksum_tag.
+            std::int64_t block_index;
+
+            auto operator<(const key_type& _other) const -> bool
+            {
+                return std::tie(data_id, replica_number, modify_time, size, checksum, block_index) <
+                       std::tie(_other.data_id, _other.replica_number, _other.modify_time, _other.size, _other.checksum, _other.block_index);
+            }
+        };
+
+        // Reduces a replica checksum (which may contain '/') to a number that can
+        // be part of a file name. Zero when the replica has no checksum.
+        static auto checksum_tag(const std::string& _checksum) -> std::uint64_t
+        {
+            if (_checksum.empty())
+                return 0;
+
+            // FNV-1a.
+            std::uint64_t hash = 0xcbf29ce484222325ULL;
+
+            for (unsigned char c : _checksum)
+            {
+                hash ^= c;
+                hash *= 0x100000001b3ULL;
+            }
+
+            return hash;
+        }
+
+        block_cache(const std::string& _directory, std::int64_t _block_size, std::int64_t _capacity)
+            : directory_{_directory}
+            , block_size_{_block_size}
+            , capacity_{_capacity}
+        {
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(directory_, ec);
+
+            // Whoever creates the counter also counts the blocks already there.
+            const auto since = std::time(nullptr);
+            const bool count_existing = attach_usage();
+
+            scanner_ = std::thread{[this, count_existing, since] { scan(count_existing, since); }};
+        }
+
+        block_cache(const block_cache&) = delete;
+        auto operator=(const block_cache&) -> block_cache& = delete;
+
+        ~block_cache()
+        {
+            stop_.store(true);
+
+            if (scanner_.joinable())
+                scanner_.join();
+
+            if (usage_ != &local_usage_)
+                ::munmap(usage_, sizeof(*usage_));
+        }
+
+        auto block_size() const noexcept -> std::int64_t
+        {
+            return block_size_;
+        }
+
+        // Copies up to _size bytes starting at _offset within the block into _buffer.
+        // Returns the number of bytes copied or -1 if the block is not cached.
+        auto read(const key_type& _key, std::int64_t _offset, void* _buffer, std::int64_t _size) -> std::int64_t
+        {
+            const int fd = ::open(path(_key).c_str(), O_RDONLY);
+
+            if (fd < 0)
+            {
+                std::lock_guard lock{mutex_};
+                forget(_key);
+                return -1;
+            }
+
+            const auto bytes_read = ::pread(fd, _buffer, static_cast<std::size_t>(_size), _offset);
+
+            struct stat st{};
+            const auto block_bytes = ::fstat(fd, &st) == 0 ? static_cast<std::int64_t>(st.st_size) : block_size_;
+            ::close(fd);
+
+            if (bytes_read < 0)
+                return -1;
+
+            std::lock_guard lock{mutex_};
+            touch(_key, block_bytes); // May have been written by another process.
+
+            return bytes_read;
+        }
+
+        auto write(const key_type& _key, const void* _buffer, std::int64_t _size) -> bool
+        {
+            if (_size <= 0 || _size > capacity_)
+                return false;
+
+            const auto final_path = path(_key);
+            const auto tmp_path = final_path + ".tmp." + std::to_string(::getpid());
+
+            const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+            if (fd < 0)
+                return false;
+
+            const auto bytes_written = ::write(fd, _buffer, static_cast<std::size_t>(_size));
+            ::close(fd);
+
+            // Unlike rename, link fails if another process stored the block first.
+            // Only the process that stored it accounts for it.
+            const bool linked = bytes_written == _size && ::link(tmp_path.c_str(), final_path.c_str()) == 0;
+            const bool exists = !linked && bytes_written == _size && errno == EEXIST;
+            ::unlink(tmp_path.c_str());
+
+            if (!linked && !exists)
+                return false;
+
+            if (linked)
+                usage_->fetch_add(_size);
+
+            std::lock_guard lock{mutex_};
+            touch(_key, _size);
+            evict();
+
+            return true;
+        }
+
+    private:
+        struct entry
+        {
+            std::int64_t size;
+            std::list<key_type>::iterator lru_position;
+        };
+
+        auto path(const key_type& _key) const -> std::string
+        {
+            auto p = directory_;
+            p += '/';
+            p += _key.data_id;
+            p += '.';
+            p += std::to_string(_key.replica_number);
+            p += '.';
+            p += _key.modify_time;
+            p += '.';
+            p += std::to_string(_key.size);
+            p += '.';
+            p += std::to_string(_key.checksum);
+            p += '.';
+            p += std::to_string(_key.block_index);
+            return p;
+        }
+
+        static auto parse_filename(const std::string& _name, key_type& _key) -> bool
+        {
+            // <data id>.<replica number>.<modify time>.<size>.<checksum>.<block index>
+            constexpr std::size_t part_count = 6;
+            std::string parts[part_count];
+            std::size_t n = 0;
+
+            for (char c : _name)
+            {
+                if (c == '.')
+                {
+                    if (++n == part_count)
+                        return false;
+                }
+                else if (c < '0' || c > '9')
+                {
+                    return false;
+                }
+                else
+                {
+                    parts[n] += c;
+                }
+            }
+
+            if (n != part_count - 1 || std::any_of(std::begin(parts), std::end(parts), [](auto& _p) { return _p.empty(); }))
+                return false;
+
+            _key = {parts[0], std::stoi(parts[1]), parts[2], std::stoll(parts[3]), std::stoull(parts[4]), std::stoll(parts[5])};
+
+            return true;
+        }
+
+        // Maps the directory's size counter. Returns true if this process created
+        // it. Without it, the cap falls back to what this process knows about.
+        auto attach_usage() -> bool
+        {
+            const auto usage_path = directory_ + "/.usage";
+
+            bool creator = true;
+            int fd = ::open(usage_path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+
+            if (fd < 0 && errno == EEXIST)
+            {
+                creator = false;
+                fd = ::open(usage_path.c_str(), O_RDWR);
+            }
+
+            if (fd < 0)
+                return true;
+
+            if (creator && ::ftruncate(fd, sizeof(*usage_)) != 0)
+            {
+                ::close(fd);
+                ::unlink(usage_path.c_str());
+                return true;
+            }
+
+            // Wait for the creator to size the file.
+            struct stat st{};
+            for (int i = 0; i < 100 && ::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) < sizeof(*usage_); ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+            void* addr = MAP_FAILED;
+
+            if (static_cast<std::size_t>(st.st_size) >= sizeof(*usage_) || creator)
+                addr = ::mmap(nullptr, sizeof(*usage_), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+            ::close(fd);
+
+            if (addr == MAP_FAILED)
+                return true;
+
+            usage_ = static_cast<std::atomic<std::int64_t>*>(addr);
+
+            return creator;
+        }
+
+        // Adopts the blocks in the directory as eviction candidates, oldest first.
+        // If _count is set, blocks from before _since are added to the counter,
+        // later ones were counted by the process that stored them.
+        auto scan(bool _count, std::time_t _since) -> void
+        {
+            namespace fs = boost::filesystem;
+
+            std::multimap<std::time_t, std::pair<key_type, std::int64_t>> existing;
+            std::int64_t total = 0;
+            boost::system::error_code ec;
+
+            // Counting must not stop halfway, no other process would finish it.
+            for (fs::directory_iterator iter{directory_, ec}, end; !ec && iter != end && (_count || !stop_.load()); iter.increment(ec))
+            {
+                key_type key;
+
+                if (!parse_filename(iter->path().filename().string(), key))
+                    continue;
+
+                const auto size = static_cast<std::int64_t>(fs::file_size(iter->path(), ec));
+
+                if (ec)
+                {
+                    ec.clear();
+                    continue;
+                }
+
+                const auto time = fs::last_write_time(iter->path(), ec);
+
+                if (_count && time < _since)
+                    total += size;
+
+                existing.emplace(time, std::make_pair(std::move(key), size));
+            }
+
+            if (_count)
+                usage_->fetch_add(total);
+
+            std::lock_guard lock{mutex_};
+
+            // Blocks used by this process meanwhile are already more recent.
+            for (auto iter = existing.rbegin(); iter != existing.rend(); ++iter)
+            {
+                auto& [key, size] = iter->second;
+
+                if (index_.find(key) == std::end(index_))
+                    index_.emplace(key, entry{size, lru_.insert(std::begin(lru_), key)});
+            }
+
+            evict();
+        }
+
+        // Callers must hold mutex_.
+        auto touch(const key_type& _key, std::int64_t _size) -> void
+        {
+            if (auto iter = index_.find(_key); iter != std::end(index_))
+            {
+                iter->second.size = _size;
+                lru_.splice(std::end(lru_), lru_, iter->second.lru_position);
+                return;
+            }
+
+            auto position = lru_.insert(std::end(lru_), _key);
+            index_.emplace(_key, entry{_size, position});
+        }
+
+        auto forget(const key_type& _key) -> void
+        {
+            if (auto iter = index_.find(_key); iter != std::end(index_))
+            {
+                lru_.erase(iter->second.lru_position);
+                index_.erase(iter);
+            }
+        }
+
+        auto evict() -> void
+        {
+            while (usage_->load() > capacity_ && !lru_.empty())
+            {
+                const auto key = lru_.front();
+
+                // Another process may have evicted the block already.
+                if (::unlink(path(key).c_str()) == 0)
+                    usage_->fetch_sub(index_.at(key).size);
+
+                forget(key);
+            }
+        }
+
+        const std::string directory_;
+        const std::int64_t block_size_;
+        const std::int64_t capacity_;
+        std::atomic<std::int64_t> local_usage_{0};
+        std::atomic<std::int64_t>* usage_ = &local_usage_;
+        std::mutex mutex_;
+        std::list<key_type> lru_;
+        std::map<key_type, entry> index_;
+        std::atomic<bool> stop_{false};
+        std::thread scanner_;
+    };
+} // namespace irods::smb
+
+#endif // IRODS_SMB_BLOCK_CACHE_HPP
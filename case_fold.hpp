@@ -0,0 +1,150 @@
+#ifndef IRODS_SMB_CASE_FOLD_HPP
+#define IRODS_SMB_CASE_FOLD_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace irods::smb
+{
+    namespace detail
+    {
+        // Lowercases ASCII letters in place, 16 bytes at a time when SSE2 is
+        // available. Returns false if a non-ASCII byte was seen, in which case the
+        // contents of _s are unspecified.
+        inline auto fold_ascii(char* _s, std::size_t _size) -> bool
+        {
+            std::size_t i = 0;
+
+#if defined(__SSE2__)
+            const auto upper_a = _mm_set1_epi8('A' - 1);
+            const auto upper_z = _mm_set1_epi8('Z' + 1);
+            const auto delta = _mm_set1_epi8('a' - 'A');
+
+            for (; i + 16 <= _size; i += 16)
+            {
+                auto* p = reinterpret_cast<__m128i*>(_s + i);
+                const auto v = _mm_loadu_si128(p);
+
+                // Any byte with the high bit set is not ASCII.
+                if (_mm_movemask_epi8(v) != 0)
+                    return false;
+
+                const auto is_upper = _mm_and_si128(_mm_cmpgt_epi8(v, upper_a), _mm_cmplt_epi8(v, upper_z));
+                _mm_storeu_si128(p, _mm_add_epi8(v, _mm_and_si128(is_upper, delta)));
+            }
+#endif
+
+            for (; i < _size; ++i)
+            {
+                const auto c = static_cast<unsigned char>(_s[i]);
+
+                if (c & 0x80)
+                    return false;
+
+                if (c >= 'A' && c <= 'Z')
+                    _s[i] = static_cast<char>(c + ('a' - 'A'));
+            }
+
+            return true;
+        }
+
+        // Decodes one UTF-8 sequence. Invalid bytes decode to themselves so that
+        // folding never loses information.
+        inline auto decode_utf8(std::string_view _s, std::size_t& _i) -> char32_t
+        {
+            const auto b0 = static_cast<unsigned char>(_s[_i]);
+
+            const auto continuation = [&_s](std::size_t _j) {
+                return _j < _s.size() && (static_cast<unsigned char>(_s[_j]) & 0xC0) == 0x80;
+            };
+
+            const auto bits = [&_s](std::size_t _j) {
+                return static_cast<char32_t>(static_cast<unsigned char>(_s[_j]) & 0x3F);
+            };
+
+            if (b0 >= 0xC2 && b0 <= 0xDF && continuation(_i + 1))
+            {
+                const auto cp = (static_cast<char32_t>(b0 & 0x1F) << 6) | bits(_i + 1);
+                _i += 2;
+                return cp;
+            }
+
+            if (b0 >= 0xE0 && b0 <= 0xEF && continuation(_i + 1) && continuation(_i + 2))
+            {
+                const auto cp = (static_cast<char32_t>(b0 & 0x0F) << 12) | (bits(_i + 1) << 6) | bits(_i + 2);
+                _i += 3;
+                return cp;
+            }
+
+            if (b0 >= 0xF0 && b0 <= 0xF4 && continuation(_i + 1) && continuation(_i + 2) && continuation(_i + 3))
+            {
+                const auto cp = (static_cast<char32_t>(b0 & 0x07) << 18) | (bits(_i + 1) << 12) | (bits(_i + 2) << 6) | bits(_i + 3);
+                _i += 4;
+                return cp;
+            }
+
+            ++_i;
+
+            return b0;
+        }
+
+        inline auto encode_utf8(char32_t _cp, std::string& _out) -> void
+        {
+            if (_cp < 0x80)
+                _out += static_cast<char>(_cp);
+            else if (_cp < 0x800)
+            {
+                _out += static_cast<char>(0xC0 | (_cp >> 6));
+                _out += static_cast<char>(0x80 | (_cp & 0x3F));
+            }
+            else if (_cp < 0x10000)
+            {
+                _out += static_cast<char>(0xE0 | (_cp >> 12));
+                _out += static_cast<char>(0x80 | ((_cp >> 6) & 0x3F));
+                _out += static_cast<char>(0x80 | (_cp & 0x3F));
+            }
+            else
+            {
+                _out += static_cast<char>(0xF0 | (_cp >> 18));
+                _out += static_cast<char>(0x80 | ((_cp >> 12) & 0x3F));
+                _out += static_cast<char>(0x80 | ((_cp >> 6) & 0x3F));
+                _out += static_cast<char>(0x80 | (_cp & 0x3F));
+            }
+        }
+    } // namespace detail
+
+    // Returns the case-folded form of a UTF-8 name. ASCII names (the common case)
+    // take the vectorized path. Anything else is decoded and folded per code point
+    // using the C library's wide character tables.
+    inline auto case_fold(std::string_view _name) -> std::string
+    {
+        std::string folded{_name};
+
+        if (detail::fold_ascii(folded.data(), folded.size()))
+            return folded;
+
+        folded.clear();
+        folded.reserve(_name.size());
+
+        for (std::size_t i = 0; i < _name.size();)
+        {
+            const auto cp = detail::decode_utf8(_name, i);
+
+            if (cp < 0x80)
+                folded += static_cast<char>((cp >= 'A' && cp <= 'Z') ? cp + ('a' - 'A') : cp);
+            else
+                detail::encode_utf8(static_cast<char32_t>(std::towlower(static_cast<std::wint_t>(cp))), folded);
+        }
+
+        return folded;
+    }
+} // namespace irods::smb
+
+#endif // IRODS_SMB_CASE_FOLD_HPP
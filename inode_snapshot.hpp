@@ -0,0 +1,392 @@
+#ifndef IRODS_SMB_INODE_SNAPSHOT_HPP
+#define IRODS_SMB_INODE_SNAPSHOT_HPP
+
+#include "libirods_smb.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace irods::smb
+{
+    // A read-only, memory-mapped table of logical paths, the inode numbers they
+    // were given and (optionally) their last known attributes. It is written by
+    // earlier processes so that a new session starts with stable inode numbers
+    // and warm attributes.
+    //
+    // Layout: a header, the records sorted by path and a string table holding the
+    // paths. Lookups are binary searches directly on the mapping, nothing is
+    // copied at load time.
+    //
+    // Attributes are only hints. Callers must revalidate them (e.g. by modify
+    // time) before use.
+    //
+    // Concurrent sessions share the file. A lock file next to it serializes
+    // writers and holds the counter that gives every session a range of inode
+    // numbers of its own.
+    class inode_snapshot
+    {
+    public:
+        struct record
+        {
+            std::uint64_t path_offset;
+            std::uint32_t path_size;
+            std::uint32_t has_stat_info;
+            std::int64_t inode;
+            irods_stat_info stat_info;
+        };
+
+        struct entry
+        {
+            std::string path;
+            std::int64_t inode;
+            bool has_stat_info;
+            irods_stat_info stat_info;
+        };
+
+        // Snapshots are merged on every write. This bounds their growth.
+        static constexpr std::size_t max_entries = 1 << 20;
+
+        // Inode numbers reserved per session.
+        static constexpr std::int64_t inode_range = std::int64_t{1} << 32;
+
+        inode_snapshot() = default;
+
+        inode_snapshot(const inode_snapshot&) = delete;
+        auto operator=(const inode_snapshot&) -> inode_snapshot& = delete;
+
+        ~inode_snapshot()
+        {
+            unmap();
+        }
+
+        auto map(const std::string& _path) -> bool
+        {
+            unmap();
+
+            const int fd = ::open(_path.c_str(), O_RDONLY);
+
+            if (fd < 0)
+                return false;
+
+            struct stat st{};
+
+            if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(header))
+            {
+                ::close(fd);
+                return false;
+            }
+
+            void* addr = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+
+            if (addr == MAP_FAILED)
+                return false;
+
+            base_ = static_cast<const char*>(addr);
+            size_ = static_cast<std::size_t>(st.st_size);
+
+            if (!valid())
+            {
+                unmap();
+                return false;
+            }
+
+            return true;
+        }
+
+        auto mapped() const noexcept -> bool
+        {
+            return base_ != nullptr;
+        }
+
+        // The first inode number that no process has handed out yet.
+        auto next_inode() const noexcept -> std::int64_t
+        {
+            return mapped() ? head().next_inode : 1;
+        }
+
+        auto find(std::string_view _path) const -> const record*
+        {
+            if (!mapped())
+                return nullptr;
+
+            const auto* first = records();
+            const auto* last = first + head().count;
+
+            const auto* iter = std::lower_bound(first, last, _path, [this](const record& _r, std::string_view _p) {
+                return path(_r) < _p;
+            });
+
+            return (iter != last && path(*iter) == _path) ? iter : nullptr;
+        }
+
+        // Calls _func(name, record) for every direct child of _collection.
+        template <typename Function>
+        auto for_each_child(const std::string& _collection, Function _func) const -> void
+        {
+            if (!mapped())
+                return;
+
+            const auto prefix = _collection == "/" ? _collection : _collection + '/';
+            const auto* first = records();
+            const auto* last = first + head().count;
+
+            const auto* iter = std::lower_bound(first, last, std::string_view{prefix}, [this](const record& _r, std::string_view _p) {
+                return path(_r) < _p;
+            });
+
+            for (; iter != last; ++iter)
+            {
+                const auto p = path(*iter);
+
+                if (p.substr(0, prefix.size()) != prefix)
+                    break;
+
+                if (const auto name = p.substr(prefix.size()); !name.empty() && name.find('/') == std::string_view::npos)
+                    _func(name, *iter);
+            }
+        }
+
+        // Returns the first of inode_range numbers that no other session uses,
+        // and no lower than _floor. Returns zero if the lock file is unusable.
+        static auto reserve_inodes(const std::string& _path, std::int64_t _floor) -> std::int64_t
+        {
+            const file_lock lock{_path};
+
+            if (!lock.locked())
+                return 0;
+
+            std::int64_t next = 0;
+
+            if (::pread(lock.fd(), &next, sizeof(next), 0) != static_cast<ssize_t>(sizeof(next)))
+                next = 0;
+
+            const auto first = std::max<std::int64_t>({next, _floor, 1});
+            const auto reserved = first + inode_range;
+
+            if (::pwrite(lock.fd(), &reserved, sizeof(reserved), 0) != static_cast<ssize_t>(sizeof(reserved)))
+                return 0;
+
+            return first;
+        }
+
+        // Writes _entries merged with whatever snapshot currently exists at _path.
+        // _entries take precedence. Older entries are dropped when they conflict
+        // with them on either the path or the inode number. The file is replaced
+        // atomically, while holding the lock so that no session's entries are lost.
+        static auto write(const std::string& _path, std::vector<entry> _entries, std::int64_t _next_inode) -> bool
+        {
+            const file_lock lock{_path};
+
+            if (!lock.locked())
+                return false;
+
+            std::unordered_set<std::string_view> paths;
+            std::unordered_set<std::int64_t> inodes;
+
+            for (const auto& e : _entries)
+            {
+                paths.insert(e.path);
+                inodes.insert(e.inode);
+            }
+
+            std::vector<entry> merged;
+
+            if (inode_snapshot current; current.map(_path))
+            {
+                _next_inode = std::max(_next_inode, current.next_inode());
+
+                const auto* r = current.records();
+
+                for (std::uint64_t i = 0; i < current.head().count && _entries.size() + merged.size() < max_entries; ++i, ++r)
+                {
+                    const auto p = current.path(*r);
+
+                    if (paths.count(p) == 0 && inodes.count(r->inode) == 0)
+                        merged.push_back({std::string{p}, r->inode, r->has_stat_info != 0, r->stat_info});
+                }
+            }
+
+            // The set views strings owned by _entries, which may move below.
+            paths.clear();
+            _entries.insert(std::end(_entries), std::make_move_iterator(std::begin(merged)), std::make_move_iterator(std::end(merged)));
+
+            if (_entries.size() > max_entries)
+                _entries.resize(max_entries);
+
+            std::sort(std::begin(_entries), std::end(_entries), [](const entry& _a, const entry& _b) {
+                return _a.path < _b.path;
+            });
+
+            header h{};
+            h.magic = magic;
+            h.record_size = sizeof(record);
+            h.count = _entries.size();
+            h.next_inode = _next_inode;
+            h.strings_offset = sizeof(header) + sizeof(record) * _entries.size();
+
+            std::vector<record> records(_entries.size());
+            std::string strings;
+
+            for (std::size_t i = 0; i < _entries.size(); ++i)
+            {
+                auto& r = records[i];
+                std::memset(&r, 0, sizeof(r));
+                r.path_offset = strings.size();
+                r.path_size = static_cast<std::uint32_t>(_entries[i].path.size());
+                r.inode = _entries[i].inode;
+                r.has_stat_info = _entries[i].has_stat_info ? 1 : 0;
+
+                if (_entries[i].has_stat_info)
+                    r.stat_info = _entries[i].stat_info;
+
+                strings += _entries[i].path;
+            }
+
+            h.strings_size = strings.size();
+
+            // The file holds the user's paths. Only the owner may read it.
+            const auto tmp_path = _path + ".tmp." + std::to_string(::getpid());
+            const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+            if (fd < 0)
+                return false;
+
+            auto* file = ::fdopen(fd, "wb");
+
+            if (!file)
+            {
+                ::close(fd);
+                std::remove(tmp_path.c_str());
+                return false;
+            }
+
+            bool ok = std::fwrite(&h, sizeof(h), 1, file) == 1;
+            ok = ok && (records.empty() || std::fwrite(records.data(), sizeof(record), records.size(), file) == records.size());
+            ok = ok && (strings.empty() || std::fwrite(strings.data(), 1, strings.size(), file) == strings.size());
+            ok = (std::fclose(file) == 0) && ok;
+
+            if (!ok || std::rename(tmp_path.c_str(), _path.c_str()) != 0)
+            {
+                std::remove(tmp_path.c_str());
+                return false;
+            }
+
+            return true;
+        }
+
+    private:
+        static constexpr std::uint64_t magic = 0x69736d62696e6f31; // "ismbino1"
+
+        // Holds an exclusive lock on the snapshot's lock file for its lifetime.
+        class file_lock
+        {
+        public:
+            explicit file_lock(const std::string& _snapshot_path)
+                : fd_{::open((_snapshot_path + ".lock").c_str(), O_RDWR | O_CREAT, 0600)}
+            {
+                if (fd_ >= 0 && ::flock(fd_, LOCK_EX) != 0)
+                {
+                    ::close(fd_);
+                    fd_ = -1;
+                }
+            }
+
+            file_lock(const file_lock&) = delete;
+            auto operator=(const file_lock&) -> file_lock& = delete;
+
+            ~file_lock()
+            {
+                if (fd_ >= 0)
+                    ::close(fd_); // Releases the lock.
+            }
+
+            auto locked() const noexcept -> bool
+            {
+                return fd_ >= 0;
+            }
+
+            auto fd() const noexcept -> int
+            {
+                return fd_;
+            }
+
+        private:
+            int fd_;
+        };
+
+        struct header
+        {
+            std::uint64_t magic;
+            std::uint64_t record_size;
+            std::uint64_t count;
+            std::int64_t next_inode;
+            std::uint64_t strings_offset;
+            std::uint64_t strings_size;
+        };
+
+        auto head() const noexcept -> const header&
+        {
+            return *reinterpret_cast<const header*>(base_);
+        }
+
+        auto records() const noexcept -> const record*
+        {
+            return reinterpret_cast<const record*>(base_ + sizeof(header));
+        }
+
+        auto path(const record& _r) const -> std::string_view
+        {
+            return {base_ + head().strings_offset + _r.path_offset, _r.path_size};
+        }
+
+        auto valid() const -> bool
+        {
+            const auto& h = head();
+
+            // A file written by a build with a different record layout is ignored.
+            if (h.magic != magic || h.record_size != sizeof(record) || h.count > max_entries)
+                return false;
+
+            if (h.strings_offset != sizeof(header) + sizeof(record) * h.count || h.strings_offset + h.strings_size > size_)
+                return false;
+
+            const auto* r = records();
+
+            for (std::uint64_t i = 0; i < h.count; ++i, ++r)
+            {
+                if (r->path_offset + r->path_size > h.strings_size)
+                    return false;
+            }
+
+            return true;
+        }
+
+        auto unmap() -> void
+        {
+            if (base_)
+                ::munmap(const_cast<char*>(base_), size_);
+
+            base_ = nullptr;
+            size_ = 0;
+        }
+
+        const char* base_ = nullptr;
+        std::size_t size_ = 0;
+    };
+} // namespace irods::smb
+
+#endif // IRODS_SMB_INODE_SNAPSHOT_HPP
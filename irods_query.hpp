@@ -14,6 +14,8 @@
 #include "rcMisc.h"
 #include "irods_exception.hpp"
 
+#include "span_trace.hpp"
+
 #include <algorithm>
 
 #include <boost/format.hpp>
@@ -135,6 +137,16 @@ namespace irods {
                 return res;
             }
 
+            int64_t page_bytes() {
+                int64_t bytes = 0;
+                if(gen_output_) {
+                    for(int attr_idx = 0; attr_idx < gen_output_->attriCnt; ++attr_idx) {
+                        bytes += int64_t{gen_output_->sqlResult[attr_idx].len} * gen_output_->rowCnt;
+                    }
+                }
+                return bytes;
+            }
+
             bool results_valid() {
                 if(gen_output_) {
                     return (gen_output_->rowCnt > 0);
@@ -173,10 +185,12 @@ namespace irods {
                     freeGenQueryOut(&gen_output_);
                 }
 
+                irods::smb::span_scope span{"rcGenQuery"};
                 int ret = query_helper::gen_query_fcn(
                            comm_,
                            &gen_input_,
                            &gen_output_);
+                span.set_bytes(page_bytes());
                 return ret;
             } // fetch_page
 
@@ -214,10 +228,12 @@ namespace irods {
                     freeGenQueryOut(&gen_output_);
                 }
 
+                irods::smb::span_scope span{"rcSpecificQuery"};
                 int ret = query_helper::spec_query_fcn(
                            comm_,
                            &spec_input_,
                            &gen_output_);
+                span.set_bytes(page_bytes());
                 return ret;
             } // fetch_page
 
@@ -231,10 +247,12 @@ namespace irods {
                 spec_input_.maxRows = _max_rows;
                 spec_input_.sql = const_cast<char*>(_query_string.c_str());
 
+                irods::smb::span_scope span{"rcSpecificQuery", _query_string.c_str()};
                 int spec_err = query_helper::spec_query_fcn(
                                    _comm,
                                    &spec_input_,
                                    &gen_output_);
+                span.set_bytes(page_bytes());
                 if(spec_err < 0) {
                     THROW(
                         spec_err,
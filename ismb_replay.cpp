@@ -0,0 +1,424 @@
+// Replays a trace recorded with IOPT_TRACE_FILE against a live zone and reports
+// per-operation latencies.
+//
+// Usage: ismb_replay [--speed N] [--dry-run] [--share PATH] TRACE_FILE
+//
+//   --speed N    1 keeps the recorded timing, 0 issues calls back-to-back and
+//                values above 1 compress the gaps between calls. Default is 1.
+//   --dry-run    Does not connect. Reports the latencies stored in the trace.
+//   --share PATH Passed to ismb_create_context. Default is "./irods".
+
+#include "libirods_smb.h"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    using irods::smb::trace_op;
+    using irods::smb::trace_record;
+
+    struct options
+    {
+        double speed = 1;
+        bool dry_run = false;
+        std::string share = "./irods";
+        std::string trace_file;
+    };
+
+    struct op_statistics
+    {
+        std::vector<std::int64_t> durations_ns;
+        std::int64_t errors = 0;
+    };
+
+    class replayer
+    {
+    public:
+        explicit replayer(irods_context* _ctx)
+            : ctx_{_ctx}
+        {
+        }
+
+        // Issues the call described by _record. Returns the result the same
+        // way it is recorded, so that it can be compared with the original.
+        auto replay(const trace_record& _record) -> std::int64_t
+        {
+            const auto* path = _record.path.c_str();
+            const auto* path2 = _record.path2.c_str();
+            const auto* args = _record.args;
+
+            switch (_record.op)
+            {
+                case trace_op::stat: {
+                    irods_stat_info info{};
+                    return ismb_stat(ctx_, path, &info);
+                }
+
+                case trace_op::list: {
+                    irods_string_array entries{};
+                    ismb_list(ctx_, path, &entries);
+
+                    if (entries.size > 0)
+                        ismb_free_string_array(&entries);
+
+                    return 0;
+                }
+
+                case trace_op::chdir:
+                    return ismb_chdir(ctx_, path);
+
+                case trace_op::opendir:
+                    // Only one stream is tracked. Most clients read a directory
+                    // to the end before opening the next one.
+                    close_dir();
+                    return ismb_opendir(ctx_, path, &dir_);
+
+                case trace_op::readdir:
+                    return dir_ && ismb_readdir(ctx_, dir_) ? 1 : 0;
+
+                case trace_op::closedir:
+                    close_dir();
+                    return 0;
+
+                case trace_op::mkdir:
+                    return ismb_mkdir(ctx_, path);
+
+                case trace_op::rmdir:
+                    return ismb_rmdir(ctx_, path);
+
+                case trace_op::rmtree:
+                    return ismb_rmtree(ctx_, path, static_cast<int>(args[0]));
+
+                case trace_op::open: {
+                    const auto fd = ismb_open(ctx_, path, static_cast<int>(args[0]), static_cast<int>(args[1]));
+
+                    if (fd >= 0 && _record.result >= 0)
+                        fds_[_record.result] = fd;
+
+                    return fd;
+                }
+
+                case trace_op::close: {
+                    const auto fd = live_fd(args[0]);
+                    fds_.erase(args[0]);
+                    return ismb_close(ctx_, fd);
+                }
+
+                case trace_op::read:
+                    return ismb_read(ctx_, live_fd(args[0]), buffer(args[1]), static_cast<int>(args[1]));
+
+                case trace_op::pread:
+                    return ismb_pread(ctx_, live_fd(args[0]), buffer(args[1]), static_cast<int>(args[1]), args[2]);
+
+                case trace_op::write:
+                    return ismb_write(ctx_, live_fd(args[0]), zeroed_buffer(args[1]), static_cast<int>(args[1]));
+
+                case trace_op::pwrite:
+                    return ismb_pwrite(ctx_, live_fd(args[0]), zeroed_buffer(args[1]), static_cast<int>(args[1]), args[2]);
+
+                case trace_op::lseek:
+                    return ismb_lseek(ctx_, live_fd(args[0]), args[1], static_cast<int>(args[2]));
+
+                case trace_op::ftruncate:
+                    return ismb_ftruncate(ctx_, live_fd(args[0]), args[1]);
+
+                case trace_op::fstat: {
+                    irods_stat_info info{};
+                    return ismb_fstat(ctx_, live_fd(args[0]), &info);
+                }
+
+                case trace_op::unlink:
+                    return ismb_unlink(ctx_, path);
+
+                case trace_op::copy:
+                    return ismb_copy(ctx_, path, path2, args[0], args[1]);
+
+                case trace_op::rename:
+                    return ismb_rename(ctx_, path, path2);
+
+                case trace_op::dir_usage: {
+                    long long bytes = 0;
+                    long long objects = 0;
+                    return ismb_dir_usage(ctx_, path, &bytes, &objects);
+                }
+
+                case trace_op::statvfs: {
+                    irods_statvfs_info info{};
+                    return ismb_statvfs(ctx_, path, &info);
+                }
+
+                case trace_op::lookup_nocase: {
+                    char* real_name = nullptr;
+                    const auto ec = ismb_lookup_nocase(ctx_, path, path2, &real_name);
+
+                    if (real_name)
+                        ismb_free_string(real_name);
+
+                    return ec;
+                }
+
+                case trace_op::getxattr:
+                    return ismb_getxattr(ctx_, path, path2, static_cast<char*>(buffer(args[0])), static_cast<int>(args[0]));
+
+                case trace_op::listxattr:
+                    return ismb_listxattr(ctx_, path, static_cast<char*>(buffer(args[0])), static_cast<int>(args[0]));
+
+                case trace_op::setxattr: {
+                    // Values are not recorded. A value of the original size is
+                    // written instead.
+                    auto* value = static_cast<char*>(buffer(args[0]));
+                    std::fill_n(value, std::max<std::int64_t>(args[0], 0), 'x');
+                    return ismb_setxattr(ctx_, path, path2, value, static_cast<int>(args[0]));
+                }
+
+                case trace_op::removexattr:
+                    return ismb_removexattr(ctx_, path, path2);
+
+                case trace_op::walk: {
+                    irods_walk_options opts{};
+                    opts.max_depth = static_cast<int>(args[0]);
+                    opts.threads = static_cast<int>(args[1]);
+                    opts.page_size = static_cast<int>(args[2]);
+
+                    const auto ignore = [](const char*, const irods_stat_info*, void*) { return 0; };
+
+                    return ismb_walk(ctx_, path, ignore, &opts, nullptr);
+                }
+
+                case trace_op::changes_since: {
+                    // Cookies are issued per session. A poll continues from the
+                    // last cookie of the replay for the same collection.
+                    auto& cookie = cookies_[_record.path];
+
+                    if (args[0] == 0)
+                        cookie = 0;
+
+                    irods_change_list changes{};
+                    const auto ec = ismb_changes_since(ctx_, path, &cookie, &changes);
+                    ismb_free_change_list(&changes);
+
+                    return ec;
+                }
+            }
+
+            return 0;
+        }
+
+        auto close_dir() -> void
+        {
+            if (dir_)
+                ismb_closedir(ctx_, dir_);
+
+            dir_ = nullptr;
+        }
+
+        auto close_files() -> void
+        {
+            for (const auto& [recorded, fd] : fds_)
+                ismb_close(ctx_, fd);
+
+            fds_.clear();
+        }
+
+    private:
+        // Descriptors that were never opened during the replay (e.g. the trace
+        // starts in the middle of a session) map to -1 and fail like a stale
+        // descriptor would.
+        auto live_fd(std::int64_t _recorded) const -> int
+        {
+            const auto iter = fds_.find(_recorded);
+            return iter != std::end(fds_) ? iter->second : -1;
+        }
+
+        auto buffer(std::int64_t _size) -> void*
+        {
+            const auto size = static_cast<std::size_t>(std::max<std::int64_t>(_size, 1));
+
+            if (buffer_.size() < size)
+                buffer_.resize(size);
+
+            return buffer_.data();
+        }
+
+        auto zeroed_buffer(std::int64_t _size) -> void*
+        {
+            auto* data = buffer(_size);
+            std::memset(data, 0, static_cast<std::size_t>(std::max<std::int64_t>(_size, 0)));
+            return data;
+        }
+
+        irods_context* ctx_;
+        irods_collection_stream* dir_ = nullptr;
+        std::unordered_map<std::int64_t, int> fds_;
+        std::unordered_map<std::string, long long> cookies_;
+        std::vector<char> buffer_;
+    };
+
+    auto is_error(trace_op _op, std::int64_t _result) -> bool
+    {
+        // Pointer results are recorded as 1 or 0. Zero from readdir is the end
+        // of the stream.
+        return _op != trace_op::readdir && _result < 0;
+    }
+
+    auto percentile(const std::vector<std::int64_t>& _sorted, double _p) -> double
+    {
+        if (_sorted.empty())
+            return 0;
+
+        const auto index = static_cast<std::size_t>(_p * static_cast<double>(_sorted.size() - 1) + 0.5);
+
+        return static_cast<double>(_sorted[index]) / 1000.0;
+    }
+
+    auto print_usage(const char* _program) -> void
+    {
+        std::fprintf(stderr, "usage: %s [--speed N] [--dry-run] [--share PATH] TRACE_FILE\n", _program);
+    }
+
+    auto parse_options(int _argc, char* _argv[], options& _opts) -> bool
+    {
+        for (int i = 1; i < _argc; ++i)
+        {
+            const std::string arg = _argv[i];
+
+            if (arg == "--speed" && i + 1 < _argc)
+                _opts.speed = std::atof(_argv[++i]);
+            else if (arg == "--dry-run")
+                _opts.dry_run = true;
+            else if (arg == "--share" && i + 1 < _argc)
+                _opts.share = _argv[++i];
+            else if (!arg.empty() && arg[0] != '-' && _opts.trace_file.empty())
+                _opts.trace_file = arg;
+            else
+                return false;
+        }
+
+        return !_opts.trace_file.empty() && _opts.speed >= 0;
+    }
+} // anonymous namespace
+
+int main(int _argc, char* _argv[])
+{
+    options opts;
+
+    if (!parse_options(_argc, _argv, opts))
+    {
+        print_usage(_argv[0]);
+        return 1;
+    }
+
+    irods::smb::trace_reader reader;
+
+    if (!reader.open(opts.trace_file))
+    {
+        std::fprintf(stderr, "could not read trace file [%s].\n", opts.trace_file.c_str());
+        return 1;
+    }
+
+    irods_context* ctx = nullptr;
+
+    if (!opts.dry_run)
+    {
+        ctx = ismb_create_context(opts.share.c_str());
+
+        if (!ctx)
+        {
+            std::fprintf(stderr, "could not create context.\n");
+            return 1;
+        }
+
+        if (const auto ec = ismb_connect(ctx); ec != 0)
+        {
+            std::fprintf(stderr, "ismb_connect :: error code = %i\n", ec);
+            ismb_destroy_context(ctx);
+            return 1;
+        }
+    }
+
+    using clock_type = std::chrono::steady_clock;
+
+    replayer player{ctx};
+    std::map<trace_op, op_statistics> statistics;
+    std::int64_t mismatches = 0;
+    std::int64_t total = 0;
+    trace_record record;
+
+    const auto started_at = clock_type::now();
+
+    while (reader.next(record))
+    {
+        auto& stats = statistics[record.op];
+        ++total;
+
+        if (opts.dry_run)
+        {
+            stats.durations_ns.push_back(record.duration_ns);
+            stats.errors += is_error(record.op, record.result) ? 1 : 0;
+            continue;
+        }
+
+        if (opts.speed > 0)
+        {
+            const auto offset = std::chrono::nanoseconds{static_cast<std::int64_t>(static_cast<double>(record.start_ns) / opts.speed)};
+            std::this_thread::sleep_until(started_at + offset);
+        }
+
+        const auto start = clock_type::now();
+        const auto result = player.replay(record);
+        const auto duration = clock_type::now() - start;
+
+        stats.durations_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+        stats.errors += is_error(record.op, result) ? 1 : 0;
+
+        // Descriptors and byte counts legitimately differ between runs. Only a
+        // change between success and failure is interesting.
+        if (is_error(record.op, result) != is_error(record.op, record.result))
+            ++mismatches;
+    }
+
+    if (ctx)
+    {
+        player.close_dir();
+        player.close_files();
+        ismb_disconnect(ctx);
+        ismb_destroy_context(ctx);
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - started_at).count();
+
+    std::printf("%s %lld calls", opts.dry_run ? "recorded" : "replayed", static_cast<long long>(total));
+
+    if (!opts.dry_run)
+        std::printf(" in %lld ms, %lld with a different outcome", static_cast<long long>(elapsed), static_cast<long long>(mismatches));
+
+    std::printf("\n\n%-14s %10s %8s %12s %12s %12s %12s\n", "operation", "count", "errors", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+
+    for (auto& [op, stats] : statistics)
+    {
+        auto& durations = stats.durations_ns;
+        std::sort(std::begin(durations), std::end(durations));
+
+        std::printf("%-14s %10zu %8lld %12.1f %12.1f %12.1f %12.1f\n",
+                    irods::smb::trace_op_name(op),
+                    durations.size(),
+                    static_cast<long long>(stats.errors),
+                    percentile(durations, 0.50),
+                    percentile(durations, 0.90),
+                    percentile(durations, 0.99),
+                    percentile(durations, 1.0));
+    }
+
+    return 0;
+}
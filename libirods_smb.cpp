@@ -1,11 +1,32 @@
 #include "libirods_smb.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <irods/objStat.h>
 #include <irods/openCollection.h>
@@ -14,11 +35,30 @@
 #include <irods/collection.hpp>
 #include <irods/miscUtil.h>
 #include <irods/rmColl.h>
+#include <irods/dataObjCopy.h>
+#include <irods/dataObjRead.h>
+#include <irods/dataObjLseek.h>
+#include <irods/dataObjRename.h>
+#include <irods/dataObjGet.h>
+#include <irods/dataObjTruncate.h>
+#include <irods/modAVUMetadata.h>
+#include <irods/oprComplete.h>
+
+#include <openssl/evp.h>
 
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 
+#include "block_cache.hpp"
+#include "case_fold.hpp"
+#include "inode_snapshot.hpp"
 #include "irods_query.hpp"
+#include "query_cache.hpp"
+#include "query_columns.hpp"
+#include "rpc_scheduler.hpp"
+#include "shared_attribute_cache.hpp"
+#include "span_trace.hpp"
+#include "trace.hpp"
 
 namespace
 {
@@ -44,11 +84,30 @@ namespace
             return true;
         }
 
+        // Consulted before a new value is assigned, so that paths keep the values
+        // handed out by earlier processes. _resolver returns zero for unknown paths.
+        // Values below _first_free are never assigned by counting.
+        void set_resolver(std::function<integral_type(const path_type&)> _resolver, integral_type _first_free)
+        {
+            resolver_ = std::move(_resolver);
+            counter_ = std::max(counter_, _first_free - 1);
+        }
+
         integral_type insert(const path_type& _absolute_path)
         {
             if (auto iter = ints_.find(_absolute_path); iter != std::end(ints_))
                 return iter->second;
 
+            if (resolver_)
+            {
+                if (const auto i = resolver_(_absolute_path); i > 0 && paths_.find(i) == std::end(paths_))
+                {
+                    ints_[_absolute_path] = i;
+                    paths_[i] = _absolute_path;
+                    return i;
+                }
+            }
+
             ints_[_absolute_path] = ++counter_;
             paths_[counter_] = _absolute_path;
 
@@ -59,8 +118,52 @@ namespace
         {
             if (auto iter = ints_.find(_absolute_path); iter != std::end(ints_))
             {
+                paths_.erase(iter->second);
                 ints_.erase(iter);
+            }
+        }
+
+        void erase_descendants(const path_type& _absolute_path)
+        {
+            const auto prefix = _absolute_path + '/';
+
+            for (auto iter = ints_.lower_bound(prefix);
+                 iter != std::end(ints_) && boost::starts_with(iter->first, prefix);)
+            {
                 paths_.erase(iter->second);
+                iter = ints_.erase(iter);
+            }
+        }
+
+        // Moves _old_path and every path below it to _new_path. The integral values
+        // are preserved so that inode numbers and descriptors remain stable.
+        void rename(const path_type& _old_path, const path_type& _new_path)
+        {
+            std::vector<std::pair<path_type, integral_type>> moved;
+
+            const auto move_entry = [this, &moved, &_old_path, &_new_path](auto _iter) {
+                auto new_path = _new_path + _iter->first.substr(_old_path.size());
+                paths_.erase(_iter->second);
+                moved.emplace_back(std::move(new_path), _iter->second);
+                return ints_.erase(_iter);
+            };
+
+            if (auto iter = ints_.find(_old_path); iter != std::end(ints_))
+                move_entry(iter);
+
+            const auto prefix = _old_path + '/';
+
+            for (auto iter = ints_.lower_bound(prefix);
+                 iter != std::end(ints_) && boost::starts_with(iter->first, prefix);)
+            {
+                iter = move_entry(iter);
+            }
+
+            for (auto& [path, i] : moved)
+            {
+                erase(path); // The target may have been overwritten.
+                ints_[path] = i;
+                paths_[i] = std::move(path);
             }
         }
 
@@ -74,588 +177,5489 @@ namespace
             return paths_.at(_i);
         }
 
+        integral_type next_free() const noexcept
+        {
+            return counter_ + 1;
+        }
+
+        template <typename Function>
+        void for_each(Function _func) const
+        {
+            for (const auto& [path, i] : ints_)
+                _func(path, i);
+        }
+
     private:
         integral_type counter_{};
+        std::function<integral_type(const path_type&)> resolver_;
         // TODO Could replace these with a bimap of some type (maybe boost::bimap?).
         std::map<path_type, integral_type> ints_;
         std::map<integral_type, path_type> paths_;
     };
 
-    auto get_root_path(const rodsEnv& _env) -> std::string;
-    auto filename(const std::string& _path) -> std::string;
-    auto list(rcComm_t* _conn, const std::string& _path) -> std::vector<std::string>;
-}
-
-struct irods_context_t
-{
-    rodsEnv env;
-    rcComm_t* conn;
-    std::string smb_path;
-    std::string cwd;
-    integral_bimap<std::int64_t> fsys;
-    integral_bimap<std::int64_t> fd;
-    std::unique_ptr<irods_collection_stream> dir;
-    dirent dir_entry;
-    error_code read_coll_ec;
-};
+    // Attribute name and value pairs of an object's AVU metadata.
+    using avu_list = std::vector<std::pair<std::string, std::string>>;
 
-auto ismb_test() -> error_code
-{
-    std::cout << "ismb_test :: fetching irods environment ...\n";
+    // Short-lived cache of stat results keyed by absolute logical path. Entries
+    // expire after the TTL or are invalidated explicitly by mutating operations.
+    class attribute_cache
+    {
+    public:
+        using path_type  = std::string;
+        using clock_type = std::chrono::steady_clock;
 
-    rodsEnv env;
-    auto status = getRodsEnv(&env);
+        explicit attribute_cache(std::chrono::milliseconds _ttl = {})
+            : ttl_{_ttl}
+        {
+        }
 
-    if (status < 0)
-    {
-        std::cout << "ismb_test :: environment retrieval error.\n";
-        return 1;
-    }
+        void set_ttl(std::chrono::milliseconds _ttl)
+        {
+            ttl_ = _ttl;
 
-    std::cout << "ismb_test :: connecting to iRODS server ...\n";
-    rErrMsg_t errors;
-    auto* conn = rcConnect(env.rodsHost,
-                           env.rodsPort,
-                           env.rodsUserName,
-                           env.rodsZone,
-                           0,
-                           &errors);
+            if (ttl_.count() <= 0)
+            {
+                entries_.clear();
+                avus_.clear();
+                avu_prefetch_skipped_.clear();
+            }
+        }
 
-    if (!conn)
-    {
-        std::cout << "ismb_test :: connection error.\n";
-        return 1;
-    }
+        // Backs this cache with a segment shared by every process on the host.
+        // _key_prefix must identify the iRODS user so that entries are only
+        // shared between sessions with the same permissions.
+        bool attach_shared(const std::string& _name, std::uint32_t _capacity, const std::string& _key_prefix)
+        {
+            auto shared = std::make_unique<irods::smb::shared_attribute_cache>();
 
-    std::cout << "ismb_test :: logging in ...\n";
-    //status = clientLogin(conn);
-    char password[] = "rods";
-    status = clientLoginWithPassword(conn, password);
+            if (!shared->attach(_name, _capacity))
+                return false;
 
-    if (status != 0)
-    {
-        std::cout << "ismb_test :: login error.\n";
-        return 1;
-    }
+            shared_ = std::move(shared);
+            shared_key_prefix_ = _key_prefix;
 
-    std::cout << "ismb_test :: disconnecting ...\n";
-    rcDisconnect(conn);
+            return true;
+        }
 
-    std::cout << "ismb_test :: done.\n";
+        bool lookup(const path_type& _absolute_path, irods_stat_info& _stat_info)
+        {
+            auto iter = entries_.find(_absolute_path);
 
-    return 0;
-}
+            if (iter == std::end(entries_))
+            {
+                if (shared_ && ttl_.count() > 0 && shared_->lookup(shared_key(_absolute_path), _stat_info))
+                {
+                    entries_[_absolute_path] = {_stat_info, clock_type::now() + ttl_};
+                    return true;
+                }
 
-auto ismb_create_context(const char* _smb_path) -> irods_context*
-{
-    auto* ctx = new irods_context{};
-    ctx->smb_path = boost::filesystem::path{_smb_path}.generic_string();
-    std::cout << __func__ << " :: samba share path = " << _smb_path << '\n';
-    return ctx;
-}
+                return false;
+            }
 
-auto ismb_destroy_context(irods_context* _ctx) -> void
-{
-    delete _ctx;
-}
+            if (clock_type::now() >= iter->second.expires_at)
+            {
+                entries_.erase(iter);
+                return false;
+            }
 
-auto ismb_connect(irods_context* _ctx) -> error_code
-{
-    /*
-    using namespace irods::experimental;
+            _stat_info = iter->second.stat_info;
 
-    static bool init_logging = true;
+            return true;
+        }
 
-    if (init_logging)
-    {
-        init_logging = false;
-        log::init();
-        log::server::set_level(log::level::debug);
-    }
+        void insert(const path_type& _absolute_path, const irods_stat_info& _stat_info)
+        {
+            if (ttl_.count() <= 0)
+                return;
 
-    log::debug("loading environment ...");
-    */
+            entries_[_absolute_path] = {_stat_info, clock_type::now() + ttl_};
 
-    //irods::dynamic_cast_hack();
+            if (shared_)
+                shared_->insert(shared_key(_absolute_path), _stat_info, ttl_);
+        }
 
-    auto status = getRodsEnv(&_ctx->env);
+        // Calls _func(path, stat_info) for every entry that has not expired.
+        template <typename Function>
+        void for_each(Function _func) const
+        {
+            const auto now = clock_type::now();
 
-    if (status < 0)
-        return 1;
+            for (const auto& [path, e] : entries_)
+            {
+                if (now < e.expires_at)
+                    _func(path, e.stat_info);
+            }
+        }
 
-    //auto& api_tbl = irods::get_client_api_table();
-    //auto& pk_tbl = irods::get_pack_table();
-    //init_api_table(api_tbl, pk_tbl);
+        // Entries are otherwise only dropped when looked up after they expired.
+        void erase_expired()
+        {
+            const auto now = clock_type::now();
 
-    //log::debug("connecting to iRODS server ...");
+            for (auto iter = std::begin(entries_); iter != std::end(entries_);)
+                iter = (now >= iter->second.expires_at) ? entries_.erase(iter) : std::next(iter);
+        }
 
-    rErrMsg_t errors;
-    _ctx->conn = rcConnect(_ctx->env.rodsHost,
-                           _ctx->env.rodsPort,
-                           _ctx->env.rodsUserName,
-                           _ctx->env.rodsZone,
-                           0, //NO_RECONN,
-                           &errors);
+        // Changes whenever entries are invalidated. Lets producers of entries that
+        // were computed elsewhere detect that they may be stale.
+        auto generation() const noexcept -> std::uint64_t
+        {
+            return generation_;
+        }
 
-    if (!_ctx->conn)
-        return 1;
+        // Returns true if entries at or below _collection may have been
+        // invalidated since generation() returned _generation.
+        auto changed_since(const path_type& _collection, std::uint64_t _generation) const -> bool
+        {
+            if (_generation < touched_floor_)
+                return true;
 
-    //log::debug("logging into iRODS server ...");
+            const auto newer = [_generation](const auto& _iter) {
+                return _iter->second.generation > _generation;
+            };
 
-    //status = clientLogin(_ctx->conn);
-    char password[] = "rods";
-    status = clientLoginWithPassword(_ctx->conn, password);
+            if (auto iter = touched_.find(_collection); iter != std::end(touched_) && newer(iter))
+                return true;
 
-    if (status != 0)
-    {
-        _ctx->conn = nullptr;
-        return 1;
-    }
+            const auto prefix = _collection + '/';
 
-    _ctx->cwd = get_root_path(_ctx->env);
-    _ctx->fsys.insert(_ctx->cwd);
+            for (auto iter = touched_.lower_bound(prefix); iter != std::end(touched_) && boost::starts_with(iter->first, prefix); ++iter)
+            {
+                if (newer(iter))
+                    return true;
+            }
 
-    //log::debug("login successful.");
+            // Subtrees dropped above the collection (e.g. by a rename).
+            for (auto path = parent_of(_collection); !path.empty(); path = parent_of(path))
+            {
+                if (auto iter = touched_.find(path); iter != std::end(touched_) && iter->second.subtree && newer(iter))
+                    return true;
+            }
 
-    return 0;
-}
+            return false;
+        }
 
-auto ismb_disconnect(irods_context* _ctx) -> error_code
-{
-    //log::debug("disconnecting from iRODS server ...");
-    rcDisconnect(_ctx->conn);
-    //log::debug("disconnection successful.");
-    return 0;
-}
+        void erase(const path_type& _absolute_path)
+        {
+            ++generation_;
+            touch(parent_of(_absolute_path), false);
+            entries_.erase(_absolute_path);
+            avus_.erase(_absolute_path);
 
-auto ismb_stat(irods_context* _ctx, const char* _path, irods_stat_info* _stat_info) -> error_code
-{
-    std::cout << __func__ << " :: _path (dirty)  = " << _path << '\n';
+            if (shared_)
+                shared_->erase(shared_key(_absolute_path));
+        }
 
-    namespace fs = boost::filesystem;
+        // AVUs (exposed as extended attributes) live next to the stat results and
+        // share their TTL and invalidation. They are process-local only.
+        bool lookup_avus(const path_type& _absolute_path, avu_list& _avus)
+        {
+            auto iter = avus_.find(_absolute_path);
 
-    std::string abs_path;
+            if (iter == std::end(avus_))
+                return false;
 
-    if (!_path || std::strcmp(_path, ".") == 0)
-    {
-        abs_path = get_root_path(_ctx->env);
-    }
-    else if (boost::starts_with(_path, "./"))
-    {
-        abs_path = _path;
-        boost::replace_first(abs_path, "./", _ctx->cwd + '/');
-    }
-    else if (boost::starts_with(_path, "/"))
-    {
-        abs_path = _path;
-        boost::replace_first(abs_path, "/", get_root_path(_ctx->env) + '/');
-    }
-    else
-    {
-        abs_path = _ctx->cwd;
-        abs_path += '/';
-        abs_path += _path;
-    }
+            if (clock_type::now() >= iter->second.expires_at)
+            {
+                avus_.erase(iter);
+                return false;
+            }
 
-    boost::replace_first(abs_path, _ctx->smb_path, ""); // Remove the samba share root.
+            _avus = iter->second.avus;
 
-    rodsObjStat_t* stat_info_ptr{};
-    dataObjInp_t data_obj_input{};
+            return true;
+        }
 
-    std::strncpy(data_obj_input.objPath, abs_path.c_str(), abs_path.length());
-    std::cout << __func__ << " :: data_obj_input.objPath = " << data_obj_input.objPath << '\n';
+        bool enabled() const noexcept
+        {
+            return ttl_.count() > 0;
+        }
 
-    if (auto ec = rcObjStat(_ctx->conn, &data_obj_input, &stat_info_ptr); ec < 0)
-        return ec;
+        void insert_avus(const path_type& _absolute_path, avu_list _avus)
+        {
+            if (ttl_.count() <= 0)
+                return;
 
-    std::cout << std::boolalpha;
-    std::cout << "found stat info: " << (stat_info_ptr != nullptr) << '\n';
+            const auto now = clock_type::now();
 
-    if (stat_info_ptr)
-    {
-#if 0
-        std::cout << "\nstat results for [" << _path << "]\n";
-        std::cout << "- object size = " << stat_info_ptr->objSize << '\n';
-        std::cout << "- object type = " << stat_info_ptr->objType << '\n';
-        std::cout << "- data mode   = " << stat_info_ptr->dataMode << '\n';
-        std::cout << "- data id     = " << stat_info_ptr->dataId << '\n';
-        std::cout << "- checksum    = " << stat_info_ptr->chksum << '\n';
-        std::cout << "- owner name  = " << stat_info_ptr->ownerName << '\n';
-        std::cout << "- owner zone  = " << stat_info_ptr->ownerZone << '\n';
-        std::cout << "- create time = " << stat_info_ptr->createTime << '\n';
-        std::cout << "- modify time = " << stat_info_ptr->modifyTime << '\n';
-        std::cout << "- resc. hier  = " << stat_info_ptr->rescHier << '\n';
-        std::cout << '\n';
-#endif
+            // When full, new lists are only cached once older ones expire.
+            if (avus_.size() >= max_avu_entries && avus_.find(_absolute_path) == std::end(avus_))
+            {
+                for (auto iter = std::begin(avus_); iter != std::end(avus_);)
+                    iter = (now >= iter->second.expires_at) ? avus_.erase(iter) : std::next(iter);
 
-        _ctx->fsys.insert(data_obj_input.objPath);
+                if (avus_.size() >= max_avu_entries)
+                    return;
+            }
 
-        std::memset(_stat_info, 0, sizeof(irods_stat_info));
+            avus_[_absolute_path] = {std::move(_avus), now + ttl_};
+        }
 
-        _stat_info->size = stat_info_ptr->objSize;
-        _stat_info->type = stat_info_ptr->objType;
-        _stat_info->mode = static_cast<int>(stat_info_ptr->dataMode);
-        _stat_info->id = _ctx->fsys.insert(data_obj_input.objPath);
-        std::strncpy(_stat_info->owner_name, stat_info_ptr->ownerName, strlen(stat_info_ptr->ownerName));
-        std::strncpy(_stat_info->owner_zone, stat_info_ptr->ownerZone, strlen(stat_info_ptr->ownerZone));
-        _stat_info->creation_time = std::stoll(stat_info_ptr->createTime);
-        _stat_info->modified_time = std::stoll(stat_info_ptr->modifyTime);
+        // Collections with too many rows to prefetch the AVUs of. Misses in them
+        // go straight to the single object for the TTL.
+        void skip_avu_prefetch(const path_type& _collection)
+        {
+            if (ttl_.count() <= 0)
+                return;
 
-        freeRodsObjStat(stat_info_ptr);
-    }
+            const auto now = clock_type::now();
 
-    return 0;
-}
+            if (avu_prefetch_skipped_.size() >= max_avu_prefetch_skipped)
+            {
+                for (auto iter = std::begin(avu_prefetch_skipped_); iter != std::end(avu_prefetch_skipped_);)
+                    iter = (now >= iter->second) ? avu_prefetch_skipped_.erase(iter) : std::next(iter);
 
-auto ismb_list(irods_context* _ctx, const char* _path, irods_string_array* _entries) -> void
-{
-    std::cout << __func__ << " :: _path = " << _path << '\n';
-    
-    auto entries = list(_ctx->conn, _path);
+                if (avu_prefetch_skipped_.size() >= max_avu_prefetch_skipped)
+                    return;
+            }
 
-    if (entries.empty())
-        return;
+            avu_prefetch_skipped_[_collection] = now + ttl_;
+        }
 
-    _entries->strings = new irods_char_array[entries.size()];
-    _entries->size = static_cast<long>(entries.size());
-    
-    using size_type = std::vector<std::string>::size_type;
+        bool avu_prefetch_skipped(const path_type& _collection)
+        {
+            auto iter = avu_prefetch_skipped_.find(_collection);
 
-    for (size_type i = 0; i < entries.size(); ++i)
-    {
-        auto& entry = _entries->strings[i];
-        entry.data = new char[entries[i].length() + 1] {};
-        entry.length = entries[i].length();
-        std::strncpy(entry.data, entries[i].c_str(), entries[i].length());
-    }
-}
+            if (iter == std::end(avu_prefetch_skipped_))
+                return false;
 
-auto ismb_free_string_array(irods_string_array* _string_array) -> void
-{
-    using index_type = decltype(_string_array->size);
+            if (clock_type::now() >= iter->second)
+            {
+                avu_prefetch_skipped_.erase(iter);
+                return false;
+            }
 
-    for (index_type i = 0; i < _string_array->size; ++i)
-        delete[] _string_array->strings[i].data;
+            return true;
+        }
 
-    delete[] _string_array->strings;
-}
+        void rename(const path_type& _old_path, const path_type& _new_path)
+        {
+            ++generation_;
+            touch(parent_of(_old_path), false);
+            auto node = entries_.extract(_old_path);
+            avus_.erase(_old_path);
 
-auto ismb_free_string(const char* _string) -> void
-{
-    delete[] _string;
-}
+            // Only the object itself can be carried over. Descendants of a renamed
+            // collection are dropped and will be re-fetched on demand. Data objects
+            // have none.
+            const bool data_object = node && node.mapped().stat_info.type == IOT_DATA_OBJECT;
 
-auto ismb_chdir(irods_context* _ctx, const char* _target_dir) -> error_code
-{
-    std::cout << __func__ << " :: _target_dir    = " << _target_dir << '\n';
-    std::cout << __func__ << " :: _ctx->smb_path = " << _ctx->smb_path << '\n';
+            if (!data_object)
+                erase_descendants(_old_path);
 
-    using namespace std::string_literals;
+            erase(_new_path);
 
-    if (_target_dir == "/"s || _target_dir == _ctx->smb_path)
-    {
-        _ctx->cwd = get_root_path(_ctx->env);
-        return 0;
-    }
+            if (!data_object)
+                erase_descendants(_new_path);
+
+            if (node)
+            {
+                node.key() = _new_path;
+                entries_.insert(std::move(node));
+            }
+
+            if (shared_)
+            {
+                shared_->erase(shared_key(_old_path));
+                shared_->erase(shared_key(_new_path));
+            }
+        }
+
+        void erase_descendants(const path_type& _absolute_path)
+        {
+            ++generation_;
+            touch(_absolute_path, true);
+            const auto prefix = _absolute_path + '/';
+
+            erase_prefix(entries_, prefix);
+            erase_prefix(avus_, prefix);
+
+            if (shared_)
+                shared_->clear_below(_absolute_path);
+        }
+
+    private:
+        struct entry
+        {
+            irods_stat_info stat_info;
+            clock_type::time_point expires_at;
+        };
+
+        struct avu_entry
+        {
+            avu_list avus;
+            clock_type::time_point expires_at;
+        };
+
+        // The last invalidation in a collection. subtree is set when entries
+        // below it were dropped as well.
+        struct touched_collection
+        {
+            std::uint64_t generation;
+            bool subtree;
+        };
+
+        static constexpr std::size_t max_touched = 4096;
+        static constexpr std::size_t max_avu_entries = 16384;
+        static constexpr std::size_t max_avu_prefetch_skipped = 1024;
+
+        static auto parent_of(const path_type& _path) -> path_type
+        {
+            const auto pos = _path.find_last_of('/');
+
+            if (pos == path_type::npos || _path == "/")
+                return {};
+
+            return _path.substr(0, std::max<std::size_t>(pos, 1));
+        }
+
+        auto touch(const path_type& _collection, bool _subtree) -> void
+        {
+            if (_collection.empty())
+                return;
+
+            // Forgetting is safe. Everything older than the floor counts as changed.
+            if (touched_.size() >= max_touched && touched_.find(_collection) == std::end(touched_))
+            {
+                touched_.clear();
+                touched_floor_ = generation_;
+            }
+
+            auto& t = touched_[_collection];
+            t.generation = generation_;
+            t.subtree = t.subtree || _subtree;
+        }
+
+        auto shared_key(const path_type& _absolute_path) const -> std::string
+        {
+            return shared_key_prefix_ + _absolute_path;
+        }
+
+        template <typename Map>
+        static auto erase_prefix(Map& _map, const path_type& _prefix) -> void
+        {
+            auto first = _map.lower_bound(_prefix);
+            auto last = first;
+
+            while (last != std::end(_map) && boost::starts_with(last->first, _prefix))
+                ++last;
+
+            _map.erase(first, last);
+        }
+
+        std::chrono::milliseconds ttl_;
+        std::map<path_type, entry> entries_;
+        std::map<path_type, avu_entry> avus_;
+        std::map<path_type, clock_type::time_point> avu_prefetch_skipped_;
+        std::uint64_t generation_ = 0;
+        std::map<path_type, touched_collection> touched_;
+        std::uint64_t touched_floor_ = 0;
+        std::unique_ptr<irods::smb::shared_attribute_cache> shared_;
+        std::string shared_key_prefix_;
+    };
+
+    // Incremental SHA-256 over the bytes passing through the write path. OpenSSL
+    // selects the fastest implementation for the CPU (SHA-NI, AVX2, NEON, ...).
+    class sha256
+    {
+    public:
+        sha256()
+            : ctx_{EVP_MD_CTX_new(), &EVP_MD_CTX_free}
+        {
+            if (!ctx_ || EVP_DigestInit_ex(ctx_.get(), EVP_sha256(), nullptr) != 1)
+                throw std::runtime_error{"sha256: digest initialization failed"};
+        }
+
+        void update(const void* _data, std::size_t _size)
+        {
+            EVP_DigestUpdate(ctx_.get(), _data, _size);
+        }
+
+        // Returns the digest in the format iRODS stores in the catalog
+        // (i.e. "sha2:" followed by the base64 encoded digest).
+        auto finalize() -> std::string
+        {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digest_size = 0;
+            EVP_DigestFinal_ex(ctx_.get(), digest, &digest_size);
+
+            unsigned char encoded[2 * EVP_MAX_MD_SIZE];
+            const auto encoded_size = EVP_EncodeBlock(encoded, digest, static_cast<int>(digest_size));
+
+            return "sha2:" + std::string(reinterpret_cast<char*>(encoded), static_cast<std::size_t>(encoded_size));
+        }
+
+    private:
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx_;
+    };
+
+    struct options
+    {
+        bool streaming_checksum = false;
+        std::uint32_t shared_attribute_cache_size = 16384;
+        std::string shared_attribute_cache_name;
+        std::string block_cache_directory;
+        std::int64_t block_cache_block_size = 1024 * 1024;
+        std::int64_t block_cache_size = 10LL * 1024 * 1024 * 1024;
+        std::int64_t inline_read_size = 0;
+        std::chrono::milliseconds deferred_close{0};
+        bool replica_routing = false;
+        std::chrono::milliseconds usage_cache_ttl = std::chrono::seconds{60};
+        long long volume_size = 1LL << 50;
+        int prefetch_children = 0;
+        int prefetch_max_rows = 10000;
+        std::string snapshot_file;
+        std::chrono::milliseconds snapshot_interval = std::chrono::minutes{5};
+        std::string trace_file;
+        int transfer_chunk_size = 4 * 1024 * 1024;
+    };
+
+    // Aggregate usage (total bytes and object count) of a collection tree or a
+    // resource, as computed by the catalog.
+    struct usage_info
+    {
+        long long bytes;
+        long long objects;
+    };
+
+    // Caches usage aggregates so that frequent free-space checks do not turn into
+    // catalog queries. Keys are prefixed by their kind (e.g. "coll:", "resc:").
+    class usage_cache
+    {
+    public:
+        using clock_type = std::chrono::steady_clock;
+
+        auto lookup(const std::string& _key, usage_info& _usage) const -> bool
+        {
+            auto iter = entries_.find(_key);
+
+            if (iter == std::end(entries_) || clock_type::now() >= iter->second.second)
+                return false;
+
+            _usage = iter->second.first;
+
+            return true;
+        }
+
+        void insert(const std::string& _key, const usage_info& _usage, std::chrono::milliseconds _ttl)
+        {
+            if (_ttl.count() > 0)
+                entries_[_key] = {_usage, clock_type::now() + _ttl};
+        }
+
+    private:
+        std::map<std::string, std::pair<usage_info, clock_type::time_point>> entries_;
+    };
+
+    // Case-folded names of the entries of recently listed collections. SMB names
+    // are case-insensitive while iRODS names are not.
+    class name_index
+    {
+    public:
+        using clock_type = std::chrono::steady_clock;
+
+        // Returns nullptr if the collection has no usable index. Otherwise, returns
+        // the index mapping folded names to real names.
+        auto find(const std::string& _collection) -> const std::unordered_map<std::string, std::string>*
+        {
+            auto iter = collections_.find(_collection);
+
+            if (iter == std::end(collections_))
+                return nullptr;
+
+            if (clock_type::now() - iter->second.built_at >= ttl)
+            {
+                collections_.erase(iter);
+                return nullptr;
+            }
+
+            return &iter->second.names;
+        }
+
+        template <typename Range>
+        void build(const std::string& _collection, const Range& _names)
+        {
+            if (collections_.size() >= max_collections)
+            {
+                auto oldest = std::min_element(std::begin(collections_), std::end(collections_), [](auto& _a, auto& _b) {
+                    return _a.second.built_at < _b.second.built_at;
+                });
+
+                collections_.erase(oldest);
+            }
+
+            auto& index = collections_[_collection];
+            index.built_at = clock_type::now();
+            index.names.clear();
+
+            for (const auto& name : _names)
+                index.names.emplace(irods::smb::case_fold(name), name);
+        }
+
+        void insert(const std::string& _absolute_path)
+        {
+            const auto [collection, name] = split(_absolute_path);
+
+            if (auto iter = collections_.find(collection); iter != std::end(collections_))
+                iter->second.names.emplace(irods::smb::case_fold(name), name);
+        }
+
+        void erase(const std::string& _absolute_path)
+        {
+            const auto [collection, name] = split(_absolute_path);
+
+            auto iter = collections_.find(collection);
+
+            if (iter == std::end(collections_))
+                return;
+
+            auto& names = iter->second.names;
+
+            if (auto name_iter = names.find(irods::smb::case_fold(name)); name_iter != std::end(names))
+            {
+                // Another name may fold to the same key. Rebuild rather than guess.
+                if (name_iter->second == name)
+                    names.erase(name_iter);
+                else
+                    collections_.erase(iter);
+            }
+        }
+
+        // Drops the index of the collection and of every collection below it.
+        void erase_collection(const std::string& _collection)
+        {
+            collections_.erase(_collection);
+
+            const auto prefix = _collection + '/';
+
+            for (auto iter = collections_.lower_bound(prefix);
+                 iter != std::end(collections_) && boost::starts_with(iter->first, prefix);)
+            {
+                iter = collections_.erase(iter);
+            }
+        }
+
+    private:
+        static constexpr auto ttl = std::chrono::seconds{30};
+        static constexpr std::size_t max_collections = 256;
+
+        struct collection
+        {
+            clock_type::time_point built_at;
+            std::unordered_map<std::string, std::string> names;
+        };
+
+        static auto split(const std::string& _absolute_path) -> std::pair<std::string, std::string>
+        {
+            const auto pos = _absolute_path.find_last_of('/');
+
+            if (pos == std::string::npos)
+                return {"", _absolute_path};
+
+            return {_absolute_path.substr(0, std::max<std::size_t>(pos, 1)), _absolute_path.substr(pos + 1)};
+        }
+
+        std::map<std::string, collection> collections_;
+    };
+
+    // A good replica of a data object.
+    struct replica_info
+    {
+        std::string data_id;
+        int replica_number;
+        std::string modify_time;
+        std::string resource;
+        std::int64_t size;
+        std::string checksum;
+    };
+
+    // Moving estimates of how quickly each resource serves requests, learned from
+    // the reads and writes the library performs anyway.
+    class resource_statistics
+    {
+    public:
+        void record(const std::string& _resource, std::int64_t _bytes, std::chrono::nanoseconds _elapsed)
+        {
+            using seconds = std::chrono::duration<double>;
+
+            if (_resource.empty() || _elapsed.count() <= 0)
+                return;
+
+            auto& s = stats_[_resource];
+            const auto elapsed = std::chrono::duration_cast<seconds>(_elapsed).count();
+
+            // Small requests are dominated by latency, large ones by throughput.
+            if (_bytes <= latency_sample_limit)
+                s.latency = (s.latency < 0) ? elapsed : alpha * elapsed + (1 - alpha) * s.latency;
+            else
+            {
+                const auto throughput = static_cast<double>(_bytes) / elapsed;
+                s.throughput = (s.throughput < 0) ? throughput : alpha * throughput + (1 - alpha) * s.throughput;
+            }
+        }
+
+        // Returns the expected time in seconds to read _bytes from _resource, or a
+        // negative value if nothing is known about it yet.
+        auto estimate(const std::string& _resource, std::int64_t _bytes) const -> double
+        {
+            auto iter = stats_.find(_resource);
+
+            if (iter == std::end(stats_))
+                return -1;
+
+            const auto& s = iter->second;
+
+            if (s.latency < 0 && s.throughput < 0)
+                return -1;
+
+            const auto latency = std::max(0.0, s.latency);
+
+            if (s.throughput <= 0)
+                return latency;
+
+            return latency + static_cast<double>(_bytes) / s.throughput;
+        }
+
+        auto explore() -> bool
+        {
+            return ++selections_ % exploration_interval == 0;
+        }
+
+    private:
+        static constexpr double alpha = 0.2;
+        static constexpr std::uint64_t exploration_interval = 32;
+        static constexpr std::int64_t latency_sample_limit = 64 * 1024;
+
+        struct entry
+        {
+            double latency = -1;
+            double throughput = -1;
+        };
+
+        std::map<std::string, entry> stats_;
+        std::uint64_t selections_ = 0;
+    };
+
+    // Library-side state for a descriptor returned by ismb_open.
+    struct descriptor
+    {
+        int open_flags = 0;
+
+        // The iRODS descriptor. Usually the number handed out by ismb_open, but
+        // ismb_ftruncate reopens the object and the server may pick another.
+        int server_fd = -1;
+
+        // The position seen by the SMB client and the position of the iRODS
+        // descriptor. They differ once reads are served from the block cache.
+        std::int64_t offset = 0;
+        std::int64_t server_offset = 0;
+
+        // The size of the object as far as this descriptor knows. -1 if unknown.
+        std::int64_t size = -1;
+
+        // Byte ranges [first, second) written through this descriptor.
+        std::map<std::int64_t, std::int64_t> dirty;
+
+        // Identifies the replica content for read-only descriptors when the block
+        // cache is enabled. Empty otherwise.
+        std::string data_id;
+        int replica_number = -1;
+        std::string modify_time;
+        std::int64_t replica_size = -1;
+        std::string replica_checksum;
+
+        // The root resource the descriptor's replica lives on.
+        std::string resource;
+
+        // The whole object, for small objects fetched at open time. Such
+        // descriptors do not refer to an open iRODS descriptor.
+        std::unique_ptr<std::vector<char>> content;
+
+        // Attributes known without asking the server.
+        std::unique_ptr<irods_stat_info> stat_info;
+
+        // Present while every byte of the object has been written in order
+        // starting at offset zero. checksummed is the number of bytes hashed.
+        std::unique_ptr<sha256> checksum;
+        std::int64_t checksummed = 0;
+    };
+
+    // A read-only iRODS descriptor whose close has been deferred in case the
+    // client opens the same object again.
+    struct parked_descriptor
+    {
+        std::string path;
+        int fd;
+        descriptor desc;
+        std::chrono::steady_clock::time_point expires_at;
+    };
+
+    // Connections that were connected and authenticated before they were needed.
+    //
+    // The pool is meant to be filled by the parent process before it forks. Each
+    // fork hands the oldest connection to the child and removes it from the parent,
+    // so no socket is ever used by two processes.
+    class connection_pool
+    {
+    public:
+        using clock_type = std::chrono::steady_clock;
+
+        static auto instance() -> connection_pool&
+        {
+            // Never destroyed. The refill thread may still run while the process exits.
+            static auto* pool = new connection_pool;
+            return *pool;
+        }
+
+        // Tops the pool up to _size connections and keeps it there. A thread
+        // refills the pool after every fork and replaces connections that have
+        // been idle for too long. Forks wait until it is out of the client
+        // library, so that the child never inherits locks it held (e.g. in
+        // getaddrinfo or OpenSSL).
+        auto fill(const rodsEnv& _env, std::size_t _size) -> error_code;
+
+        // Returns nullptr if no usable connection is available.
+        auto take() -> rcComm_t*
+        {
+            std::lock_guard lock{mutex_};
+
+            while (!conns_.empty())
+            {
+                auto* conn = conns_.front().conn;
+                conns_.pop_front();
+
+                if (usable(conn))
+                    return conn;
+
+                release(conn);
+            }
+
+            return nullptr;
+        }
+
+        // Hands back a connection obtained with take() that is still usable.
+        auto put(rcComm_t* _conn) -> void
+        {
+            std::lock_guard lock{mutex_};
+            conns_.push_back({_conn, clock_type::now()});
+        }
+
+        connection_pool(const connection_pool&) = delete;
+        auto operator=(const connection_pool&) -> connection_pool& = delete;
+
+    private:
+        struct pooled_connection
+        {
+            rcComm_t* conn;
+            clock_type::time_point since;
+        };
+
+        static constexpr auto check_interval = std::chrono::seconds{30};
+        static constexpr auto max_idle = std::chrono::minutes{5};
+
+        connection_pool()
+        {
+            pthread_atfork(&connection_pool::prepare, &connection_pool::parent, &connection_pool::child);
+        }
+
+        // Releases the connection without telling the server. The other process
+        // still owns the session.
+        static auto release(rcComm_t* _conn) -> void
+        {
+            close(_conn->sock);
+            freeRcComm(_conn);
+        }
+
+        // An idle connection has nothing to read. A readable socket means the
+        // server closed it (e.g. an agent or firewall timeout).
+        static auto usable(rcComm_t* _conn) -> bool
+        {
+            pollfd pfd{_conn->sock, POLLIN, 0};
+            return ::poll(&pfd, 1, 0) == 0;
+        }
+
+        auto top_up() -> error_code;
+        auto refill() -> void;
+
+        static auto prepare() -> void
+        {
+            auto& pool = instance();
+            std::unique_lock lock{pool.mutex_};
+            pool.idle_.wait(lock, [&pool] { return pool.busy_ == 0; });
+            lock.release(); // Unlocked by parent() and child().
+        }
+
+        // Callers must hold mutex_.
+        auto leave_client_library() -> void
+        {
+            if (--busy_ == 0)
+                idle_.notify_all();
+        }
+
+        static auto parent() -> void
+        {
+            auto& pool = instance();
+
+            if (!pool.conns_.empty())
+            {
+                release(pool.conns_.front().conn);
+                pool.conns_.pop_front();
+            }
+
+            pool.mutex_.unlock();
+            pool.refill_.notify_one();
+        }
+
+        // The child has no refill thread and must not wait on or notify the
+        // condition variable inherited from the parent.
+        static auto child() -> void
+        {
+            auto& pool = instance();
+
+            while (pool.conns_.size() > 1)
+            {
+                release(pool.conns_.back().conn);
+                pool.conns_.pop_back();
+            }
+
+            pool.target_ = 0;
+            pool.refilling_ = false;
+            pool.busy_ = 0;
+            pool.mutex_.unlock();
+        }
+
+        std::mutex mutex_;
+        std::condition_variable refill_;
+        std::condition_variable idle_;
+        std::deque<pooled_connection> conns_;
+        std::optional<rodsEnv> env_;
+        std::size_t target_ = 0;
+        bool refilling_ = false;
+        std::size_t busy_ = 0; // Threads inside the client library. Forks wait for zero.
+    };
+
+    // True for opens that can never change the object's content. Other flags
+    // (e.g. O_LARGEFILE, O_NOFOLLOW) do not matter.
+    inline auto read_only(int _flags) noexcept -> bool
+    {
+        return (_flags & O_ACCMODE) == O_RDONLY && !(_flags & O_TRUNC);
+    }
+
+    // Descriptors for objects held in memory are allocated from this value up so
+    // that they never collide with iRODS descriptors.
+    constexpr int inline_fd_base = 1 << 24;
+
+    auto open_inline(irods_context& _ctx, dataObjInp_t& _args, const irods_stat_info& _stat_info) -> int;
+    // Returns a descriptor number that the server never hands out.
+    auto allocate_local_fd(irods_context& _ctx) -> int;
+    auto unpark(irods_context& _ctx, const std::string& _path, int _flags) -> int;
+    auto park(irods_context& _ctx, const std::string& _path, int _fd, descriptor&& _desc) -> void;
+    auto close_parked(irods_context& _ctx, const std::string& _path) -> void;
+    auto close_expired_parked(irods_context& _ctx, bool _all = false) -> void;
+    auto load_environment(rodsEnv& _env) -> int;
+    auto lookup_replicas(irods_context& _ctx, const std::string& _abs_path) -> std::vector<replica_info>;
+    auto query_usage(irods_context& _ctx, const std::string& _key, const std::string& _condition) -> std::optional<usage_info>;
+    auto query_free_space(irods_context& _ctx, const std::string& _resource) -> long long;
+    // Calls _func(row) for every row of the query. Results are memoized when the
+    // query cache is enabled. Otherwise, rows are streamed as they arrive.
+    template <typename Function>
+    auto run_query(irods_context& _ctx, const std::string& _sql, Function _func, irods::query::query_type _type = irods::query::GENERAL) -> void;
+    auto fetch_avus(irods_context& _ctx, const std::string& _abs_path, avu_list& _avus) -> error_code;
+    auto prefetch_avus(irods_context& _ctx, const std::string& _collection) -> error_code;
+    auto modify_avu(irods_context& _ctx, const char* _operation, const std::string& _abs_path, const std::string& _name, const std::string& _value) -> error_code;
+    auto select_replica(irods_context& _ctx, const std::vector<replica_info>& _replicas) -> std::optional<replica_info>;
+    auto stat_path(irods_context& _ctx, const std::string& _abs_path, irods_stat_info* _stat_info) -> error_code;
+    auto seek(irods_context& _ctx, descriptor& _desc, std::int64_t _offset) -> error_code;
+    auto read_from_server(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, void* _buffer, int _size) -> int;
+    auto read_through_block_cache(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, void* _buffer, int _size) -> int;
+    auto read_at(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, void* _buffer, int _size) -> int;
+    auto write_at(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, const void* _buffer, int _size) -> int;
+    auto login(rcComm_t* _conn) -> int;
+    auto connect(const rodsEnv& _env) -> rcComm_t*;
+
+    // Stat results and listings fetched ahead of time by the prefetcher.
+    struct prefetch_results
+    {
+        std::string collection;
+        std::uint64_t generation;
+        std::vector<std::pair<std::string, irods_stat_info>> entries;
+        std::vector<std::pair<std::string, std::vector<std::string>>> listings;
+    };
+
+    // Fetches the listings and attributes of the first few child collections of
+    // a collection that was just listed, anticipating that one of them is opened
+    // next. Queries run on a thread of their own using a spare pooled connection
+    // (or one it logs in itself), so foreground requests never wait on them.
+    //
+    // Only one request is pending at a time. A newer listing replaces a request
+    // that has not started. Results are handed back to the session thread, which
+    // applies them to the caches.
+    class prefetcher
+    {
+    public:
+        struct request
+        {
+            std::string collection;
+            int children;
+            int max_rows;
+            std::uint64_t generation;
+        };
+
+        explicit prefetcher(const rodsEnv& _env)
+            : env_{_env}
+        {
+        }
+
+        prefetcher(const prefetcher&) = delete;
+        auto operator=(const prefetcher&) -> prefetcher& = delete;
+
+        ~prefetcher()
+        {
+            {
+                std::lock_guard lock{mutex_};
+                stopping_ = true;
+            }
+
+            cv_.notify_one();
+
+            if (thread_.joinable())
+                thread_.join();
+
+            // A pooled connection is kept warm for other sessions.
+            if (conn_ && pooled_)
+                connection_pool::instance().put(conn_);
+            else if (conn_)
+                rcDisconnect(conn_);
+        }
+
+        auto schedule(request _request) -> void
+        {
+            {
+                std::lock_guard lock{mutex_};
+
+                if (pending_)
+                    ++stats_.dropped;
+
+                pending_ = std::move(_request);
+                ++stats_.scheduled;
+            }
+
+            if (!thread_.joinable())
+                thread_ = std::thread{&prefetcher::run, this};
+
+            cv_.notify_one();
+        }
+
+        auto take_results(std::vector<prefetch_results>& _results) -> bool
+        {
+            std::lock_guard lock{mutex_};
+
+            if (results_.empty())
+                return false;
+
+            _results.swap(results_);
+            results_.clear();
+
+            return true;
+        }
+
+        auto record_hit() -> void
+        {
+            std::lock_guard lock{mutex_};
+            ++stats_.hits;
+        }
+
+        auto record_discarded(long long _entries) -> void
+        {
+            std::lock_guard lock{mutex_};
+            stats_.discarded += _entries;
+        }
+
+        auto statistics() -> irods_prefetch_stats
+        {
+            std::lock_guard lock{mutex_};
+            return stats_;
+        }
+
+    private:
+        auto run() -> void;
+        auto fetch(const request& _request, prefetch_results& _results) -> bool;
+
+        const rodsEnv env_;
+        rcComm_t* conn_ = nullptr;
+        bool pooled_ = false;
+        std::thread thread_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::optional<request> pending_;
+        std::vector<prefetch_results> results_;
+        irods_prefetch_stats stats_{};
+        std::atomic<bool> stopping_{false};
+    };
+
+    auto apply_prefetched(irods_context& _ctx) -> void;
+    auto schedule_prefetch(irods_context& _ctx, const std::string& _collection) -> void;
+
+    struct walk_entry
+    {
+        std::string path;
+        irods_stat_info stat_info;
+    };
+
+    // The data objects of a few collections, or of every collection below one
+    // collection (below is true and there is exactly one collection).
+    struct walk_unit
+    {
+        std::vector<std::string> collections;
+        bool below;
+    };
+
+    // Runs the data object queries of ismb_walk on threads of their own, each
+    // with its own connection. Every page becomes a batch that the session thread
+    // takes with next(). The number of batches waiting is bounded, so a slow
+    // callback throttles the queries instead of piling up results.
+    class walker
+    {
+    public:
+        walker(const rodsEnv& _env, std::vector<walk_unit> _units, int _page_size)
+            : env_{_env}
+            , units_{std::move(_units)}
+            , page_size_{_page_size}
+        {
+        }
+
+        walker(const walker&) = delete;
+        auto operator=(const walker&) -> walker& = delete;
+
+        ~walker()
+        {
+            stop();
+
+            for (auto& t : threads_)
+                t.join();
+        }
+
+        auto start(int _threads) -> void
+        {
+            const auto count = std::min<std::size_t>(static_cast<std::size_t>(_threads), units_.size());
+
+            running_ = static_cast<int>(count);
+
+            for (std::size_t i = 0; i < count; ++i)
+                threads_.emplace_back(&walker::run, this);
+        }
+
+        // Blocks until a batch is ready. Returns false once every query is done.
+        auto next(std::vector<walk_entry>& _batch) -> bool
+        {
+            std::unique_lock lock{mutex_};
+            ready_.wait(lock, [this] { return !batches_.empty() || running_ == 0; });
+
+            if (batches_.empty())
+                return false;
+
+            _batch = std::move(batches_.front());
+            batches_.pop_front();
+            space_.notify_one();
+
+            return true;
+        }
+
+        auto stop() -> void
+        {
+            {
+                std::lock_guard lock{mutex_};
+                stopping_ = true;
+            }
+
+            space_.notify_all();
+        }
+
+        // The first error any query ran into, or zero.
+        auto error() -> int
+        {
+            std::lock_guard lock{mutex_};
+            return ec_;
+        }
+
+    private:
+        static constexpr std::size_t max_batches = 16;
+
+        auto run() -> void;
+        auto fetch(rcComm_t* _conn, const walk_unit& _unit) -> int;
+        auto push(std::vector<walk_entry>&& _batch) -> bool;
+
+        const rodsEnv env_;
+        const std::vector<walk_unit> units_;
+        const int page_size_;
+        std::atomic<std::size_t> next_unit_{0};
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::condition_variable space_;
+        std::deque<std::vector<walk_entry>> batches_;
+        int running_ = 0;
+        bool stopping_ = false;
+        int ec_ = 0;
+    };
+
+    auto make_walk_units(const std::string& _root,
+                         const std::vector<walk_entry>& _collections,
+                         int _max_depth,
+                         std::size_t _target_size) -> std::vector<walk_unit>;
+
+    // What ismb_changes_since saw of a collection at the poll that returned a
+    // cookie. Every watcher follows its own chain of cookies.
+    struct watched_collection
+    {
+        struct entry
+        {
+            irods_object_type type;
+            long long modified_time;
+            long long size; // Tells apart modifications made within the same second.
+        };
+
+        std::string collection;
+        long long watermark = 0; // Latest modify time seen, in seconds.
+        std::chrono::steady_clock::time_point polled_at;
+        std::unordered_map<std::string, entry> entries;
+    };
+
+    // The least recently polled watch is forgotten first. Its next poll asks the
+    // client to list the collection again.
+    constexpr std::size_t max_watched_collections = 256;
+
+    // Calls _func(name, stat_info) for every child of _collection modified at or
+    // after _since (seconds). Data objects appear once per replica, whatever its
+    // status, so that objects being written are not mistaken for deleted ones.
+    auto for_each_modified_child(irods_context& _ctx,
+                                 const std::string& _collection,
+                                 long long _since,
+                                 const std::function<void(std::string_view, const irods_stat_info&)>& _func) -> error_code;
+
+    auto fetch_child_names(irods_context& _ctx,
+                           const std::string& _collection,
+                           std::unordered_map<std::string, irods_object_type>& _names) -> error_code;
+
+    // Writes inode snapshots on a background thread, one at a time. The session
+    // thread only copies the tables.
+    class snapshot_writer
+    {
+    public:
+        snapshot_writer() = default;
+
+        snapshot_writer(const snapshot_writer&) = delete;
+        auto operator=(const snapshot_writer&) -> snapshot_writer& = delete;
+
+        ~snapshot_writer()
+        {
+            wait();
+        }
+
+        // Returns false if the previous snapshot is still being written.
+        auto start(std::string _path, std::vector<irods::smb::inode_snapshot::entry> _entries, std::int64_t _next_inode) -> bool
+        {
+            if (busy_)
+                return false;
+
+            wait();
+            busy_ = true;
+
+            thread_ = std::thread{[this, path = std::move(_path), entries = std::move(_entries), _next_inode]() mutable {
+                if (!irods::smb::inode_snapshot::write(path, std::move(entries), _next_inode))
+                    std::cout << "snapshot_writer :: could not write [" << path << "].\n";
+
+                busy_ = false;
+            }};
+
+            return true;
+        }
+
+        auto wait() -> void
+        {
+            if (thread_.joinable())
+                thread_.join();
+        }
+
+    private:
+        std::thread thread_;
+        std::atomic<bool> busy_{false};
+    };
+
+    auto warm_from_snapshot(irods_context& _ctx, const std::string& _abs_path) -> bool;
+    auto write_snapshot(irods_context& _ctx, bool _force) -> void;
+
+    auto get_root_path(const rodsEnv& _env) -> std::string;
+    auto absolute_path(const irods_context& _ctx, const char* _path) -> std::string;
+    auto filename(const std::string& _path) -> std::string;
+    auto make_stat_info(irods_object_type _type, long long _size, int _mode, std::string_view _owner_name,
+                        std::string_view _owner_zone, long long _ctime, long long _mtime) -> irods_stat_info;
+    // Names packed back to back, each followed by a null terminator.
+    struct name_list
+    {
+        std::string names;
+        std::vector<std::size_t> offsets;
+    };
+
+    auto list(rcComm_t* _conn, const std::string& _path) -> name_list;
+}
+
+struct irods_context_t
+{
+    rodsEnv env;
+    rcComm_t* conn;
+    std::string smb_path;
+    std::string cwd;
+    integral_bimap<std::int64_t> fsys;
+    integral_bimap<std::int64_t> fd;
+    attribute_cache attrs;
+    options opts;
+    std::map<int, descriptor> descriptors;
+    std::unique_ptr<irods::smb::block_cache> blocks;
+    int next_inline_fd = inline_fd_base;
+    std::deque<parked_descriptor> parked;
+    resource_statistics resource_stats;
+    name_index names;
+    usage_cache usage;
+    usage_cache free_space; // Keyed by resource name. Only bytes is used.
+    irods::smb::query_cache queries;
+    std::unique_ptr<prefetcher> prefetch;
+    std::unordered_set<std::string> prefetched_paths;
+    std::string snapshot_path;
+    std::unique_ptr<irods::smb::inode_snapshot> snapshot;
+    std::unordered_set<std::string> snapshot_checked;
+    std::chrono::steady_clock::time_point snapshot_written_at;
+    snapshot_writer snapshot_writes;
+    std::unique_ptr<irods::smb::trace_writer> trace;
+    std::chrono::steady_clock::time_point trace_started_at;
+    irods::smb::rpc_scheduler scheduler;
+    std::map<long long, watched_collection> watched; // Keyed by cookie.
+    long long next_watch_cookie = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::unique_ptr<irods_collection_stream> dir;
+    std::string dir_path;
+    dirent dir_entry;
+    error_code read_coll_ec;
+};
+
+auto ismb_test() -> error_code
+{
+    std::cout << "ismb_test :: fetching irods environment ...\n";
+
+    rodsEnv env;
+    auto status = getRodsEnv(&env);
+
+    if (status < 0)
+    {
+        std::cout << "ismb_test :: environment retrieval error.\n";
+        return 1;
+    }
+
+    std::cout << "ismb_test :: connecting to iRODS server ...\n";
+    rErrMsg_t errors;
+    auto* conn = rcConnect(env.rodsHost,
+                           env.rodsPort,
+                           env.rodsUserName,
+                           env.rodsZone,
+                           0,
+                           &errors);
+
+    if (!conn)
+    {
+        std::cout << "ismb_test :: connection error.\n";
+        return 1;
+    }
+
+    std::cout << "ismb_test :: logging in ...\n";
+
+    if (login(conn) != 0)
+    {
+        std::cout << "ismb_test :: login error.\n";
+        rcDisconnect(conn);
+        return 1;
+    }
+
+    std::cout << "ismb_test :: disconnecting ...\n";
+    rcDisconnect(conn);
+
+    std::cout << "ismb_test :: done.\n";
+
+    return 0;
+}
+
+auto ismb_create_context(const char* _smb_path) -> irods_context*
+{
+    auto* ctx = new irods_context{};
+    ctx->smb_path = boost::filesystem::path{_smb_path}.generic_string();
+    std::cout << __func__ << " :: samba share path = " << _smb_path << '\n';
+    return ctx;
+}
+
+auto ismb_destroy_context(irods_context* _ctx) -> void
+{
+    delete _ctx;
+}
+
+auto ismb_set_option(irods_context* _ctx, irods_option _option, long long _value) -> error_code
+{
+    switch (_option)
+    {
+        case IOPT_ATTRIBUTE_CACHE_TTL:
+            _ctx->attrs.set_ttl(std::chrono::milliseconds{_value});
+            return 0;
+
+        case IOPT_STREAMING_CHECKSUM:
+            _ctx->opts.streaming_checksum = (_value != 0);
+            return 0;
+
+        case IOPT_BLOCK_CACHE_BLOCK_SIZE:
+            if (_value <= 0 || _value > std::numeric_limits<int>::max())
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.block_cache_block_size = _value;
+            return 0;
+
+        case IOPT_BLOCK_CACHE_SIZE:
+            if (_value <= 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.block_cache_size = _value;
+            return 0;
+
+        case IOPT_INLINE_READ_SIZE:
+            if (_value < 0 || _value > MAX_SZ_FOR_SINGLE_BUF)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.inline_read_size = _value;
+            return 0;
+
+        case IOPT_DEFERRED_CLOSE:
+            if (_value < 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.deferred_close = std::chrono::milliseconds{_value};
+            if (_value == 0)
+                close_expired_parked(*_ctx, true);
+            return 0;
+
+        case IOPT_REPLICA_ROUTING:
+            _ctx->opts.replica_routing = (_value != 0);
+            return 0;
+
+        case IOPT_USAGE_CACHE_TTL:
+            if (_value < 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.usage_cache_ttl = std::chrono::milliseconds{_value};
+            return 0;
+
+        case IOPT_VOLUME_SIZE:
+            if (_value <= 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.volume_size = _value;
+            return 0;
+
+        case IOPT_QUERY_CACHE_TTL:
+            if (_value < 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->queries.set_ttl(std::chrono::milliseconds{_value});
+            return 0;
+
+        case IOPT_QUERY_CACHE_SIZE:
+            if (_value < 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->queries.set_capacity(static_cast<std::size_t>(_value));
+            return 0;
+
+        case IOPT_SNAPSHOT_INTERVAL:
+            if (_value <= 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.snapshot_interval = std::chrono::milliseconds{_value};
+            return 0;
+
+        case IOPT_SPAN_BUFFER_SIZE:
+            // Spans are recorded per process, not per context.
+            if (_value < 0 || _value > (1 << 20))
+                return SYS_INVALID_INPUT_PARAM;
+            irods::smb::span_recorder::instance().set_capacity(static_cast<std::size_t>(_value));
+            return 0;
+
+        case IOPT_STARVATION_LIMIT:
+            if (_value <= 0)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->scheduler.set_starvation_limit(std::chrono::milliseconds{_value});
+            return 0;
+
+        case IOPT_TRANSFER_CHUNK_SIZE:
+            // Zero sends every read and write as a single RPC.
+            if (_value < 0 || _value > std::numeric_limits<int>::max())
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.transfer_chunk_size = static_cast<int>(_value);
+            return 0;
+
+        case IOPT_PREFETCH_CHILDREN:
+            if (_value < 0 || _value > 64)
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.prefetch_children = static_cast<int>(_value);
+            return 0;
+
+        case IOPT_PREFETCH_MAX_ROWS:
+            if (_value <= 0 || _value > std::numeric_limits<int>::max())
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.prefetch_max_rows = static_cast<int>(_value);
+            return 0;
+
+        case IOPT_SHARED_ATTRIBUTE_CACHE_SIZE:
+            if (_value <= 0 || _value > std::numeric_limits<std::uint32_t>::max())
+                return SYS_INVALID_INPUT_PARAM;
+            _ctx->opts.shared_attribute_cache_size = static_cast<std::uint32_t>(_value);
+            return 0;
+
+        default:
+            return SYS_INVALID_INPUT_PARAM;
+    }
+}
+
+auto ismb_set_string_option(irods_context* _ctx, irods_option _option, const char* _value) -> error_code
+{
+    if (!_value)
+        return SYS_INVALID_INPUT_PARAM;
+
+    switch (_option)
+    {
+        case IOPT_SHARED_ATTRIBUTE_CACHE:
+            // Attached by ismb_connect once the user is known.
+            _ctx->opts.shared_attribute_cache_name = _value;
+            return 0;
+
+        case IOPT_BLOCK_CACHE_DIRECTORY:
+            // Created by ismb_connect.
+            _ctx->opts.block_cache_directory = _value;
+            return 0;
+
+        case IOPT_TRACE_FILE:
+            // Opened by ismb_connect. The process id is appended to the name.
+            _ctx->opts.trace_file = _value;
+            return 0;
+
+        case IOPT_SNAPSHOT_FILE:
+            // Mapped by ismb_connect. The user and zone are appended to the name.
+            _ctx->opts.snapshot_file = _value;
+            return 0;
+
+        default:
+            return SYS_INVALID_INPUT_PARAM;
+    }
+}
+
+auto ismb_connect(irods_context* _ctx) -> error_code
+{
+    /*
+    using namespace irods::experimental;
+
+    static bool init_logging = true;
+
+    if (init_logging)
+    {
+        init_logging = false;
+        log::init();
+        log::server::set_level(log::level::debug);
+    }
+    */
+
+    //irods::dynamic_cast_hack();
+
+    // The environment is only parsed once per process. Forked children inherit it.
+    if (load_environment(_ctx->env) < 0)
+        return 1;
+
+    // Prefer a connection that was authenticated ahead of time by the parent
+    // process (see ismb_prewarm_connections). Only fall back to a full
+    // connect + login when none is available.
+    _ctx->conn = connection_pool::instance().take();
+
+    if (_ctx->conn)
+    {
+        std::cout << __func__ << " :: using pre-warmed connection.\n";
+    }
+    else if (_ctx->conn = connect(_ctx->env); !_ctx->conn)
+    {
+        return 1;
+    }
+
+    _ctx->cwd = get_root_path(_ctx->env);
+
+    if (const auto& file = _ctx->opts.trace_file; !file.empty())
+    {
+        using namespace std::chrono;
+
+        // Contexts of the same process must not share (and truncate) a file.
+        static std::atomic<int> contexts{0};
+        auto path = file + '.' + std::to_string(getpid());
+
+        if (const auto n = contexts++; n > 0)
+            path += '.' + std::to_string(n);
+
+        const auto now = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+
+        _ctx->trace = std::make_unique<irods::smb::trace_writer>();
+        _ctx->trace_started_at = steady_clock::now();
+
+        if (!_ctx->trace->open(path, now))
+        {
+            std::cout << __func__ << " :: could not open trace file [" << path << "].\n";
+            _ctx->trace.reset();
+        }
+    }
+
+    // Inode numbers handed out by earlier sessions are reused, so they stay
+    // stable across restarts.
+    if (const auto& file = _ctx->opts.snapshot_file; !file.empty())
+    {
+        _ctx->snapshot_path = file + '.' + _ctx->env.rodsUserName + '#' + _ctx->env.rodsZone;
+        _ctx->snapshot = std::make_unique<irods::smb::inode_snapshot>();
+        _ctx->snapshot_written_at = std::chrono::steady_clock::now();
+
+        const auto mapped = _ctx->snapshot->map(_ctx->snapshot_path);
+
+        // Concurrent sessions count from ranges of their own, so that no two of
+        // them give the same number to different paths.
+        auto first_free = irods::smb::inode_snapshot::reserve_inodes(_ctx->snapshot_path, _ctx->snapshot->next_inode());
+
+        if (first_free == 0)
+        {
+            std::cout << __func__ << " :: could not reserve inode numbers in [" << _ctx->snapshot_path << "].\n";
+            first_free = _ctx->snapshot->next_inode();
+        }
+
+        std::function<std::int64_t(const std::string&)> resolver;
+
+        if (mapped)
+        {
+            resolver = [snapshot = _ctx->snapshot.get()](const std::string& _path) -> std::int64_t {
+                const auto* r = snapshot->find(_path);
+                return r ? r->inode : 0;
+            };
+        }
+
+        _ctx->fsys.set_resolver(std::move(resolver), first_free);
+    }
+
+    _ctx->fsys.insert(_ctx->cwd);
+
+    if (const auto& name = _ctx->opts.shared_attribute_cache_name; !name.empty())
+    {
+        auto key_prefix = std::string{_ctx->env.rodsUserName} + '#' + _ctx->env.rodsZone + ':';
+
+        if (!_ctx->attrs.attach_shared(name, _ctx->opts.shared_attribute_cache_size, key_prefix))
+            std::cout << __func__ << " :: could not attach to shared attribute cache [" << name << "].\n";
+    }
+
+    if (const auto& dir = _ctx->opts.block_cache_directory; !dir.empty())
+    {
+        _ctx->blocks = std::make_unique<irods::smb::block_cache>(dir,
+                                                                 _ctx->opts.block_cache_block_size,
+                                                                 _ctx->opts.block_cache_size);
+    }
+
+    return 0;
+}
+
+auto ismb_prewarm_connections(int _count) -> error_code
+{
+    if (_count < 0)
+        return SYS_INVALID_INPUT_PARAM;
+
+    rodsEnv env;
+
+    if (load_environment(env) < 0)
+        return 1;
+
+    return connection_pool::instance().fill(env, static_cast<std::size_t>(_count));
+}
+
+auto ismb_disconnect(irods_context* _ctx) -> error_code
+{
+    //log::debug("disconnecting from iRODS server ...");
+    close_expired_parked(*_ctx, true);
+    _ctx->prefetch.reset();
+    write_snapshot(*_ctx, true);
+    _ctx->snapshot_writes.wait();
+    _ctx->trace.reset();
+    rcDisconnect(_ctx->conn);
+    //log::debug("disconnection successful.");
+    return 0;
+}
+
+static auto ismb_stat_impl(irods_context* _ctx, const char* _path, irods_stat_info* _stat_info) -> error_code
+{
+    std::cout << "ismb_stat :: _path (dirty)  = " << _path << '\n';
+
+    // Sessions that stopped opening files still stat, so parked handles expire here too.
+    close_expired_parked(*_ctx);
+
+    namespace fs = boost::filesystem;
+
+    std::string abs_path;
+
+    if (!_path || std::strcmp(_path, ".") == 0)
+    {
+        abs_path = get_root_path(_ctx->env);
+    }
+    else if (boost::starts_with(_path, "./"))
+    {
+        abs_path = _path;
+        boost::replace_first(abs_path, "./", _ctx->cwd + '/');
+    }
+    else if (boost::starts_with(_path, "/"))
+    {
+        abs_path = _path;
+        boost::replace_first(abs_path, "/", get_root_path(_ctx->env) + '/');
+    }
+    else
+    {
+        abs_path = _ctx->cwd;
+        abs_path += '/';
+        abs_path += _path;
+    }
+
+    boost::replace_first(abs_path, _ctx->smb_path, ""); // Remove the samba share root.
+
+    return stat_path(*_ctx, abs_path, _stat_info);
+}
+
+static auto ismb_list_impl(irods_context* _ctx, const char* _path, irods_string_array* _entries) -> void
+{
+    std::cout << "ismb_list :: _path = " << _path << '\n';
+
+    _entries->strings = nullptr;
+    _entries->size = 0;
+
+    std::string path = _path;
+
+    while (path.size() > 1 && '/' == path.back())
+        path.pop_back();
+
+    name_list entries;
+
+    try
+    {
+        entries = list(_ctx->conn, path);
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "ismb_list :: " << e.what() << '\n';
+        return;
+    }
+
+    // A case-insensitive lookup that follows the listing needs no query of its own.
+    {
+        std::vector<std::string_view> names;
+        names.reserve(entries.offsets.size());
+
+        for (auto offset : entries.offsets)
+            names.emplace_back(entries.names.c_str() + offset);
+
+        _ctx->names.build(path, names);
+    }
+
+    if (entries.offsets.empty())
+        return;
+
+    schedule_prefetch(*_ctx, path);
+
+    // Everything lives in one allocation: the array of irods_char_array followed
+    // by the names. ismb_free_string_array releases it with a single delete.
+    const auto header_size = sizeof(irods_char_array) * entries.offsets.size();
+    auto* arena = new char[header_size + entries.names.size()];
+
+    auto* strings = reinterpret_cast<irods_char_array*>(arena);
+    auto* names = arena + header_size;
+    std::memcpy(names, entries.names.data(), entries.names.size());
+
+    for (std::size_t i = 0; i < entries.offsets.size(); ++i)
+    {
+        strings[i].data = names + entries.offsets[i];
+        strings[i].length = static_cast<long>(std::strlen(strings[i].data));
+    }
+
+    _entries->strings = strings;
+    _entries->size = static_cast<long>(entries.offsets.size());
+}
+
+auto ismb_free_string_array(irods_string_array* _string_array) -> void
+{
+    delete[] reinterpret_cast<char*>(_string_array->strings);
+
+    _string_array->strings = nullptr;
+    _string_array->size = 0;
+}
+
+auto ismb_free_string(const char* _string) -> void
+{
+    delete[] _string;
+}
+
+static auto ismb_chdir_impl(irods_context* _ctx, const char* _target_dir) -> error_code
+{
+    std::cout << "ismb_chdir :: _target_dir    = " << _target_dir << '\n';
+    std::cout << "ismb_chdir :: _ctx->smb_path = " << _ctx->smb_path << '\n';
+
+    using namespace std::string_literals;
+
+    if (_target_dir == "/"s || _target_dir == _ctx->smb_path)
+    {
+        _ctx->cwd = get_root_path(_ctx->env);
+        return 0;
+    }
 
     // Verify that the directory exists.
 
-    namespace fs = boost::filesystem;
+    namespace fs = boost::filesystem;
+
+    const auto cwd = (fs::path{_ctx->cwd} / _target_dir).generic_string();
+
+    std::cout << "ismb_chdir :: possible new working directory = " << cwd << '\n';
+
+    auto sql = "select count(COLL_NAME) where COLL_NAME = '"s;
+    sql += cwd;
+    sql += "'";
+
+    bool exists = false;
+
+    run_query(*_ctx, sql, [&exists](const auto& _row) {
+        exists = exists || std::find(std::begin(_row), std::end(_row), "1") != std::end(_row);
+    });
+
+    if (exists)
+    {
+        _ctx->cwd = cwd;
+        std::cout << "ismb_chdir :: new working directory = " << _ctx->cwd << '\n';
+        return 0;
+    }
+
+    std::cout << "ismb_chdir :: invalid directory.\n";
+
+    return -1;
+}
+
+auto ismb_getwd(irods_context* _ctx, char** _dir) -> void
+{
+    *_dir = new char[_ctx->cwd.length() + 1] {};
+    std::strncpy(*_dir, _ctx->cwd.c_str(), _ctx->cwd.length());
+}
+
+static auto ismb_opendir_impl(irods_context* _ctx,
+                              const char* _path,
+                              irods_collection_stream** _coll_stream) -> error_code
+{
+    std::cout << "ismb_opendir :: _path = " << _path << '\n';
+
+    close_expired_parked(*_ctx);
+
+    std::string path;
+
+    if (!_path || std::strcmp(_path, ".") == 0)
+    {
+        path = _ctx->cwd;
+    }
+    else if (boost::starts_with(_path, "./"))
+    {
+        path = _path;
+        boost::replace_first(path, "./", _ctx->cwd + '/');
+    }
+    else if (boost::starts_with(_path, "/"))
+    {
+        path = _path;
+        boost::replace_first(path, "/", get_root_path(_ctx->env) + '/');
+    }
+    else
+    {
+        path = _ctx->cwd;
+        path += '/';
+        path += _path;
+    }
+
+    std::cout << "ismb_opendir :: path  = " << path << '\n';
+
+    //path.erase(path.find_last_of("/."));
+    //path.erase(path.find_last_of("/.."));
+    while ('/' == path.back() || '.' == path.back())
+        path.erase(path.length() - 1);
+
+    std::cout << "ismb_opendir :: path  = " << path << '\n';
+
+    collInp_t coll_input{};
+    coll_input.flags = LONG_METADATA_FG;
+    std::strncpy(coll_input.collName, path.c_str(), path.length());
+
+    auto handle = irods::smb::in_span("rcOpenCollection", coll_input.collName, [&] {
+        return rcOpenCollection(_ctx->conn, &coll_input);
+    });
+
+    if (handle < 0)
+    {
+        std::cout << "ismb_opendir :: failed to open collection.\n";
+        return -1;
+    }
+
+    _ctx->dir.reset(new irods_collection_stream{handle});
+    _ctx->dir_path = path;
+    *_coll_stream = _ctx->dir.get();
+
+    return 0;
+}
+
+auto ismb_fdopendir(irods_context* _ctx,
+                    const char* _path,
+                    irods_collection_stream** _coll_stream) -> error_code
+{
+    return ismb_opendir(_ctx, _path, _coll_stream);
+}
+
+static auto ismb_readdir_impl(irods_context* _ctx, irods_collection_stream* _coll_stream) -> dirent*
+{
+    collEnt_t* coll_entry{};
+
+    _ctx->read_coll_ec = irods::smb::in_span("rcReadCollection", nullptr, [&] {
+        return rcReadCollection(_ctx->conn, *_coll_stream, &coll_entry);
+    });
+
+    if (_ctx->read_coll_ec < 0)
+    {
+        if (_ctx->read_coll_ec == CAT_NO_ROWS_FOUND)
+            schedule_prefetch(*_ctx, _ctx->dir_path);
+
+        return nullptr;
+    }
+
+    _ctx->dir_entry = {}; // Clear old data.
+
+    if (coll_entry->objType == DATA_OBJ_T)
+    {
+        const auto length = std::strlen(coll_entry->dataName);
+        std::strncpy(_ctx->dir_entry.d_name, coll_entry->dataName, length);
+    }
+    else if (coll_entry->objType == COLL_OBJ_T)
+    {
+        std::string name = coll_entry->collName;
+
+        if (auto pos = name.find_last_of('/'); pos != std::string::npos)
+            name.erase(0, pos + 1);
+
+        std::strncpy(_ctx->dir_entry.d_name, name.c_str(), name.length());
+    }
+
+    _ctx->dir_entry.d_ino = _ctx->fsys.insert(_ctx->dir_entry.d_name);
+
+    freeCollEnt(coll_entry);
+
+    return &_ctx->dir_entry;
+}
+
+error_code ismb_seekdir(irods_context* _ctx, const char* _path)
+{
+    return 0;
+}
+
+error_code ismb_telldir(irods_context* _ctx)
+{
+    return _ctx->read_coll_ec >= 0 ? 0 : -1;
+}
+
+error_code ismb_rewind_dir(irods_context* _ctx, const char* _path)
+{
+    return 0;
+}
+
+static error_code ismb_mkdir_impl(irods_context* _ctx, const char* _path)
+{
+    std::cout << "ismb_mkdir :: _path = " << _path << '\n';
+
+    auto abs_path = _ctx->cwd;
+    abs_path += '/';
+    abs_path += _path;
+
+    std::cout << "ismb_mkdir :: abs_path = " << abs_path << '\n';
+
+    char coll_path[1024]{};
+    std::strncpy(coll_path, abs_path.c_str(), abs_path.length());
+
+    if (auto ec = mkColl(_ctx->conn, coll_path); ec != 0)
+    {
+        std::cout << "ismb_mkdir :: mkColl() failed.\n";
+        return -1;
+    }
+
+    _ctx->fsys.insert(abs_path);
+    _ctx->attrs.erase(abs_path);
+    _ctx->names.insert(abs_path);
+    _ctx->queries.invalidate(abs_path);
+
+    return 0;
+}
+
+static error_code ismb_rmdir_impl(irods_context* _ctx, const char* _path)
+{
+    std::cout << "ismb_rmdir :: _path = " << _path << '\n';
+
+    auto abs_path = _ctx->cwd;
+    abs_path += '/';
+    abs_path += _path;
+
+    std::cout << "ismb_rmdir :: abs_path = " << abs_path << '\n';
+
+    char coll_path[1024]{};
+    std::strncpy(coll_path, abs_path.c_str(), abs_path.length());
+
+    collInp_t coll_input{};
+    std::strncpy(coll_input.collName, abs_path.c_str(), abs_path.length());
+
+    //addKeyVal(&coll_input.condInput, FORCE_FLAG_KW, "");
+    //addKeyVal(&coll_input.condInput, RECURSIVE_OPR__KW, "");
+
+    constexpr int verbose = 0;
+    const auto ec = irods::smb::in_span("rcRmColl", coll_input.collName, [&] {
+        return rcRmColl(_ctx->conn, &coll_input, verbose);
+    });
+
+    if (ec < 0)
+    {
+        std::cout << "ismb_rmdir :: rcRmColl() failed.\n";
+        return -1;
+    }
+
+    _ctx->fsys.erase(abs_path);
+    _ctx->attrs.erase(abs_path);
+    _ctx->names.erase(abs_path);
+    _ctx->names.erase_collection(abs_path);
+    _ctx->queries.invalidate(abs_path);
+    std::cout << "ismb_rmdir :: collection removed.\n";
+
+    return 0;
+}
+
+static error_code ismb_rmtree_impl(irods_context* _ctx, const char* _path, int _no_trash)
+{
+    std::cout << "ismb_rmtree :: _path = " << _path << '\n';
+
+    const auto abs_path = absolute_path(*_ctx, _path);
+
+    std::cout << "ismb_rmtree :: abs_path = " << abs_path << '\n';
+
+    if (abs_path == get_root_path(_ctx->env))
+    {
+        std::cout << "ismb_rmtree :: refusing to remove the home collection.\n";
+        return SYS_INVALID_INPUT_PARAM;
+    }
+
+    collInp_t coll_input{};
+    rstrcpy(coll_input.collName, abs_path.c_str(), MAX_NAME_LEN);
+
+    // The server walks the whole subtree, so this is a single round trip no
+    // matter how many objects are below the collection.
+    addKeyVal(&coll_input.condInput, RECURSIVE_OPR__KW, "");
+
+    if (_no_trash)
+        addKeyVal(&coll_input.condInput, FORCE_FLAG_KW, "");
+
+    close_parked(*_ctx, abs_path);
+
+    constexpr int verbose = 0;
+    const auto ec = irods::smb::in_span("rcRmColl", coll_input.collName, [&] {
+        return rcRmColl(_ctx->conn, &coll_input, verbose);
+    });
+
+    clearKeyVal(&coll_input.condInput);
+
+    if (ec < 0)
+    {
+        std::cout << "ismb_rmtree :: rcRmColl() failed [ec = " << ec << "].\n";
+        return ec;
+    }
+
+    _ctx->fsys.erase(abs_path);
+    _ctx->fsys.erase_descendants(abs_path);
+    _ctx->attrs.erase(abs_path);
+    _ctx->attrs.erase_descendants(abs_path);
+    _ctx->names.erase(abs_path);
+    _ctx->names.erase_collection(abs_path);
+    _ctx->queries.invalidate(abs_path);
+
+    std::cout << "ismb_rmtree :: collection tree removed.\n";
+
+    return 0;
+}
+
+static void ismb_closedir_impl(irods_context* _ctx, irods_collection_stream* _coll_stream)
+{
+    irods::smb::in_span("rcCloseCollection", nullptr, [&] { rcCloseCollection(_ctx->conn, *_coll_stream); });
+    _ctx->dir.reset();
+}
+
+//
+// File Operations
+//
+
+static auto ismb_open_impl(irods_context* _ctx, const char* _filename, int _flags, int _mode) -> int
+{
+    namespace fs = boost::filesystem;
+
+    std::cout << "ismb_open :: _filename = " << _filename << '\n';
+    std::cout << "ismb_open :: _flags    = " << _flags << '\n';
+    std::cout << "ismb_open :: _mode     = " << _mode << '\n';
+
+    dataObjInp_t args{};
+
+    args.createMode = _mode;
+    args.openFlags = _flags;
+
+    auto abs_path = _ctx->cwd;
+    abs_path += '/';
+    abs_path += fs::path{_filename}.filename().generic_string();
+    std::cout << "ismb_open :: abs_path  = " << abs_path << '\n';
+    rstrcpy(args.objPath, abs_path.c_str(), MAX_NAME_LEN);
+
+    // FIXME The client must have a default resource defined for this to work!
+    addKeyVal(&args.condInput, RESC_NAME_KW, _ctx->env.rodsDefResource);
+    std::cout << "ismb_open :: def. resc = " << _ctx->env.rodsDefResource << '\n';
+
+    close_expired_parked(*_ctx);
+
+    if (const auto fd = unpark(*_ctx, abs_path, _flags); fd >= 0)
+    {
+        clearKeyVal(&args.condInput);
+        std::cout << "ismb_open :: reusing descriptor " << fd << ".\n";
+        return fd;
+    }
+
+    // Writers must not race with descriptors that still see the old content.
+    if (!read_only(_flags))
+        close_parked(*_ctx, abs_path);
+
+    // Small objects are fetched whole in a single request. No iRODS descriptor
+    // is kept open and all reads are served from memory.
+    if (const auto limit = _ctx->opts.inline_read_size; limit > 0 && read_only(_flags))
+    {
+        irods_stat_info stat_info{};
+
+        if (_ctx->attrs.lookup(abs_path, stat_info) && stat_info.type == IOT_DATA_OBJECT && stat_info.size <= limit)
+        {
+            if (const auto fd = open_inline(*_ctx, args, stat_info); fd >= 0)
+            {
+                // The path is already mapped when the object is open elsewhere.
+                // Such opens go to the server like any other.
+                if (!_ctx->fd.map(abs_path, fd))
+                {
+                    _ctx->descriptors.erase(fd);
+                }
+                else
+                {
+                    clearKeyVal(&args.condInput);
+                    stat_info.id = _ctx->fsys.insert(abs_path);
+                    _ctx->descriptors[fd].stat_info = std::make_unique<irods_stat_info>(stat_info);
+                    _ctx->descriptors[fd].open_flags = _flags;
+                    std::cout << "ismb_open :: fetched " << stat_info.size << " bytes inline.\n";
+                    return fd;
+                }
+            }
+        }
+    }
+
+    // Pick the replica to read from. The block cache also needs to know which
+    // replica's content it is holding. Writes always go to the default resource.
+    std::optional<replica_info> replica;
+    bool routed = false;
+
+    if (read_only(_flags) && (_ctx->blocks || _ctx->opts.replica_routing))
+    {
+        replica = select_replica(*_ctx, lookup_replicas(*_ctx, abs_path));
+
+        if (replica && _ctx->opts.replica_routing)
+        {
+            std::cout << "ismb_open :: reading replica " << replica->replica_number
+                      << " on [" << replica->resource << "].\n";
+
+            clearKeyVal(&args.condInput);
+            addKeyVal(&args.condInput, REPL_NUM_KW, std::to_string(replica->replica_number).c_str());
+            routed = true;
+        }
+    }
+
+    const auto server_fd = irods::smb::in_span("rcDataObjOpen", args.objPath, [&] {
+        return rcDataObjOpen(_ctx->conn, &args);
+    });
+
+    clearKeyVal(&args.condInput);
+
+    if (server_fd >= 0)
+    {
+        // The number is still handed out for a descriptor that was reopened
+        // under another one (see ismb_ftruncate).
+        const auto fd = _ctx->descriptors.count(server_fd) > 0 ? allocate_local_fd(*_ctx) : server_fd;
+
+        // Only the first descriptor of a path is mapped. Operations that need
+        // the path of another one fail with SYS_INVALID_INPUT_PARAM.
+        if (!_ctx->fd.map(abs_path, fd))
+            std::cout << "ismb_open :: [" << abs_path << "] is already open. Descriptor " << fd << " has no path.\n";
+
+        if (_flags & O_CREAT)
+            _ctx->names.insert(abs_path);
+
+        irods_stat_info stat_info{};
+        const bool size_known = _ctx->attrs.lookup(abs_path, stat_info);
+
+        if ((_flags & O_ACCMODE) != O_RDONLY)
+        {
+            _ctx->attrs.erase(abs_path);
+            _ctx->queries.invalidate(abs_path);
+        }
+
+        auto& desc = _ctx->descriptors[fd];
+        desc = {};
+        desc.open_flags = _flags;
+        desc.server_fd = server_fd;
+
+        if ((_flags & O_TRUNC) || ((_flags & O_CREAT) && (_flags & O_EXCL)))
+            desc.size = 0;
+        else if (size_known)
+            desc.size = stat_info.size;
+
+        // Seed the descriptor's attributes so that ismb_fstat never has to ask
+        // the server while the object is open.
+        if (size_known)
+        {
+            desc.stat_info = std::make_unique<irods_stat_info>(stat_info);
+            desc.stat_info->size = desc.size;
+        }
+        else if (desc.size == 0)
+        {
+            const auto now = static_cast<long long>(std::time(nullptr));
+
+            desc.stat_info = std::make_unique<irods_stat_info>();
+            desc.stat_info->type = IOT_DATA_OBJECT;
+            desc.stat_info->mode = _mode;
+            rstrcpy(desc.stat_info->owner_name, _ctx->env.rodsUserName, sizeof(irods_stat_info::owner_name));
+            rstrcpy(desc.stat_info->owner_zone, _ctx->env.rodsZone, sizeof(irods_stat_info::owner_zone));
+            desc.stat_info->creation_time = now;
+            desc.stat_info->modified_time = now;
+        }
+
+        if (desc.stat_info)
+            desc.stat_info->id = _ctx->fsys.insert(abs_path);
+
+        // The checksum can only be computed on the fly if the object starts out empty.
+        const bool starts_empty = (_flags & O_TRUNC) || ((_flags & O_CREAT) && (_flags & O_EXCL));
+
+        if (_ctx->opts.streaming_checksum && (_flags & O_ACCMODE) != O_RDONLY && starts_empty)
+        {
+            // Checksumming is best effort. Without a digest, the object is written unverified.
+            try
+            {
+                desc.checksum = std::make_unique<sha256>();
+            }
+            catch (const std::exception& e)
+            {
+                std::cout << "ismb_open :: " << e.what() << '\n';
+            }
+        }
+
+        // Blocks are only cached for content this descriptor cannot change.
+        if (replica && read_only(_flags))
+        {
+            desc.data_id = replica->data_id;
+            desc.replica_number = replica->replica_number;
+            desc.modify_time = replica->modify_time;
+            desc.replica_size = replica->size;
+            desc.replica_checksum = replica->checksum;
+        }
+
+        // Measurements are attributed to the resource that serves the I/O. Without
+        // routing, that is the default resource whichever replica was selected.
+        desc.resource = routed ? replica->resource : _ctx->env.rodsDefResource;
+
+        return fd;
+    }
+
+    return -1;
+}
+
+static auto ismb_close_impl(irods_context* _ctx, int _fd) -> int
+{
+    openedDataObjInp_t args{};
+
+    args.l1descInx = _fd;
+
+    std::string checksum;
+
+    if (auto iter = _ctx->descriptors.find(_fd); iter != std::end(_ctx->descriptors) && iter->second.content)
+    {
+        _ctx->descriptors.erase(iter);
+
+        try
+        {
+            _ctx->fd.erase(_ctx->fd.path(_fd));
+        }
+        catch (const std::out_of_range&)
+        {
+        }
+
+        return 0;
+    }
+
+    // Read-only descriptors are kept open for a moment. Clients often reopen
+    // the object they just closed.
+    if (auto iter = _ctx->descriptors.find(_fd);
+        iter != std::end(_ctx->descriptors) &&
+        _ctx->opts.deferred_close.count() > 0 &&
+        read_only(iter->second.open_flags))
+    {
+        try
+        {
+            const auto path = _ctx->fd.path(_fd);
+            _ctx->fd.erase(path);
+            park(*_ctx, path, _fd, std::move(iter->second));
+            _ctx->descriptors.erase(iter);
+            close_expired_parked(*_ctx);
+            return 0;
+        }
+        catch (const std::out_of_range&)
+        {
+        }
+    }
+
+    bool writable = true;
+
+    if (auto iter = _ctx->descriptors.find(_fd); iter != std::end(_ctx->descriptors))
+    {
+        writable = (iter->second.open_flags & O_ACCMODE) != O_RDONLY;
+        args.l1descInx = iter->second.server_fd;
+
+        // Registering the checksum here saves the server from reading the
+        // object back from storage to compute it.
+        if (const auto& desc = iter->second; desc.checksum && desc.checksummed > 0 && desc.checksummed == desc.size)
+        {
+            checksum = iter->second.checksum->finalize();
+            addKeyVal(&args.condInput, CHKSUM_KW, checksum.c_str());
+            std::cout << "ismb_close :: checksum = " << checksum << '\n';
+        }
+
+        _ctx->descriptors.erase(iter);
+    }
+
+    const auto ec = irods::smb::in_span("rcDataObjClose", nullptr, [&] {
+        return rcDataObjClose(_ctx->conn, &args);
+    });
+
+    clearKeyVal(&args.condInput);
+
+    if (ec < 0)
+        return -1;
+
+    try
+    {
+        const auto path = _ctx->fd.path(_fd);
+
+        if (writable)
+        {
+            _ctx->attrs.erase(path);
+            _ctx->queries.invalidate(path);
+        }
+
+        _ctx->fd.erase(path);
+    }
+    catch (const std::out_of_range&)
+    {
+    }
+
+    return 0;
+}
+
+static auto ismb_read_impl(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size) -> int
+{
+    auto iter = _ctx->descriptors.find(_fd);
+
+    if (iter == std::end(_ctx->descriptors))
+        return SYS_INVALID_INPUT_PARAM;
+
+    auto& desc = iter->second;
+    const auto bytes_read = read_at(*_ctx, _fd, desc, desc.offset, _buffer, _buffer_size);
+
+    if (bytes_read > 0)
+        desc.offset += bytes_read;
+
+    return bytes_read;
+}
+
+static auto ismb_pread_impl(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size, long long _offset) -> int
+{
+    auto iter = _ctx->descriptors.find(_fd);
+
+    if (iter == std::end(_ctx->descriptors) || _offset < 0)
+        return SYS_INVALID_INPUT_PARAM;
+
+    return read_at(*_ctx, _fd, iter->second, _offset, _buffer, _buffer_size);
+}
+
+static auto ismb_write_impl(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size) -> int
+{
+    auto iter = _ctx->descriptors.find(_fd);
+
+    if (iter == std::end(_ctx->descriptors))
+        return SYS_INVALID_INPUT_PARAM;
+
+    auto& desc = iter->second;
+    const auto bytes_written = write_at(*_ctx, _fd, desc, desc.offset, _buffer, _buffer_size);
+
+    if (bytes_written > 0)
+        desc.offset += bytes_written;
+
+    return bytes_written;
+}
+
+static auto ismb_pwrite_impl(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size, long long _offset) -> int
+{
+    auto iter = _ctx->descriptors.find(_fd);
+
+    if (iter == std::end(_ctx->descriptors) || _offset < 0)
+        return SYS_INVALID_INPUT_PARAM;
+
+    return write_at(*_ctx, _fd, iter->second, _offset, _buffer, _buffer_size);
+}
+
+static auto ismb_lseek_impl(irods_context* _ctx, int _fd, long long _offset, int _whence) -> long long
+{
+    auto iter = _ctx->descriptors.find(_fd);
+
+    if (iter == std::end(_ctx->descriptors))
+        return SYS_INVALID_INPUT_PARAM;
+
+    auto& desc = iter->second;
+    std::int64_t new_offset = 0;
+
+    // Seeking only moves the local position. The iRODS descriptor is moved by
+    // the next read or write, and only if it is not already in the right place.
+    switch (_whence)
+    {
+        case SEEK_SET:
+            new_offset = _offset;
+            break;
+
+        case SEEK_CUR:
+            new_offset = desc.offset + _offset;
+            break;
+
+        case SEEK_END:
+            if (desc.size < 0)
+            {
+                openedDataObjInp_t args{};
+                args.l1descInx = desc.server_fd;
+                args.offset = 0;
+                args.whence = SEEK_END;
+
+                fileLseekOut_t* out{};
+
+                const auto ec = irods::smb::in_span("rcDataObjLseek", nullptr, [&] {
+                    return rcDataObjLseek(_ctx->conn, &args, &out);
+                });
+
+                if (ec < 0)
+                {
+                    std::free(out);
+                    desc.server_offset = -1;
+                    return ec;
+                }
+
+                desc.size = out->offset;
+                desc.server_offset = out->offset;
+                std::free(out);
+            }
+
+            new_offset = desc.size + _offset;
+            break;
+
+        default:
+            return SYS_INVALID_INPUT_PARAM;
+    }
+
+    if (new_offset < 0)
+        return SYS_INVALID_INPUT_PARAM;
+
+    desc.offset = new_offset;
+
+    return new_offset;
+}
+
+static auto ismb_ftruncate_impl(irods_context* _ctx, int _fd, long long _length) -> error_code
+{
+    auto iter = _ctx->descriptors.find(_fd);
+
+    if (iter == std::end(_ctx->descriptors) || _length < 0)
+        return SYS_INVALID_INPUT_PARAM;
+
+    auto& desc = iter->second;
+
+    if (desc.content || (desc.open_flags & O_ACCMODE) == O_RDONLY)
+        return SYS_INVALID_INPUT_PARAM;
+
+    std::string path;
+
+    try
+    {
+        path = _ctx->fd.path(_fd);
+    }
+    catch (const std::out_of_range&)
+    {
+        return SYS_INVALID_INPUT_PARAM;
+    }
+
+    if (desc.size == _length)
+        return 0;
+
+    // The server only truncates by path. While this session holds the object
+    // open for write, the close would record the old size again (4.2) or the
+    // replica is locked (4.3). So the object is closed, truncated and opened
+    // again. Writes are never buffered locally, nothing is lost by the close.
+    openedDataObjInp_t close_args{};
+    close_args.l1descInx = desc.server_fd;
+
+    if (const auto ec = irods::smb::in_span("rcDataObjClose", nullptr, [&] { return rcDataObjClose(_ctx->conn, &close_args); }); ec < 0)
+        return ec;
+
+    desc.server_fd = -1;
+    desc.server_offset = -1;
+
+    dataObjInp_t args{};
+    rstrcpy(args.objPath, path.c_str(), MAX_NAME_LEN);
+    args.dataSize = _length;
+
+    const auto ec = irods::smb::in_span("rcDataObjTruncate", args.objPath, [&] {
+        return rcDataObjTruncate(_ctx->conn, &args);
+    });
+
+    _ctx->attrs.erase(path);
+    _ctx->queries.invalidate(path);
+
+    dataObjInp_t open_args{};
+    rstrcpy(open_args.objPath, path.c_str(), MAX_NAME_LEN);
+    open_args.openFlags = desc.open_flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+    addKeyVal(&open_args.condInput, RESC_NAME_KW, _ctx->env.rodsDefResource);
+
+    const auto server_fd = irods::smb::in_span("rcDataObjOpen", open_args.objPath, [&] {
+        return rcDataObjOpen(_ctx->conn, &open_args);
+    });
+
+    clearKeyVal(&open_args.condInput);
+
+    // Without a server descriptor, every later operation on _fd fails.
+    if (server_fd < 0)
+        return server_fd;
+
+    desc.server_fd = server_fd;
+    desc.server_offset = 0;
+
+    if (server_fd != _fd)
+        std::cout << "ismb_ftruncate :: descriptor " << _fd << " now refers to iRODS descriptor " << server_fd << ".\n";
+
+    if (ec < 0)
+        return ec;
+
+    desc.size = _length;
+
+    if (desc.stat_info)
+        desc.stat_info->modified_time = static_cast<long long>(std::time(nullptr));
+
+    if (!desc.dirty.empty())
+    {
+        // Drop dirty ranges past the new end.
+        for (auto it = desc.dirty.lower_bound(_length); it != std::end(desc.dirty);)
+            it = desc.dirty.erase(it);
+
+        if (!desc.dirty.empty())
+        {
+            auto& last = *std::prev(std::end(desc.dirty));
+            last.second = std::min<std::int64_t>(last.second, _length);
+        }
+    }
+
+    // The checksum only remains valid if the object still ends where hashing stopped.
+    if (desc.checksummed != _length)
+        desc.checksum.reset();
+
+    return 0;
+}
+
+static auto ismb_fstat_impl(irods_context* _ctx, int _fd, irods_stat_info* _stat_info) -> error_code
+{
+    auto iter = _ctx->descriptors.find(_fd);
+
+    if (iter == std::end(_ctx->descriptors))
+        return SYS_INVALID_INPUT_PARAM;
+
+    auto& desc = iter->second;
+
+    // Answered locally. The descriptor's attributes are kept current by the
+    // writes and truncates made through it.
+    if (!desc.stat_info)
+    {
+        std::string path;
+
+        try
+        {
+            path = _ctx->fd.path(_fd);
+        }
+        catch (const std::out_of_range&)
+        {
+            return SYS_INVALID_INPUT_PARAM;
+        }
+
+        irods_stat_info stat_info{};
+
+        if (auto ec = stat_path(*_ctx, path, &stat_info); ec < 0)
+            return ec;
+
+        // The catalog does not see the size of an object until it is closed.
+        const auto written_end = desc.dirty.empty() ? 0 : std::prev(std::end(desc.dirty))->second;
+
+        if (desc.size < 0)
+            desc.size = std::max<std::int64_t>(stat_info.size, written_end);
+
+        desc.stat_info = std::make_unique<irods_stat_info>(stat_info);
+    }
+
+    *_stat_info = *desc.stat_info;
+
+    if (desc.size >= 0)
+        _stat_info->size = desc.size;
+
+    return 0;
+}
+
+static auto ismb_unlink_impl(irods_context* _ctx, const char* _filename) -> error_code
+{
+    std::cout << "ismb_unlink :: _filename = " << _filename << '\n';
+
+    auto abs_path = _ctx->cwd;
+    abs_path += '/';
+    abs_path += _filename;
+
+    dataObjInp_t args{};
+    rstrcpy(args.objPath, abs_path.c_str(), MAX_NAME_LEN);
+
+    // Permanently deletes data object instead of moving it to the
+    // trash collection.
+    //addKeyVal(&args.condInput, FORCE_FLAG_KW, "");
+
+    _ctx->attrs.erase(abs_path);
+    close_parked(*_ctx, abs_path);
+
+    const auto ec = irods::smb::in_span("rcDataObjUnlink", args.objPath, [&] {
+        return rcDataObjUnlink(_ctx->conn, &args);
+    });
+
+    if (ec >= 0)
+    {
+        _ctx->names.erase(abs_path);
+        _ctx->queries.invalidate(abs_path);
+    }
+
+    return ec;
+}
+
+static auto ismb_copy_impl(irods_context* _ctx,
+                           const char* _src_path,
+                           const char* _dst_path,
+                           long long _offset,
+                           long long _length) -> error_code
+{
+    std::cout << "ismb_copy :: _src_path = " << _src_path << '\n';
+    std::cout << "ismb_copy :: _dst_path = " << _dst_path << '\n';
+    std::cout << "ismb_copy :: _offset   = " << _offset << '\n';
+    std::cout << "ismb_copy :: _length   = " << _length << '\n';
+
+    if (_offset < 0)
+        return SYS_INVALID_INPUT_PARAM;
+
+    const auto src_path = absolute_path(*_ctx, _src_path);
+    const auto dst_path = absolute_path(*_ctx, _dst_path);
+
+    close_parked(*_ctx, dst_path);
+
+    // Returns the size of the data object at _path, or the error of rcObjStat.
+    const auto object_size = [_ctx](const std::string& _path) -> long long {
+        rodsObjStat_t* stat_info_ptr{};
+        dataObjInp_t stat_input{};
+        rstrcpy(stat_input.objPath, _path.c_str(), MAX_NAME_LEN);
+
+        const auto stat_ec = irods::smb::in_span("rcObjStat", stat_input.objPath, [&] {
+            return rcObjStat(_ctx->conn, &stat_input, &stat_info_ptr);
+        });
+
+        if (stat_ec < 0)
+            return stat_ec;
+
+        const long long size = (stat_info_ptr->objType == DATA_OBJ_T) ? stat_info_ptr->objSize : SYS_INVALID_INPUT_PARAM;
+        freeRodsObjStat(stat_info_ptr);
+
+        return size;
+    };
+
+    const auto src_size = object_size(src_path);
+
+    if (src_size < 0)
+        return static_cast<error_code>(src_size);
+
+    // Nothing to copy. The destination is left alone.
+    if (_offset > src_size)
+        return SYS_COPY_LEN_ERR;
+
+    if (_length < 0 || _offset + _length > src_size)
+        _length = src_size - _offset;
+
+    // The whole object is being copied, so let the server do all of the work.
+    // The data never leaves the iRODS zone. The server replaces the destination,
+    // so a longer destination must be streamed into to keep its tail.
+    if (_offset == 0 && _length == src_size && object_size(dst_path) <= src_size)
+    {
+        dataObjCopyInp_t args{};
+        rstrcpy(args.srcDataObjInp.objPath, src_path.c_str(), MAX_NAME_LEN);
+        rstrcpy(args.destDataObjInp.objPath, dst_path.c_str(), MAX_NAME_LEN);
+        args.srcDataObjInp.oprType = COPY_SRC;
+        args.destDataObjInp.oprType = COPY_DEST;
+        args.destDataObjInp.createMode = 0600;
+        addKeyVal(&args.destDataObjInp.condInput, FORCE_FLAG_KW, "");
+        addKeyVal(&args.destDataObjInp.condInput, DEST_RESC_NAME_KW, _ctx->env.rodsDefResource);
+
+        const auto ec = irods::smb::in_span("rcDataObjCopy", args.srcDataObjInp.objPath, [&] {
+            return rcDataObjCopy(_ctx->conn, &args);
+        });
+
+        clearKeyVal(&args.destDataObjInp.condInput);
+
+        if (ec < 0)
+        {
+            std::cout << "ismb_copy :: rcDataObjCopy() failed [ec = " << ec << "].\n";
+            return ec;
+        }
+
+        _ctx->fsys.insert(dst_path);
+        _ctx->attrs.erase(dst_path);
+        _ctx->names.insert(dst_path);
+        _ctx->queries.invalidate(dst_path);
+
+        return 0;
+    }
+
+    // Partial copy. Stream the range through this process.
+
+    const auto open = [_ctx](const std::string& _path, int _flags) {
+        dataObjInp_t args{};
+        rstrcpy(args.objPath, _path.c_str(), MAX_NAME_LEN);
+        args.openFlags = _flags;
+        args.createMode = 0600;
+        addKeyVal(&args.condInput, RESC_NAME_KW, _ctx->env.rodsDefResource);
+        const auto fd = irods::smb::in_span("rcDataObjOpen", args.objPath, [&] {
+            return rcDataObjOpen(_ctx->conn, &args);
+        });
+        clearKeyVal(&args.condInput);
+        return fd;
+    };
+
+    const auto close = [_ctx](int _fd) {
+        openedDataObjInp_t args{};
+        args.l1descInx = _fd;
+        return irods::smb::in_span("rcDataObjClose", nullptr, [&] { return rcDataObjClose(_ctx->conn, &args); });
+    };
+
+    const auto seek = [_ctx](int _fd, long long _offset) -> error_code {
+        openedDataObjInp_t args{};
+        args.l1descInx = _fd;
+        args.offset = _offset;
+        args.whence = SEEK_SET;
+
+        fileLseekOut_t* out{};
+        const auto ec = irods::smb::in_span("rcDataObjLseek", nullptr, [&] {
+            return rcDataObjLseek(_ctx->conn, &args, &out);
+        });
+        std::free(out);
+
+        return ec < 0 ? ec : 0;
+    };
+
+    const auto src_fd = open(src_path, O_RDONLY);
+
+    if (src_fd < 0)
+        return src_fd;
+
+    const auto dst_fd = open(dst_path, O_WRONLY | O_CREAT);
+
+    if (dst_fd < 0)
+    {
+        close(src_fd);
+        return dst_fd;
+    }
+
+    error_code ec = 0;
+
+    if (_offset > 0)
+    {
+        if (ec = seek(src_fd, _offset); ec == 0)
+            ec = seek(dst_fd, _offset);
+    }
+
+    constexpr long long chunk_size = 4 * 1024 * 1024;
+    std::vector<char> buffer(static_cast<std::size_t>(std::min(chunk_size, std::max(_length, 1LL))));
+
+    for (long long remaining = _length; ec == 0 && remaining > 0;)
+    {
+        if (remaining < _length)
+            _ctx->scheduler.yield(irods::smb::rpc_class::foreground);
+
+        openedDataObjInp_t read_args{};
+        read_args.l1descInx = src_fd;
+        read_args.len = static_cast<int>(std::min<long long>(remaining, buffer.size()));
+
+        bytesBuf_t read_buf{};
+        read_buf.buf = buffer.data();
+        read_buf.len = read_args.len;
+
+        const auto bytes_read = irods::smb::in_span("rcDataObjRead", nullptr, [&] {
+            return rcDataObjRead(_ctx->conn, &read_args, &read_buf);
+        }, true);
+
+        if (bytes_read <= 0)
+        {
+            ec = bytes_read;
+            break;
+        }
+
+        openedDataObjInp_t write_args{};
+        write_args.l1descInx = dst_fd;
+        write_args.len = bytes_read;
+
+        bytesBuf_t write_buf{};
+        write_buf.buf = buffer.data();
+        write_buf.len = bytes_read;
+
+        const auto bytes_written = irods::smb::in_span("rcDataObjWrite", nullptr, [&] {
+            return rcDataObjWrite(_ctx->conn, &write_args, &write_buf);
+        }, true);
+
+        if (bytes_written != bytes_read)
+        {
+            ec = bytes_written < 0 ? bytes_written : SYS_COPY_LEN_ERR;
+            break;
+        }
+
+        remaining -= bytes_read;
+    }
+
+    close(dst_fd);
+    close(src_fd);
+
+    if (ec == 0)
+    {
+        _ctx->fsys.insert(dst_path);
+        _ctx->names.insert(dst_path);
+    }
+
+    _ctx->attrs.erase(dst_path);
+    _ctx->queries.invalidate(dst_path);
+
+    return ec;
+}
+
+static auto ismb_rename_impl(irods_context* _ctx, const char* _old_path, const char* _new_path) -> error_code
+{
+    std::cout << "ismb_rename :: _old_path = " << _old_path << '\n';
+    std::cout << "ismb_rename :: _new_path = " << _new_path << '\n';
+
+    const auto old_path = absolute_path(*_ctx, _old_path);
+    const auto new_path = absolute_path(*_ctx, _new_path);
+
+    if (old_path == new_path)
+        return 0;
+
+    irods_stat_info stat_info{};
+
+    if (auto ec = ismb_stat_impl(_ctx, _old_path, &stat_info); ec < 0)
+        return ec;
+
+    const auto opr_type = (stat_info.type == IOT_COLLECTION) ? RENAME_COLL : RENAME_DATA_OBJ;
+
+    close_parked(*_ctx, old_path);
+    close_parked(*_ctx, new_path);
+
+    dataObjCopyInp_t args{};
+    rstrcpy(args.srcDataObjInp.objPath, old_path.c_str(), MAX_NAME_LEN);
+    rstrcpy(args.destDataObjInp.objPath, new_path.c_str(), MAX_NAME_LEN);
+    args.srcDataObjInp.oprType = opr_type;
+    args.destDataObjInp.oprType = opr_type;
+
+    const auto ec = irods::smb::in_span("rcDataObjRename", args.srcDataObjInp.objPath, [&] {
+        return rcDataObjRename(_ctx->conn, &args);
+    });
+
+    if (ec < 0)
+    {
+        std::cout << "ismb_rename :: rcDataObjRename() failed [ec = " << ec << "].\n";
+        _ctx->attrs.erase(old_path);
+        return ec;
+    }
+
+    // The rename is a single catalog update, so only the local state needs to
+    // follow it. Inode numbers and open descriptors keep their values.
+    _ctx->fsys.rename(old_path, new_path);
+    _ctx->fd.rename(old_path, new_path);
+    _ctx->attrs.rename(old_path, new_path);
+    _ctx->queries.invalidate(old_path);
+    _ctx->queries.invalidate(new_path);
+    _ctx->names.erase(old_path);
+    _ctx->names.erase_collection(old_path);
+    _ctx->names.insert(new_path);
+
+    if (_ctx->cwd == old_path || boost::starts_with(_ctx->cwd, old_path + '/'))
+        _ctx->cwd = new_path + _ctx->cwd.substr(old_path.size());
+
+    return 0;
+}
+
+static auto ismb_dir_usage_impl(irods_context* _ctx, const char* _path, long long* _total_bytes, long long* _object_count) -> error_code
+{
+    std::cout << "ismb_dir_usage :: _path = " << _path << '\n';
+
+    const auto path = absolute_path(*_ctx, _path);
+
+    // Replicas are counted individually, i.e. this is the storage consumed.
+    const auto condition = "COLL_NAME = '" + path + "' || like '" + path + "/%'";
+    const auto usage = query_usage(*_ctx, "coll:" + path, condition);
+
+    if (!usage)
+        return SYS_INVALID_INPUT_PARAM;
+
+    *_total_bytes = usage->bytes;
+    *_object_count = usage->objects;
+
+    return 0;
+}
+
+static auto ismb_statvfs_impl(irods_context* _ctx, const char* _path, irods_statvfs_info* _statvfs_info) -> error_code
+{
+    std::cout << "ismb_statvfs :: _path = " << _path << '\n';
+
+    // Space is accounted against the resource new data is written to, whatever
+    // _path is. Clients only see a single volume per share.
+    const std::string resource = _ctx->env.rodsDefResource;
+    const auto condition = "DATA_RESC_HIER = '" + resource + "' || like '" + resource + ";%'";
+    const auto usage = query_usage(*_ctx, "resc:" + resource, condition);
+
+    if (!usage)
+        return SYS_INVALID_INPUT_PARAM;
+
+    // Prefer the free space recorded for the resource. Otherwise, report the
+    // configured volume size.
+    long long free_bytes = -1;
+
+    if (usage_info cached{}; _ctx->free_space.lookup(resource, cached))
+    {
+        free_bytes = cached.bytes;
+    }
+    else
+    {
+        free_bytes = query_free_space(*_ctx, resource);
+        _ctx->free_space.insert(resource, {free_bytes, 0}, _ctx->opts.usage_cache_ttl);
+    }
+
+    if (free_bytes < 0)
+        free_bytes = std::max(0LL, _ctx->opts.volume_size - usage->bytes);
+
+    constexpr long long block_size = 4096;
+
+    std::memset(_statvfs_info, 0, sizeof(irods_statvfs_info));
+    _statvfs_info->block_size = block_size;
+    _statvfs_info->total_blocks = (usage->bytes + free_bytes) / block_size;
+    _statvfs_info->free_blocks = free_bytes / block_size;
+    _statvfs_info->available_blocks = _statvfs_info->free_blocks;
+    _statvfs_info->total_files = usage->objects;
+    _statvfs_info->free_files = std::numeric_limits<int>::max();
+
+    return 0;
+}
+
+static auto ismb_lookup_nocase_impl(irods_context* _ctx, const char* _parent, const char* _name, char** _real_name) -> error_code
+{
+    std::cout << "ismb_lookup_nocase :: _parent = " << _parent << '\n';
+    std::cout << "ismb_lookup_nocase :: _name   = " << _name << '\n';
+
+    const auto collection = absolute_path(*_ctx, _parent);
+
+    apply_prefetched(*_ctx);
+
+    const auto* index = _ctx->names.find(collection);
+
+    if (!index)
+    {
+        try
+        {
+            const auto entries = list(_ctx->conn, collection);
+
+            std::vector<std::string_view> names;
+            names.reserve(entries.offsets.size());
+
+            for (auto offset : entries.offsets)
+                names.emplace_back(entries.names.c_str() + offset);
+
+            _ctx->names.build(collection, names);
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "ismb_lookup_nocase :: " << e.what() << '\n';
+            return SYS_INVALID_INPUT_PARAM;
+        }
+
+        index = _ctx->names.find(collection);
+    }
+
+    if (!index)
+        return OBJ_PATH_DOES_NOT_EXIST;
+
+    auto iter = index->find(irods::smb::case_fold(_name));
+
+    if (iter == std::end(*index))
+        return OBJ_PATH_DOES_NOT_EXIST;
+
+    const auto& real_name = iter->second;
+    *_real_name = new char[real_name.size() + 1]{};
+    std::strncpy(*_real_name, real_name.c_str(), real_name.size());
+
+    return 0;
+}
+
+static auto ismb_getxattr_impl(irods_context* _ctx, const char* _path, const char* _name, char* _value, int _size) -> int
+{
+    std::cout << "ismb_getxattr :: _path = " << _path << '\n';
+    std::cout << "ismb_getxattr :: _name = " << _name << '\n';
+
+    avu_list avus;
+
+    if (const auto ec = fetch_avus(*_ctx, absolute_path(*_ctx, _path), avus); ec < 0)
+        return ec;
+
+    // An attribute may carry several values. Only the first one is visible.
+    auto iter = std::find_if(std::begin(avus), std::end(avus), [_name](const auto& _avu) {
+        return _avu.first == _name;
+    });
+
+    if (iter == std::end(avus))
+        return CAT_NO_ROWS_FOUND;
+
+    const auto& value = iter->second;
+    const auto length = static_cast<int>(value.size());
+
+    if (_size == 0)
+        return length;
+
+    if (_size < length)
+        return SYS_COPY_LEN_ERR;
+
+    std::memcpy(_value, value.data(), value.size());
+
+    return length;
+}
+
+static auto ismb_listxattr_impl(irods_context* _ctx, const char* _path, char* _list, int _size) -> int
+{
+    std::cout << "ismb_listxattr :: _path = " << _path << '\n';
+
+    avu_list avus;
+
+    if (const auto ec = fetch_avus(*_ctx, absolute_path(*_ctx, _path), avus); ec < 0)
+        return ec;
+
+    std::string names;
+
+    for (auto iter = std::begin(avus); iter != std::end(avus); ++iter)
+    {
+        const auto seen = std::any_of(std::begin(avus), iter, [iter](const auto& _avu) {
+            return _avu.first == iter->first;
+        });
+
+        if (!seen)
+        {
+            names += iter->first;
+            names += '\0';
+        }
+    }
+
+    const auto length = static_cast<int>(names.size());
+
+    if (_size == 0)
+        return length;
+
+    if (_size < length)
+        return SYS_COPY_LEN_ERR;
+
+    std::memcpy(_list, names.data(), names.size());
+
+    return length;
+}
+
+static auto ismb_setxattr_impl(irods_context* _ctx, const char* _path, const char* _name, const char* _value, int _size) -> error_code
+{
+    std::cout << "ismb_setxattr :: _path = " << _path << '\n';
+    std::cout << "ismb_setxattr :: _name = " << _name << '\n';
+
+    // "set" replaces every existing value of the attribute.
+    return modify_avu(*_ctx, "set", absolute_path(*_ctx, _path), _name, std::string(_value, static_cast<std::size_t>(_size)));
+}
+
+static auto ismb_removexattr_impl(irods_context* _ctx, const char* _path, const char* _name) -> error_code
+{
+    std::cout << "ismb_removexattr :: _path = " << _path << '\n';
+    std::cout << "ismb_removexattr :: _name = " << _name << '\n';
+
+    const auto path = absolute_path(*_ctx, _path);
+
+    avu_list avus;
+
+    if (const auto ec = fetch_avus(*_ctx, path, avus); ec < 0)
+        return ec;
+
+    // Values are removed one at a time. The wildcard form ("rmw") would also
+    // match attribute names containing '%' or '_'.
+    bool found = false;
+
+    for (const auto& [name, value] : avus)
+    {
+        if (name != _name)
+            continue;
+
+        found = true;
+
+        if (const auto ec = modify_avu(*_ctx, "rm", path, name, value); ec < 0)
+            return ec;
+    }
+
+    return found ? 0 : CAT_NO_ROWS_FOUND;
+}
+
+auto ismb_prefetch_xattrs(irods_context* _ctx, const char* _path) -> error_code
+{
+    std::cout << __func__ << " :: _path = " << _path << '\n';
+
+    const auto slot = _ctx->scheduler.acquire(irods::smb::rpc_class::background);
+
+    return prefetch_avus(*_ctx, absolute_path(*_ctx, _path));
+}
+
+auto ismb_prefetch_statistics(irods_context* _ctx, irods_prefetch_stats* _stats) -> error_code
+{
+    if (!_ctx->prefetch)
+    {
+        std::memset(_stats, 0, sizeof(irods_prefetch_stats));
+        return 0;
+    }
+
+    *_stats = _ctx->prefetch->statistics();
+
+    return 0;
+}
+
+auto ismb_export_spans(irods_context* _ctx, const char* _path) -> error_code
+{
+    auto& recorder = irods::smb::span_recorder::instance();
+
+    if (!_ctx || !_path || !recorder.enabled())
+        return SYS_INVALID_INPUT_PARAM;
+
+    if (!recorder.export_chrome_trace(_path))
+    {
+        std::cout << __func__ << " :: could not write spans to [" << _path << "].\n";
+        return FILE_OPEN_ERR;
+    }
+
+    return 0;
+}
+
+static auto ismb_walk_impl(irods_context* _ctx,
+                           const char* _root,
+                           irods_walk_callback _callback,
+                           const irods_walk_options* _options,
+                           void* _user_data) -> error_code
+{
+    if (!_ctx || !_callback)
+        return SYS_INVALID_INPUT_PARAM;
+
+    std::cout << "ismb_walk :: _root = " << (_root ? _root : ".") << '\n';
+
+    irods_walk_options opts{};
+
+    if (_options)
+        opts = *_options;
+
+    if (opts.max_depth < 0 || opts.threads < 0 || opts.page_size < 0)
+        return SYS_INVALID_INPUT_PARAM;
+
+    const auto threads = opts.threads > 0 ? std::min(opts.threads, 16) : 4;
+    const auto page_size = opts.page_size > 0 ? opts.page_size : MAX_SQL_ROWS;
+
+    std::string root;
+    std::string prefix;
+    std::uint64_t generation = 0;
+    std::vector<walk_entry> collections;
+
+    // Listing the collections up front tells how to split the tree between the
+    // threads. It runs on the session's connection, like any other call.
+    {
+        const auto slot = _ctx->scheduler.acquire(irods::smb::rpc_class::background);
+
+        root = absolute_path(*_ctx, _root);
+        prefix = root == "/" ? root : root + '/';
+        generation = _ctx->attrs.generation();
+
+        irods_stat_info stat_info{};
+
+        if (const auto ec = stat_path(*_ctx, root, &stat_info); ec < 0)
+            return ec;
+
+        if (stat_info.type != IOT_COLLECTION)
+            return SYS_INVALID_INPUT_PARAM;
+
+        const auto sql = "select COLL_NAME, COLL_OWNER_NAME, COLL_OWNER_ZONE, COLL_CREATE_TIME, COLL_MODIFY_TIME "
+                         "where COLL_NAME like '" + prefix + "%'";
+
+        const auto ec = irods::smb::for_each_page(_ctx->conn, sql, [&](irods::smb::column_page& _page) {
+            const auto names = _page.strings(0);
+            const auto owner_names = _page.strings(1);
+            const auto owner_zones = _page.strings(2);
+            const auto ctimes = _page.int64s(3);
+            const auto mtimes = _page.int64s(4);
+
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+            {
+                // Underscores in the like pattern match any character.
+                if (names[i].size() <= prefix.size() || names[i].substr(0, prefix.size()) != prefix)
+                    continue;
+
+                collections.push_back({std::string{names[i]},
+                                       make_stat_info(IOT_COLLECTION, 0, 0, owner_names[i], owner_zones[i], ctimes[i], mtimes[i])});
+            }
+
+            return true;
+        }, page_size);
+
+        if (ec < 0)
+            return ec;
+    }
+
+    const auto target_size = std::max<std::size_t>(1, collections.size() / (static_cast<std::size_t>(threads) * 4));
+
+    walker w{_ctx->env, make_walk_units(root, collections, opts.max_depth, target_size), page_size};
+    w.start(threads);
+
+    std::size_t inserted = 0;
+
+    // Feeds the caches, then calls back without holding the connection so that
+    // the callback may call into the library.
+    const auto deliver = [&](std::vector<walk_entry>& _entries) {
+        {
+            const auto slot = _ctx->scheduler.acquire(irods::smb::rpc_class::background);
+
+            // Something was modified since the walk started. The results may
+            // describe the tree as it was before that.
+            const auto cache = _ctx->attrs.generation() == generation;
+
+            for (auto& e : _entries)
+            {
+                e.stat_info.id = _ctx->fsys.insert(e.path);
+
+                if (cache)
+                    _ctx->attrs.insert(e.path, e.stat_info);
+            }
+
+            // Entries of a large walk expire long before it ends.
+            if (inserted += _entries.size(); inserted >= 65536)
+            {
+                _ctx->attrs.erase_expired();
+                inserted = 0;
+            }
+        }
+
+        for (const auto& e : _entries)
+        {
+            if (_callback(e.path.c_str() + prefix.size(), &e.stat_info, _user_data) != 0)
+                return false;
+        }
+
+        return true;
+    };
+
+    if (opts.max_depth > 0)
+    {
+        const auto depth = [&prefix](const walk_entry& _e) {
+            return std::count(std::begin(_e.path) + prefix.size(), std::end(_e.path), '/') + 1;
+        };
+
+        collections.erase(std::remove_if(std::begin(collections), std::end(collections), [&](const walk_entry& _e) {
+            return depth(_e) > opts.max_depth;
+        }), std::end(collections));
+    }
+
+    // The collections are handed out while the data object queries run.
+    auto stopped = !deliver(collections);
+
+    for (std::vector<walk_entry> batch; !stopped && w.next(batch);)
+        stopped = !deliver(batch);
+
+    if (stopped)
+    {
+        w.stop();
+        return 0;
+    }
+
+    return w.error();
+}
+
+static auto ismb_changes_since_impl(irods_context* _ctx, const char* _collection, long long* _cookie, irods_change_list* _changes) -> error_code
+{
+    if (!_ctx || !_cookie || !_changes)
+        return SYS_INVALID_INPUT_PARAM;
+
+    std::cout << "ismb_changes_since :: _collection = " << (_collection ? _collection : ".") << '\n';
+    std::cout << "ismb_changes_since :: *_cookie    = " << *_cookie << '\n';
+
+    _changes->changes = nullptr;
+    _changes->size = 0;
+    _changes->rescan = 0;
+
+    const auto collection = absolute_path(*_ctx, _collection);
+
+    // Replicas of an object may differ. The same one must represent the object
+    // at every poll, or the object would seem to change back and forth.
+    const auto latest = [](std::map<std::string, irods_stat_info>& _entries, std::string_view _name, const irods_stat_info& _stat_info) {
+        auto [iter, inserted] = _entries.try_emplace(std::string{_name}, _stat_info);
+        auto& e = iter->second;
+
+        if (!inserted && std::tie(e.modified_time, e.size) < std::tie(_stat_info.modified_time, _stat_info.size))
+            e = _stat_info;
+    };
+
+    const auto remember = [](watched_collection& _watch, const std::string& _name, const irods_stat_info& _stat_info) {
+        _watch.entries[_name] = {_stat_info.type, _stat_info.modified_time, _stat_info.size};
+        _watch.watermark = std::max(_watch.watermark, _stat_info.modified_time);
+    };
+
+    // Makes _watch the state behind a new cookie.
+    const auto issue_cookie = [_ctx, _cookie](watched_collection&& _watch) {
+        if (_ctx->watched.size() >= max_watched_collections)
+        {
+            const auto oldest = std::min_element(std::begin(_ctx->watched), std::end(_ctx->watched), [](const auto& _a, const auto& _b) {
+                return _a.second.polled_at < _b.second.polled_at;
+            });
+
+            _ctx->watched.erase(oldest);
+        }
+
+        _watch.polled_at = std::chrono::steady_clock::now();
+        *_cookie = _ctx->next_watch_cookie++;
+        _ctx->watched.emplace(*_cookie, std::move(_watch));
+    };
+
+    auto iter = _ctx->watched.find(*_cookie);
+
+    if (iter == std::end(_ctx->watched) || iter->second.collection != collection)
+    {
+        irods_stat_info stat_info{};
+
+        if (const auto ec = stat_path(*_ctx, collection, &stat_info); ec < 0)
+            return ec;
+
+        if (stat_info.type != IOT_COLLECTION)
+            return SYS_INVALID_INPUT_PARAM;
+
+        // There is nothing to compare against. The collection as it is now
+        // becomes the baseline, and a client that expected changes must list it.
+        std::map<std::string, irods_stat_info> entries;
+
+        const auto ec = for_each_modified_child(*_ctx, collection, 0, [&](std::string_view _name, const irods_stat_info& _stat_info) {
+            latest(entries, _name, _stat_info);
+        });
+
+        if (ec < 0)
+            return ec;
+
+        watched_collection watch;
+        watch.collection = collection;
+
+        for (const auto& [name, stat_info] : entries)
+            remember(watch, name, stat_info);
+
+        _changes->rescan = *_cookie != 0 ? 1 : 0;
+        issue_cookie(std::move(watch));
+
+        return 0;
+    }
+
+    auto& watch = iter->second;
+
+    std::map<std::string, irods_stat_info> modified;
+
+    auto ec = for_each_modified_child(*_ctx, collection, watch.watermark, [&](std::string_view _name, const irods_stat_info& _stat_info) {
+        latest(modified, _name, _stat_info);
+    });
+
+    if (ec < 0)
+        return ec;
+
+    // Entries modified in the second of the watermark may have been seen
+    // already. Those still carry the modify time and size recorded for them.
+    for (auto m = std::begin(modified); m != std::end(modified);)
+    {
+        const auto e = watch.entries.find(m->first);
+        const auto& stat_info = m->second;
+
+        const auto seen = e != std::end(watch.entries) &&
+                          e->second.type == stat_info.type &&
+                          e->second.modified_time == stat_info.modified_time &&
+                          e->second.size == stat_info.size;
+
+        m = seen ? modified.erase(m) : std::next(m);
+    }
+
+    // Deletions leave nothing behind to query for. They show up as names
+    // missing from the current listing.
+    std::unordered_map<std::string, irods_object_type> current;
+
+    if (ec = fetch_child_names(*_ctx, collection, current); ec < 0)
+        return ec;
+
+    const auto prefix = collection == "/" ? collection : collection + '/';
+
+    struct change
+    {
+        irods_change_type type;
+        std::string name;
+        irods_stat_info stat_info;
+    };
+
+    std::vector<change> changes;
+
+    for (const auto& [name, e] : watch.entries)
+    {
+        if (current.find(name) == std::end(current))
+            changes.push_back({ICT_DELETED, name, irods_stat_info{}});
+    }
+
+    for (auto& [name, stat_info] : modified)
+    {
+        // Removed again between the two queries.
+        if (current.find(name) == std::end(current))
+            continue;
+
+        const auto type = watch.entries.count(name) > 0 ? ICT_MODIFIED : ICT_CREATED;
+        changes.push_back({type, name, stat_info});
+    }
+
+    // Names that appeared without a newer modify time (e.g. moved in from
+    // elsewhere) are looked up one at a time.
+    for (const auto& [name, type] : current)
+    {
+        if (watch.entries.count(name) > 0 || modified.count(name) > 0)
+            continue;
+
+        irods_stat_info stat_info{};
+
+        if (stat_path(*_ctx, prefix + name, &stat_info) >= 0)
+            changes.push_back({ICT_CREATED, name, stat_info});
+    }
+
+    // Patch the caches rather than drop the listing.
+    for (auto& c : changes)
+    {
+        const auto path = prefix + c.name;
+
+        _ctx->queries.invalidate(path);
+
+        if (c.type == ICT_DELETED)
+        {
+            if (watch.entries[c.name].type == IOT_COLLECTION)
+            {
+                _ctx->attrs.erase_descendants(path);
+                _ctx->names.erase_collection(path);
+            }
+
+            _ctx->attrs.erase(path);
+            _ctx->names.erase(path);
+            watch.entries.erase(c.name);
+            continue;
+        }
+
+        c.stat_info.id = _ctx->fsys.insert(path);
+        _ctx->attrs.insert(path, c.stat_info);
+
+        if (c.type == ICT_CREATED)
+            _ctx->names.insert(path);
+
+        remember(watch, c.name, c.stat_info);
+    }
+
+    // The cookie is used up. Its state moves to the next one.
+    auto next = std::move(watch);
+    _ctx->watched.erase(iter);
+    issue_cookie(std::move(next));
+
+    if (changes.empty())
+        return 0;
+
+    // One allocation, like ismb_list: the array followed by the names.
+    std::size_t names_size = 0;
+
+    for (const auto& c : changes)
+        names_size += c.name.size() + 1;
+
+    const auto header_size = sizeof(irods_change) * changes.size();
+    auto* arena = new char[header_size + names_size];
+
+    auto* entries = reinterpret_cast<irods_change*>(arena);
+    auto* names = arena + header_size;
+
+    for (std::size_t i = 0; i < changes.size(); ++i)
+    {
+        std::memcpy(names, changes[i].name.c_str(), changes[i].name.size() + 1);
+
+        entries[i].type = changes[i].type;
+        entries[i].name = names;
+        entries[i].stat_info = changes[i].stat_info;
+
+        names += changes[i].name.size() + 1;
+    }
+
+    _changes->changes = entries;
+    _changes->size = static_cast<long>(changes.size());
+
+    return 0;
+}
+
+auto ismb_free_change_list(irods_change_list* _changes) -> void
+{
+    delete[] reinterpret_cast<char*>(_changes->changes);
+
+    _changes->changes = nullptr;
+    _changes->size = 0;
+}
+
+// Entry points that may be traced. Each one forwards to its implementation,
+// recording the call when tracing is enabled (see IOPT_TRACE_FILE) and timing it
+// as a span when span recording is enabled (see IOPT_SPAN_BUFFER_SIZE).
+
+namespace
+{
+    auto rpc_class_of(irods::smb::trace_op _op) -> irods::smb::rpc_class
+    {
+        using irods::smb::rpc_class;
+        using irods::smb::trace_op;
+
+        switch (_op)
+        {
+            case trace_op::stat:
+            case trace_op::list:
+            case trace_op::chdir:
+            case trace_op::opendir:
+            case trace_op::readdir:
+            case trace_op::closedir:
+            case trace_op::fstat:
+            case trace_op::statvfs:
+            case trace_op::lookup_nocase:
+            case trace_op::getxattr:
+            case trace_op::listxattr:
+                return rpc_class::interactive;
+
+            // Polls are made on a timer. Nobody waits on them.
+            case trace_op::dir_usage:
+            case trace_op::changes_since:
+                return rpc_class::background;
+
+            default:
+                return rpc_class::foreground;
+        }
+    }
+
+    template <typename Function>
+    auto traced(irods_context* _ctx,
+                irods::smb::trace_op _op,
+                const char* _name,
+                const char* _path,
+                const char* _path2,
+                std::initializer_list<std::int64_t> _args,
+                Function _func) -> decltype(_func())
+    {
+        using result_type = decltype(_func());
+
+        irods::smb::span_scope span{_name, _path};
+
+        // Calls on a context share its connection. The scheduler decides which
+        // waiting call goes next. Walks take it for each step, so that their
+        // callbacks may call into the library.
+        std::optional<irods::smb::rpc_scheduler::slot> slot;
+
+        if (_op != irods::smb::trace_op::walk)
+        {
+            slot.emplace(irods::smb::in_span("queued", nullptr, [&] {
+                return _ctx->scheduler.acquire(rpc_class_of(_op));
+            }));
+        }
+
+        if (!_ctx->trace && !irods::smb::span_recorder::instance().enabled())
+            return _func();
+
+        using clock_type = std::chrono::steady_clock;
+        using irods::smb::trace_op;
+
+        irods::smb::trace_record record{};
+        record.op = _op;
+        record.path = _path ? _path : "";
+        record.path2 = _path2 ? _path2 : "";
+        std::copy_n(std::begin(_args), std::min<std::size_t>(_args.size(), 3), record.args);
+
+        const auto start = clock_type::now();
+
+        const auto finish = [&](std::int64_t _result) {
+            const auto transfer =
+                _op == trace_op::read || _op == trace_op::pread || _op == trace_op::write || _op == trace_op::pwrite;
+
+            if (transfer && _result >= 0)
+                span.set_bytes(_result);
+
+            if (!_ctx->trace)
+                return;
+
+            const auto end = clock_type::now();
+            record.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start - _ctx->trace_started_at).count();
+            record.duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            record.result = _result;
+            _ctx->trace->record(record);
+        };
+
+        if constexpr (std::is_void_v<result_type>)
+        {
+            _func();
+            finish(0);
+        }
+        else
+        {
+            auto result = _func();
+
+            if constexpr (std::is_pointer_v<result_type>)
+                finish(result ? 1 : 0);
+            else
+                finish(static_cast<std::int64_t>(result));
+
+            return result;
+        }
+    }
+}
+
+using irods::smb::trace_op;
+
+auto ismb_stat(irods_context* _ctx, const char* _path, irods_stat_info* _stat_info) -> error_code
+{
+    return traced(_ctx, trace_op::stat, __func__, _path, nullptr, {}, [&] {
+        return ismb_stat_impl(_ctx, _path, _stat_info);
+    });
+}
+
+auto ismb_list(irods_context* _ctx, const char* _path, irods_string_array* _entries) -> void
+{
+    traced(_ctx, trace_op::list, __func__, _path, nullptr, {}, [&] {
+        ismb_list_impl(_ctx, _path, _entries);
+    });
+}
+
+auto ismb_chdir(irods_context* _ctx, const char* _target_dir) -> error_code
+{
+    return traced(_ctx, trace_op::chdir, __func__, _target_dir, nullptr, {}, [&] {
+        return ismb_chdir_impl(_ctx, _target_dir);
+    });
+}
+
+auto ismb_opendir(irods_context* _ctx, const char* _path, irods_collection_stream** _coll_stream) -> error_code
+{
+    return traced(_ctx, trace_op::opendir, __func__, _path, nullptr, {}, [&] {
+        return ismb_opendir_impl(_ctx, _path, _coll_stream);
+    });
+}
+
+auto ismb_readdir(irods_context* _ctx, irods_collection_stream* _coll_stream) -> dirent*
+{
+    return traced(_ctx, trace_op::readdir, __func__, nullptr, nullptr, {}, [&] {
+        return ismb_readdir_impl(_ctx, _coll_stream);
+    });
+}
+
+auto ismb_closedir(irods_context* _ctx, irods_collection_stream* _coll_stream) -> void
+{
+    traced(_ctx, trace_op::closedir, __func__, nullptr, nullptr, {}, [&] {
+        ismb_closedir_impl(_ctx, _coll_stream);
+    });
+}
+
+auto ismb_mkdir(irods_context* _ctx, const char* _path) -> error_code
+{
+    return traced(_ctx, trace_op::mkdir, __func__, _path, nullptr, {}, [&] {
+        return ismb_mkdir_impl(_ctx, _path);
+    });
+}
+
+auto ismb_rmdir(irods_context* _ctx, const char* _path) -> error_code
+{
+    return traced(_ctx, trace_op::rmdir, __func__, _path, nullptr, {}, [&] {
+        return ismb_rmdir_impl(_ctx, _path);
+    });
+}
+
+auto ismb_rmtree(irods_context* _ctx, const char* _path, int _no_trash) -> error_code
+{
+    return traced(_ctx, trace_op::rmtree, __func__, _path, nullptr, {_no_trash}, [&] {
+        return ismb_rmtree_impl(_ctx, _path, _no_trash);
+    });
+}
+
+auto ismb_open(irods_context* _ctx, const char* _filename, int _flags, int _mode) -> int
+{
+    return traced(_ctx, trace_op::open, __func__, _filename, nullptr, {_flags, _mode}, [&] {
+        return ismb_open_impl(_ctx, _filename, _flags, _mode);
+    });
+}
+
+auto ismb_close(irods_context* _ctx, int _fd) -> int
+{
+    return traced(_ctx, trace_op::close, __func__, nullptr, nullptr, {_fd}, [&] {
+        return ismb_close_impl(_ctx, _fd);
+    });
+}
+
+auto ismb_read(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size) -> int
+{
+    return traced(_ctx, trace_op::read, __func__, nullptr, nullptr, {_fd, _buffer_size}, [&] {
+        return ismb_read_impl(_ctx, _fd, _buffer, _buffer_size);
+    });
+}
+
+auto ismb_pread(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size, long long _offset) -> int
+{
+    return traced(_ctx, trace_op::pread, __func__, nullptr, nullptr, {_fd, _buffer_size, _offset}, [&] {
+        return ismb_pread_impl(_ctx, _fd, _buffer, _buffer_size, _offset);
+    });
+}
+
+auto ismb_write(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size) -> int
+{
+    return traced(_ctx, trace_op::write, __func__, nullptr, nullptr, {_fd, _buffer_size}, [&] {
+        return ismb_write_impl(_ctx, _fd, _buffer, _buffer_size);
+    });
+}
+
+auto ismb_pwrite(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size, long long _offset) -> int
+{
+    return traced(_ctx, trace_op::pwrite, __func__, nullptr, nullptr, {_fd, _buffer_size, _offset}, [&] {
+        return ismb_pwrite_impl(_ctx, _fd, _buffer, _buffer_size, _offset);
+    });
+}
+
+auto ismb_lseek(irods_context* _ctx, int _fd, long long _offset, int _whence) -> long long
+{
+    return traced(_ctx, trace_op::lseek, __func__, nullptr, nullptr, {_fd, _offset, _whence}, [&] {
+        return ismb_lseek_impl(_ctx, _fd, _offset, _whence);
+    });
+}
+
+auto ismb_ftruncate(irods_context* _ctx, int _fd, long long _length) -> error_code
+{
+    return traced(_ctx, trace_op::ftruncate, __func__, nullptr, nullptr, {_fd, _length}, [&] {
+        return ismb_ftruncate_impl(_ctx, _fd, _length);
+    });
+}
+
+auto ismb_fstat(irods_context* _ctx, int _fd, irods_stat_info* _stat_info) -> error_code
+{
+    return traced(_ctx, trace_op::fstat, __func__, nullptr, nullptr, {_fd}, [&] {
+        return ismb_fstat_impl(_ctx, _fd, _stat_info);
+    });
+}
+
+auto ismb_unlink(irods_context* _ctx, const char* _filename) -> error_code
+{
+    return traced(_ctx, trace_op::unlink, __func__, _filename, nullptr, {}, [&] {
+        return ismb_unlink_impl(_ctx, _filename);
+    });
+}
+
+auto ismb_copy(irods_context* _ctx, const char* _src_path, const char* _dst_path, long long _offset, long long _length) -> error_code
+{
+    return traced(_ctx, trace_op::copy, __func__, _src_path, _dst_path, {_offset, _length}, [&] {
+        return ismb_copy_impl(_ctx, _src_path, _dst_path, _offset, _length);
+    });
+}
+
+auto ismb_rename(irods_context* _ctx, const char* _old_path, const char* _new_path) -> error_code
+{
+    return traced(_ctx, trace_op::rename, __func__, _old_path, _new_path, {}, [&] {
+        return ismb_rename_impl(_ctx, _old_path, _new_path);
+    });
+}
+
+auto ismb_dir_usage(irods_context* _ctx, const char* _path, long long* _total_bytes, long long* _object_count) -> error_code
+{
+    return traced(_ctx, trace_op::dir_usage, __func__, _path, nullptr, {}, [&] {
+        return ismb_dir_usage_impl(_ctx, _path, _total_bytes, _object_count);
+    });
+}
+
+auto ismb_statvfs(irods_context* _ctx, const char* _path, irods_statvfs_info* _statvfs_info) -> error_code
+{
+    return traced(_ctx, trace_op::statvfs, __func__, _path, nullptr, {}, [&] {
+        return ismb_statvfs_impl(_ctx, _path, _statvfs_info);
+    });
+}
+
+auto ismb_lookup_nocase(irods_context* _ctx, const char* _parent, const char* _name, char** _real_name) -> error_code
+{
+    return traced(_ctx, trace_op::lookup_nocase, __func__, _parent, _name, {}, [&] {
+        return ismb_lookup_nocase_impl(_ctx, _parent, _name, _real_name);
+    });
+}
+
+auto ismb_getxattr(irods_context* _ctx, const char* _path, const char* _name, char* _value, int _size) -> int
+{
+    return traced(_ctx, trace_op::getxattr, __func__, _path, _name, {_size}, [&] {
+        return ismb_getxattr_impl(_ctx, _path, _name, _value, _size);
+    });
+}
+
+auto ismb_listxattr(irods_context* _ctx, const char* _path, char* _list, int _size) -> int
+{
+    return traced(_ctx, trace_op::listxattr, __func__, _path, nullptr, {_size}, [&] {
+        return ismb_listxattr_impl(_ctx, _path, _list, _size);
+    });
+}
+
+auto ismb_setxattr(irods_context* _ctx, const char* _path, const char* _name, const char* _value, int _size) -> error_code
+{
+    return traced(_ctx, trace_op::setxattr, __func__, _path, _name, {_size}, [&] {
+        return ismb_setxattr_impl(_ctx, _path, _name, _value, _size);
+    });
+}
+
+auto ismb_removexattr(irods_context* _ctx, const char* _path, const char* _name) -> error_code
+{
+    return traced(_ctx, trace_op::removexattr, __func__, _path, _name, {}, [&] {
+        return ismb_removexattr_impl(_ctx, _path, _name);
+    });
+}
+
+auto ismb_walk(irods_context* _ctx,
+               const char* _root,
+               irods_walk_callback _callback,
+               const irods_walk_options* _options,
+               void* _user_data) -> error_code
+{
+    if (!_ctx)
+        return SYS_INVALID_INPUT_PARAM;
+
+    const auto opts = _options ? *_options : irods_walk_options{};
+
+    return traced(_ctx, trace_op::walk, __func__, _root, nullptr, {opts.max_depth, opts.threads, opts.page_size}, [&] {
+        return ismb_walk_impl(_ctx, _root, _callback, _options, _user_data);
+    });
+}
+
+auto ismb_changes_since(irods_context* _ctx, const char* _collection, long long* _cookie, irods_change_list* _changes) -> error_code
+{
+    if (!_ctx || !_cookie)
+        return SYS_INVALID_INPUT_PARAM;
+
+    return traced(_ctx, trace_op::changes_since, __func__, _collection, nullptr, {*_cookie}, [&] {
+        return ismb_changes_since_impl(_ctx, _collection, _cookie, _changes);
+    });
+}
+
+namespace
+{
+    auto connection_pool::fill(const rodsEnv& _env, std::size_t _size) -> error_code
+    {
+        {
+            std::lock_guard lock{mutex_};
+            env_ = _env;
+            target_ = _size;
+        }
+
+        const auto ec = top_up();
+
+        std::lock_guard lock{mutex_};
+
+        if (!refilling_ && target_ > 0)
+        {
+            refilling_ = true;
+            std::thread{&connection_pool::refill, this}.detach();
+        }
+
+        return ec;
+    }
+
+    auto connection_pool::top_up() -> error_code
+    {
+        for (;;)
+        {
+            std::optional<rodsEnv> env;
+
+            {
+                std::lock_guard lock{mutex_};
+
+                if (conns_.size() >= target_)
+                    return 0;
+
+                env = env_;
+                ++busy_;
+            }
+
+            // Connect without holding the lock. Forks wait for the login, but
+            // take() and put() do not.
+            auto* conn = connect(*env);
+
+            std::lock_guard lock{mutex_};
+            leave_client_library();
+
+            if (!conn)
+                return 1;
+
+            conns_.push_back({conn, clock_type::now()});
+        }
+    }
+
+    auto connection_pool::refill() -> void
+    {
+        bool failed = false;
+
+        for (;;)
+        {
+            std::vector<pooled_connection> stale;
+
+            {
+                std::unique_lock lock{mutex_};
+
+                // A failed login is only retried at the next check.
+                if (failed)
+                    refill_.wait_for(lock, check_interval);
+                else
+                    refill_.wait_for(lock, check_interval, [this] { return conns_.size() < target_; });
+
+                // Connections idle for long are replaced before a session gets
+                // one the server may be about to drop.
+                const auto now = clock_type::now();
+
+                for (auto iter = std::begin(conns_); iter != std::end(conns_);)
+                {
+                    if (now - iter->since < max_idle && usable(iter->conn))
+                    {
+                        ++iter;
+                        continue;
+                    }
+
+                    stale.push_back(*iter);
+                    iter = conns_.erase(iter);
+                }
+
+                if (!stale.empty())
+                    ++busy_;
+            }
+
+            if (!stale.empty())
+            {
+                for (const auto& c : stale)
+                {
+                    if (usable(c.conn))
+                        rcDisconnect(c.conn);
+                    else
+                        release(c.conn);
+                }
+
+                std::lock_guard lock{mutex_};
+                leave_client_library();
+            }
+
+            failed = top_up() != 0;
+        }
+    }
+
+    auto open_inline(irods_context& _ctx, dataObjInp_t& _args, const irods_stat_info& _stat_info) -> int
+    {
+        _args.dataSize = _stat_info.size;
+        _args.numThreads = NO_THREADING;
+
+        portalOprOut_t* portal{};
+        bytesBuf_t data{};
+
+        const auto ec = irods::smb::in_span("rcDataObjGet", _args.objPath, [&] {
+            return _rcDataObjGet(_ctx.conn, &_args, &portal, &data);
+        });
+
+        if (ec < 0)
+        {
+            std::free(portal);
+            std::free(data.buf);
+            return ec;
+        }
+
+        // The server chose a parallel transfer. Abandon it and let the caller open
+        // the object normally.
+        if (portal && portal->numThreads > 0)
+        {
+            irods::smb::in_span("rcOprComplete", nullptr, [&] { return rcOprComplete(_ctx.conn, portal->l1descInx); });
+            std::free(portal);
+            std::free(data.buf);
+            return SYS_NOT_SUPPORTED;
+        }
+
+        std::free(portal);
+
+        auto content = std::make_unique<std::vector<char>>();
+
+        if (data.len > 0)
+        {
+            const auto* first = static_cast<const char*>(data.buf);
+            content->assign(first, first + data.len);
+        }
+
+        std::free(data.buf);
+
+        // The object may have changed since its attributes were cached.
+        if (static_cast<long long>(content->size()) != _stat_info.size)
+            return SYS_COPY_LEN_ERR;
+
+        const auto fd = allocate_local_fd(_ctx);
+
+        auto& desc = _ctx.descriptors[fd];
+        desc = {};
+        desc.size = static_cast<std::int64_t>(content->size());
+        desc.content = std::move(content);
+
+        return fd;
+    }
+
+    auto allocate_local_fd(irods_context& _ctx) -> int
+    {
+        const auto fd = _ctx.next_inline_fd++;
+
+        if (_ctx.next_inline_fd == std::numeric_limits<int>::max())
+            _ctx.next_inline_fd = inline_fd_base;
+
+        return fd;
+    }
+
+    auto unpark(irods_context& _ctx, const std::string& _path, int _flags) -> int
+    {
+        for (auto iter = std::begin(_ctx.parked); iter != std::end(_ctx.parked); ++iter)
+        {
+            if (iter->path != _path || iter->desc.open_flags != _flags)
+                continue;
+
+            if (!_ctx.fd.map(_path, iter->fd))
+                return -1;
+
+            const auto fd = iter->fd;
+            auto& desc = _ctx.descriptors[fd];
+            desc = std::move(iter->desc);
+            desc.offset = 0; // The server offset is left alone and corrected lazily.
+            _ctx.parked.erase(iter);
+
+            return fd;
+        }
+
+        return -1;
+    }
+
+    auto park(irods_context& _ctx, const std::string& _path, int _fd, descriptor&& _desc) -> void
+    {
+        constexpr std::size_t max_parked = 16;
+
+        if (_ctx.parked.size() >= max_parked)
+        {
+            _ctx.parked.front().expires_at = {};
+            close_expired_parked(_ctx);
+        }
+
+        _ctx.parked.push_back({_path, _fd, std::move(_desc), std::chrono::steady_clock::now() + _ctx.opts.deferred_close});
+    }
+
+    auto close_parked(irods_context& _ctx, const std::string& _path) -> void
+    {
+        for (auto& p : _ctx.parked)
+        {
+            if (p.path == _path || boost::starts_with(p.path, _path + '/'))
+                p.expires_at = {};
+        }
+
+        close_expired_parked(_ctx);
+    }
+
+    auto close_expired_parked(irods_context& _ctx, bool _all) -> void
+    {
+        const auto now = std::chrono::steady_clock::now();
+
+        for (auto iter = std::begin(_ctx.parked); iter != std::end(_ctx.parked);)
+        {
+            if (!_all && iter->expires_at > now)
+            {
+                ++iter;
+                continue;
+            }
+
+            openedDataObjInp_t args{};
+            args.l1descInx = iter->desc.server_fd;
+            irods::smb::in_span("rcDataObjClose", nullptr, [&] { return rcDataObjClose(_ctx.conn, &args); });
+
+            iter = _ctx.parked.erase(iter);
+        }
+    }
+
+    auto seek(irods_context& _ctx, descriptor& _desc, std::int64_t _offset) -> error_code
+    {
+        if (_desc.server_offset == _offset)
+            return 0;
+
+        openedDataObjInp_t args{};
+        args.l1descInx = _desc.server_fd;
+        args.offset = _offset;
+        args.whence = SEEK_SET;
+
+        fileLseekOut_t* out{};
+        const auto ec = irods::smb::in_span("rcDataObjLseek", nullptr, [&] {
+            return rcDataObjLseek(_ctx.conn, &args, &out);
+        });
+        std::free(out);
+
+        if (ec < 0)
+        {
+            _desc.server_offset = -1;
+            return ec;
+        }
+
+        _desc.server_offset = _offset;
+
+        return 0;
+    }
+
+    // Transfers _size bytes with RPCs of at most transfer_chunk_size bytes.
+    // _rpc(_offset, _count) moves _count bytes starting _offset bytes into the
+    // caller's buffer. Between RPCs, waiting interactive calls get the connection.
+    // Returns the number of bytes transferred or the first error. _elapsed
+    // receives the time spent in RPCs.
+    template <typename Function>
+    auto transfer_in_chunks(irods_context& _ctx, int _size, std::chrono::steady_clock::duration& _elapsed, Function _rpc) -> int
+    {
+        const auto chunk_size = _ctx.opts.transfer_chunk_size > 0 ? _ctx.opts.transfer_chunk_size : _size;
+        int total = 0;
+
+        _elapsed = {};
+
+        do
+        {
+            if (total > 0)
+                _ctx.scheduler.yield(irods::smb::rpc_class::foreground);
+
+            const auto count = std::min(chunk_size, _size - total);
+            const auto start = std::chrono::steady_clock::now();
+            const auto ec = _rpc(total, count);
+            _elapsed += std::chrono::steady_clock::now() - start;
+
+            if (ec < 0)
+                return ec;
+
+            total += ec;
+
+            if (ec < count)
+                break;
+        }
+        while (total < _size);
+
+        return total;
+    }
+
+    auto read_from_server(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, void* _buffer, int _size) -> int
+    {
+        if (auto ec = seek(_ctx, _desc, _offset); ec < 0)
+            return ec;
+
+        std::chrono::steady_clock::duration elapsed;
+
+        const auto bytes_read = transfer_in_chunks(_ctx, _size, elapsed, [&](int _chunk_offset, int _count) {
+            openedDataObjInp_t args{};
+            args.l1descInx = _desc.server_fd;
+            args.len = _count;
+
+            bytesBuf_t buf{};
+            buf.buf = static_cast<char*>(_buffer) + _chunk_offset;
+            buf.len = _count;
+
+            return irods::smb::in_span("rcDataObjRead", nullptr, [&] {
+                return rcDataObjRead(_ctx.conn, &args, &buf);
+            }, true);
+        });
+
+        if (bytes_read > 0)
+            _ctx.resource_stats.record(_desc.resource, bytes_read, elapsed);
+
+        if (bytes_read < 0)
+            _desc.server_offset = -1;
+        else
+            _desc.server_offset += bytes_read;
+
+        return bytes_read;
+    }
+
+    auto read_through_block_cache(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, void* _buffer, int _size) -> int
+    {
+        auto& cache = *_ctx.blocks;
+        const auto block_size = cache.block_size();
+        auto* out = static_cast<char*>(_buffer);
+        std::int64_t total = 0;
+        std::vector<char> block;
+
+        while (total < _size)
+        {
+            const auto block_index = (_offset + total) / block_size;
+            const auto block_offset = (_offset + total) % block_size;
+            const auto wanted = std::min<std::int64_t>(_size - total, block_size - block_offset);
+
+            const irods::smb::block_cache::key_type key{_desc.data_id,
+                                                        _desc.replica_number,
+                                                        _desc.modify_time,
+                                                        _desc.replica_size,
+                                                        irods::smb::block_cache::checksum_tag(_desc.replica_checksum),
+                                                        block_index};
+
+            auto n = cache.read(key, block_offset, out + total, wanted);
+
+            if (n < 0)
+            {
+                // Miss. Fetch the whole block so that later reads of it are local.
+                block.resize(static_cast<std::size_t>(block_size));
+                std::int64_t block_bytes = 0;
+
+                while (block_bytes < block_size)
+                {
+                    const auto bytes_read = read_from_server(_ctx, _fd, _desc, block_index * block_size + block_bytes,
+                                                             block.data() + block_bytes,
+                                                             static_cast<int>(block_size - block_bytes));
+
+                    if (bytes_read < 0)
+                        return total > 0 ? static_cast<int>(total) : bytes_read;
+
+                    if (bytes_read == 0)
+                        break;
+
+                    block_bytes += bytes_read;
+                }
+
+                // Short blocks are only written at the end of the object.
+                cache.write(key, block.data(), block_bytes);
+
+                n = std::max<std::int64_t>(0, std::min(wanted, block_bytes - block_offset));
+                std::memcpy(out + total, block.data() + block_offset, static_cast<std::size_t>(n));
+            }
+
+            total += n;
+
+            if (n < wanted)
+                break; // End of object.
+        }
+
+        return static_cast<int>(total);
+    }
+
+    auto stat_path(irods_context& _ctx, const std::string& _abs_path, irods_stat_info* _stat_info) -> error_code
+    {
+        rodsObjStat_t* stat_info_ptr{};
+        dataObjInp_t data_obj_input{};
+
+        std::strncpy(data_obj_input.objPath, _abs_path.c_str(), _abs_path.length());
+        std::cout << __func__ << " :: data_obj_input.objPath = " << data_obj_input.objPath << '\n';
+
+        apply_prefetched(_ctx);
+
+        if (_ctx.attrs.lookup(data_obj_input.objPath, *_stat_info))
+        {
+            std::cout << __func__ << " :: cache hit.\n";
+
+            if (_ctx.prefetch && _ctx.prefetched_paths.erase(data_obj_input.objPath) > 0)
+                _ctx.prefetch->record_hit();
+
+            // Inode numbers are per-process. The entry may have come from another process.
+            _stat_info->id = _ctx.fsys.insert(data_obj_input.objPath);
+            return 0;
+        }
+
+        write_snapshot(_ctx, false);
+
+        if (warm_from_snapshot(_ctx, data_obj_input.objPath) && _ctx.attrs.lookup(data_obj_input.objPath, *_stat_info))
+        {
+            std::cout << __func__ << " :: revalidated snapshot entry.\n";
+            return 0;
+        }
+
+        const auto ec = irods::smb::in_span("rcObjStat", data_obj_input.objPath, [&] {
+            return rcObjStat(_ctx.conn, &data_obj_input, &stat_info_ptr);
+        });
+
+        if (ec < 0)
+            return ec;
+
+        std::cout << std::boolalpha;
+        std::cout << "found stat info: " << (stat_info_ptr != nullptr) << '\n';
+
+        if (stat_info_ptr)
+        {
+#if 0
+        std::cout << "\nstat results for [" << _abs_path << "]\n";
+        std::cout << "- object size = " << stat_info_ptr->objSize << '\n';
+        std::cout << "- object type = " << stat_info_ptr->objType << '\n';
+        std::cout << "- data mode   = " << stat_info_ptr->dataMode << '\n';
+        std::cout << "- data id     = " << stat_info_ptr->dataId << '\n';
+        std::cout << "- checksum    = " << stat_info_ptr->chksum << '\n';
+        std::cout << "- owner name  = " << stat_info_ptr->ownerName << '\n';
+        std::cout << "- owner zone  = " << stat_info_ptr->ownerZone << '\n';
+        std::cout << "- create time = " << stat_info_ptr->createTime << '\n';
+        std::cout << "- modify time = " << stat_info_ptr->modifyTime << '\n';
+        std::cout << "- resc. hier  = " << stat_info_ptr->rescHier << '\n';
+        std::cout << '\n';
+#endif
+
+            _ctx.fsys.insert(data_obj_input.objPath);
+
+            std::memset(_stat_info, 0, sizeof(irods_stat_info));
+
+            _stat_info->size = stat_info_ptr->objSize;
+            _stat_info->type = stat_info_ptr->objType;
+            _stat_info->mode = static_cast<int>(stat_info_ptr->dataMode);
+            _stat_info->id = _ctx.fsys.insert(data_obj_input.objPath);
+            std::strncpy(_stat_info->owner_name, stat_info_ptr->ownerName, strlen(stat_info_ptr->ownerName));
+            std::strncpy(_stat_info->owner_zone, stat_info_ptr->ownerZone, strlen(stat_info_ptr->ownerZone));
+            _stat_info->creation_time = std::stoll(stat_info_ptr->createTime);
+            _stat_info->modified_time = std::stoll(stat_info_ptr->modifyTime);
+
+            freeRodsObjStat(stat_info_ptr);
+
+            _ctx.attrs.insert(data_obj_input.objPath, *_stat_info);
+        }
+
+        return 0;
+    }
+
+    auto read_at(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, void* _buffer, int _size) -> int
+    {
+        if (_desc.content)
+        {
+            const auto& content = *_desc.content;
+            const auto offset = std::min<std::int64_t>(_offset, static_cast<std::int64_t>(content.size()));
+            const auto count = std::min<std::int64_t>(_size, static_cast<std::int64_t>(content.size()) - offset);
+
+            std::memcpy(_buffer, content.data() + offset, static_cast<std::size_t>(count));
+
+            return static_cast<int>(count);
+        }
+
+        if (_ctx.blocks && !_desc.data_id.empty())
+            return read_through_block_cache(_ctx, _fd, _desc, _offset, _buffer, _size);
+
+        return read_from_server(_ctx, _fd, _desc, _offset, _buffer, _size);
+    }
+
+    auto write_at(irods_context& _ctx, int _fd, descriptor& _desc, std::int64_t _offset, const void* _buffer, int _size) -> int
+    {
+        if (_desc.content)
+            return SYS_INVALID_INPUT_PARAM;
+
+        try
+        {
+            _ctx.attrs.erase(_ctx.fd.path(_fd));
+        }
+        catch (const std::out_of_range&)
+        {
+        }
+
+        // Only costs a round trip when the write is not contiguous with the
+        // previous operation on this descriptor.
+        if (auto ec = seek(_ctx, _desc, _offset); ec < 0)
+            return ec;
+
+        std::chrono::steady_clock::duration elapsed;
+
+        const auto bytes_written = transfer_in_chunks(_ctx, _size, elapsed, [&](int _chunk_offset, int _count) {
+            openedDataObjInp_t obj_args{};
+            obj_args.l1descInx = _desc.server_fd;
+            obj_args.len = _count;
+
+            bytesBuf_t buf_args{};
+            buf_args.buf = const_cast<char*>(static_cast<const char*>(_buffer)) + _chunk_offset;
+            buf_args.len = _count;
+
+            return irods::smb::in_span("rcDataObjWrite", nullptr, [&] {
+                return rcDataObjWrite(_ctx.conn, &obj_args, &buf_args);
+            }, true);
+        });
+
+        if (bytes_written > 0)
+            _ctx.resource_stats.record(_desc.resource, bytes_written, elapsed);
+
+        if (bytes_written < 0)
+        {
+            // The server-side offset is unknown now.
+            _desc.checksum.reset();
+            _desc.server_offset = -1;
+            return bytes_written;
+        }
+
+        if (bytes_written == 0)
+            return 0;
+
+        const auto end = _offset + bytes_written;
+
+        if (_desc.checksum)
+        {
+            if (_offset == _desc.checksummed)
+            {
+                _desc.checksum->update(_buffer, static_cast<std::size_t>(bytes_written));
+                _desc.checksummed = end;
+            }
+            else
+            {
+                _desc.checksum.reset(); // Not written in order.
+            }
+        }
+
+        _desc.server_offset = end;
+
+        if (_desc.size >= 0)
+            _desc.size = std::max(_desc.size, end);
 
-    const auto cwd = (fs::path{_ctx->cwd} / _target_dir).generic_string();
+        if (_desc.stat_info)
+            _desc.stat_info->modified_time = static_cast<long long>(std::time(nullptr));
 
-    std::cout << __func__ << " :: possible new working directory = " << cwd << '\n';
+        // Record the range, merging it with any ranges it touches.
+        auto first = _offset;
+        auto last = end;
+        auto iter = _desc.dirty.upper_bound(first);
 
-    auto sql = "select count(COLL_NAME) where COLL_NAME = '"s;
-    sql += cwd;
-    sql += "'";
+        if (iter != std::begin(_desc.dirty) && std::prev(iter)->second >= first)
+            --iter;
+
+        while (iter != std::end(_desc.dirty) && iter->first <= last)
+        {
+            first = std::min(first, iter->first);
+            last = std::max(last, iter->second);
+            iter = _desc.dirty.erase(iter);
+        }
+
+        _desc.dirty.emplace(first, last);
+
+        return bytes_written;
+    }
+
+    auto prefetcher::run() -> void
+    {
+        for (;;)
+        {
+            request req;
+
+            {
+                std::unique_lock lock{mutex_};
+                cv_.wait(lock, [this] { return stopping_ || pending_; });
+
+                if (stopping_)
+                    return;
+
+                req = std::move(*pending_);
+                pending_.reset();
+            }
+
+            // A spare pooled connection costs nothing. Otherwise, log in from this
+            // thread so that the foreground never pays for it.
+            if (!conn_)
+                pooled_ = (conn_ = connection_pool::instance().take()) != nullptr;
+
+            if (!conn_ && (conn_ = connect(env_), !conn_))
+            {
+                std::lock_guard lock{mutex_};
+                ++stats_.failed;
+                continue;
+            }
+
+            prefetch_results results{req.collection, req.generation, {}, {}};
+            const auto complete = fetch(req, results);
+
+            std::lock_guard lock{mutex_};
+
+            if (complete)
+                ++stats_.completed;
+            else
+                ++stats_.truncated;
+
+            stats_.entries += static_cast<long long>(results.entries.size());
+            results_.push_back(std::move(results));
+        }
+    }
+
+    auto prefetcher::fetch(const request& _request, prefetch_results& _results) -> bool
+    {
+        int rows = 0;
+
+        // Stops the prefetch once the row budget is spent or the session ends.
+        const auto over_budget = [this, &rows, &_request] {
+            return ++rows > _request.max_rows || stopping_;
+        };
+
+        const auto to_int64 = [](const std::string& _value) {
+            return _value.empty() ? 0LL : std::stoll(_value);
+        };
+
+        try
+        {
+            std::vector<std::pair<std::string, irods_stat_info>> children;
+
+            auto sql = "select COLL_NAME, COLL_OWNER_NAME, COLL_OWNER_ZONE, COLL_CREATE_TIME, COLL_MODIFY_TIME "
+                       "where COLL_PARENT_NAME = '" + _request.collection + "'";
+
+            for (const auto& row : irods::query{conn_, sql})
+            {
+                if (over_budget())
+                    return false;
+
+                if (row[0] != _request.collection) // The root collection is its own parent.
+                    children.emplace_back(row[0], make_stat_info(IOT_COLLECTION, 0, 0, row[1], row[2], to_int64(row[3]), to_int64(row[4])));
+            }
+
+            // Explorer shows folders in name order. The first ones are the most
+            // likely to be opened.
+            std::sort(std::begin(children), std::end(children), [](const auto& _a, const auto& _b) {
+                return _a.first < _b.first;
+            });
+
+            if (children.size() > static_cast<std::size_t>(_request.children))
+                children.resize(static_cast<std::size_t>(_request.children));
+
+            if (children.empty())
+                return true;
+
+            std::map<std::string, std::vector<std::string>> listings;
+            std::string in_list;
+
+            for (const auto& [path, stat_info] : children)
+            {
+                listings[path];
+                in_list += in_list.empty() ? "'" : ", '";
+                in_list += path;
+                in_list += '\'';
+            }
+
+            _results.entries = std::move(children);
+
+            // Replicas appear once per row. Every object is listed, including
+            // ones without a good replica (e.g. being written), since the listings
+            // feed the name index. Attributes are only taken from a good replica.
+            std::unordered_set<std::string> listed;
+            std::unordered_set<std::string> stated;
+
+            sql = "select COLL_NAME, DATA_NAME, DATA_SIZE, DATA_MODE, DATA_OWNER_NAME, DATA_OWNER_ZONE, DATA_CREATE_TIME, DATA_MODIFY_TIME, "
+                  "DATA_REPL_STATUS where COLL_NAME in (" + in_list + ")";
+
+            // This is the bulk of the rows. They are consumed column by column so
+            // that the numeric columns are converted in one pass per page.
+            bool truncated = false;
+
+            const auto ec = irods::smb::for_each_page(conn_, sql, [&](irods::smb::column_page& _page) {
+                const auto collections = _page.strings(0);
+                const auto names = _page.strings(1);
+                const auto sizes = _page.int64s(2);
+                const auto modes = _page.int64s(3);
+                const auto owner_names = _page.strings(4);
+                const auto owner_zones = _page.strings(5);
+                const auto ctimes = _page.int64s(6);
+                const auto mtimes = _page.int64s(7);
+                const auto statuses = _page.strings(8);
+
+                for (std::size_t i = 0; i < _page.rows(); ++i)
+                {
+                    if (over_budget())
+                    {
+                        truncated = true;
+                        return false;
+                    }
+
+                    std::string collection{collections[i]};
+                    std::string name{names[i]};
+                    auto path = collection + '/' + name;
+
+                    if (listed.insert(path).second)
+                        listings[collection].push_back(std::move(name));
+
+                    if (statuses[i] != "1" || !stated.insert(path).second)
+                        continue;
+
+                    _results.entries.emplace_back(std::move(path), make_stat_info(IOT_DATA_OBJECT, sizes[i], static_cast<int>(modes[i]),
+                                                                                  owner_names[i], owner_zones[i], ctimes[i], mtimes[i]));
+                }
+
+                return true;
+            });
+
+            if (truncated || ec < 0)
+                return false;
+
+            sql = "select COLL_PARENT_NAME, COLL_NAME, COLL_OWNER_NAME, COLL_OWNER_ZONE, COLL_CREATE_TIME, COLL_MODIFY_TIME "
+                  "where COLL_PARENT_NAME in (" + in_list + ")";
+
+            for (const auto& row : irods::query{conn_, sql})
+            {
+                if (over_budget())
+                    return false;
+
+                listings[row[0]].push_back(filename(row[1]));
+                _results.entries.emplace_back(row[1], make_stat_info(IOT_COLLECTION, 0, 0, row[2], row[3], to_int64(row[4]), to_int64(row[5])));
+            }
+
+            // Listings are only handed out once they are known to be complete.
+            for (auto& [collection, names] : listings)
+                _results.listings.emplace_back(collection, std::move(names));
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << __func__ << " :: " << e.what() << '\n';
+            return false;
+        }
+
+        return true;
+    }
+
+    auto apply_prefetched(irods_context& _ctx) -> void
+    {
+        std::vector<prefetch_results> results;
+
+        if (!_ctx.prefetch || !_ctx.prefetch->take_results(results))
+            return;
+
+        // Bounds the bookkeeping for hit statistics. Entries that were never used
+        // have long expired by then.
+        if (_ctx.prefetched_paths.size() > 65536)
+            _ctx.prefetched_paths.clear();
 
-    for (const auto& row : irods::query{_ctx->conn, sql})
+        for (auto& r : results)
+        {
+            // Something below the collection was modified while the queries ran.
+            // The results may describe the tree as it was before that.
+            if (_ctx.attrs.changed_since(r.collection, r.generation))
+            {
+                _ctx.prefetch->record_discarded(static_cast<long long>(r.entries.size()));
+                continue;
+            }
+
+            for (auto& [path, stat_info] : r.entries)
+            {
+                // What the session fetched itself is at least as recent.
+                if (irods_stat_info existing{}; _ctx.attrs.lookup(path, existing))
+                    continue;
+
+                stat_info.id = _ctx.fsys.insert(path);
+                _ctx.attrs.insert(path, stat_info);
+                _ctx.prefetched_paths.insert(path);
+            }
+
+            for (const auto& [collection, names] : r.listings)
+            {
+                if (!_ctx.names.find(collection))
+                    _ctx.names.build(collection, names);
+            }
+        }
+    }
+
+    auto schedule_prefetch(irods_context& _ctx, const std::string& _collection) -> void
+    {
+        if (_ctx.opts.prefetch_children <= 0 || !_ctx.attrs.enabled())
+            return;
+
+        if (!_ctx.prefetch)
+            _ctx.prefetch = std::make_unique<prefetcher>(_ctx.env);
+
+        _ctx.prefetch->schedule({_collection, _ctx.opts.prefetch_children, _ctx.opts.prefetch_max_rows, _ctx.attrs.generation()});
+    }
+
+    auto walker::run() -> void
+    {
+        auto* conn = connection_pool::instance().take();
+        const auto pooled = conn != nullptr;
+
+        if (!conn)
+            conn = connect(env_);
+
+        int ec = conn ? 0 : USER_SOCK_CONNECT_ERR;
+
+        for (auto i = next_unit_++; ec == 0 && i < units_.size(); i = next_unit_++)
+            ec = fetch(conn, units_[i]);
+
+        // Pooled connections are kept warm for other sessions. One that saw an
+        // error may be broken and is not handed back.
+        if (pooled && ec >= 0)
+            connection_pool::instance().put(conn);
+        else if (conn)
+            rcDisconnect(conn);
+
+        std::lock_guard lock{mutex_};
+
+        if (ec < 0 && ec_ == 0)
+            ec_ = ec;
+
+        if (--running_ == 0)
+            ready_.notify_all();
+    }
+
+    auto walker::fetch(rcComm_t* _conn, const walk_unit& _unit) -> int
+    {
+        std::string sql = "select COLL_NAME, DATA_NAME, DATA_SIZE, DATA_MODE, DATA_OWNER_NAME, DATA_OWNER_ZONE, "
+                          "DATA_CREATE_TIME, DATA_MODIFY_TIME, DATA_ID where ";
+
+        const auto& first = _unit.collections.front();
+        const auto prefix = first == "/" ? first : first + '/';
+
+        if (_unit.below)
+        {
+            sql += "COLL_NAME like '" + prefix + "%'";
+        }
+        else
+        {
+            std::string in_list;
+
+            for (const auto& collection : _unit.collections)
+            {
+                in_list += in_list.empty() ? "'" : ", '";
+                in_list += collection;
+                in_list += '\'';
+            }
+
+            sql += "COLL_NAME in (" + in_list + ")";
+        }
+
+        // Replicas appear once per row. Good replicas are listed first so that
+        // their attributes represent the object. Objects without one (e.g. being
+        // written or with stale replicas only) follow.
+        std::unordered_set<std::int64_t> seen;
+        bool stopped = false;
+
+        const auto on_page = [&](irods::smb::column_page& _page) {
+            const auto collections = _page.strings(0);
+            const auto names = _page.strings(1);
+            const auto sizes = _page.int64s(2);
+            const auto modes = _page.int64s(3);
+            const auto owner_names = _page.strings(4);
+            const auto owner_zones = _page.strings(5);
+            const auto ctimes = _page.int64s(6);
+            const auto mtimes = _page.int64s(7);
+            const auto ids = _page.int64s(8);
+
+            std::vector<walk_entry> batch;
+            batch.reserve(_page.rows());
+
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+            {
+                // Underscores in the like pattern match any character.
+                if (_unit.below && collections[i].substr(0, prefix.size()) != prefix)
+                    continue;
+
+                if (!seen.insert(ids[i]).second)
+                    continue;
+
+                auto path = std::string{collections[i]};
+
+                if (path != "/")
+                    path += '/';
+
+                path += names[i];
+
+                batch.push_back({std::move(path), make_stat_info(IOT_DATA_OBJECT, sizes[i], static_cast<int>(modes[i]),
+                                                                 owner_names[i], owner_zones[i], ctimes[i], mtimes[i])});
+            }
+
+            stopped = !push(std::move(batch));
+
+            return !stopped;
+        };
+
+        auto ec = irods::smb::for_each_page(_conn, sql + " and DATA_REPL_STATUS = '1'", on_page, page_size_);
+
+        if (!stopped && ec >= 0)
+            ec = irods::smb::for_each_page(_conn, sql + " and DATA_REPL_STATUS <> '1'", on_page, page_size_);
+
+        return stopped ? 1 : ec;
+    }
+
+    auto walker::push(std::vector<walk_entry>&& _batch) -> bool
+    {
+        std::unique_lock lock{mutex_};
+        space_.wait(lock, [this] { return stopping_ || batches_.size() < max_batches; });
+
+        if (stopping_)
+            return false;
+
+        if (!_batch.empty())
+        {
+            batches_.push_back(std::move(_batch));
+            ready_.notify_one();
+        }
+
+        return true;
+    }
+
+    auto make_walk_units(const std::string& _root,
+                         const std::vector<walk_entry>& _collections,
+                         int _max_depth,
+                         std::size_t _target_size) -> std::vector<walk_unit>
     {
-        for (const auto& value : row)
+        struct node
+        {
+            std::vector<std::string> children;
+            std::size_t size = 1; // Collections in the subtree, including this one.
+            int height = 0;       // Levels below this collection.
+        };
+
+        std::map<std::string, node> nodes;
+        nodes[_root];
+
+        const auto parent_of = [](const std::string& _path) {
+            const auto pos = _path.find_last_of('/');
+            return pos == 0 ? std::string{"/"} : _path.substr(0, pos);
+        };
+
+        // Collections the user cannot see may leave gaps. Those are filled in so
+        // that every collection hangs off the root.
+        for (const auto& c : _collections)
+        {
+            if (nodes.count(c.path) > 0)
+                continue;
+
+            nodes[c.path];
+
+            for (auto path = c.path;;)
+            {
+                auto parent = parent_of(path);
+                const auto known = nodes.count(parent) > 0;
+                nodes[parent].children.push_back(path);
+
+                if (known)
+                    break;
+
+                path = std::move(parent);
+            }
+        }
+
+        // Children sort after their parents.
+        for (auto iter = nodes.rbegin(); iter != nodes.rend(); ++iter)
         {
-            if (value == "1")
+            for (const auto& child : iter->second.children)
             {
-                _ctx->cwd = cwd;
-                std::cout << __func__ << " :: new working directory = " << _ctx->cwd << '\n';
+                const auto& n = nodes[child];
+                iter->second.size += n.size;
+                iter->second.height = std::max(iter->second.height, n.height + 1);
+            }
+        }
+
+        const auto prefix = _root == "/" ? _root : _root + '/';
+
+        const auto depth_of = [&](const std::string& _path) {
+            if (_path == _root)
                 return 0;
+
+            return static_cast<int>(std::count(std::begin(_path) + prefix.size(), std::end(_path), '/')) + 1;
+        };
+
+        // A data object is one level deeper than its collection.
+        const auto too_deep = [_max_depth](int _depth) {
+            return _max_depth > 0 && _depth + 1 > _max_depth;
+        };
+
+        std::vector<std::pair<std::size_t, std::string>> below_sizes;
+        std::vector<std::string> single;
+        std::vector<std::string> stack{_root};
+
+        // Subtrees small enough (and shallow enough) are queried as a whole.
+        // Larger ones are split into their own collection and their children.
+        while (!stack.empty())
+        {
+            const auto path = std::move(stack.back());
+            stack.pop_back();
+
+            const auto depth = depth_of(path);
+
+            if (too_deep(depth))
+                continue;
+
+            single.push_back(path);
+
+            const auto& n = nodes[path];
+
+            if (n.children.empty())
+                continue;
+
+            if (n.size - 1 <= _target_size && !too_deep(depth + n.height))
+                below_sizes.emplace_back(n.size, path);
+            else
+                stack.insert(std::end(stack), std::begin(n.children), std::end(n.children));
+        }
+
+        // The largest subtrees go first so that no thread is left with one at the end.
+        std::sort(std::begin(below_sizes), std::end(below_sizes), std::greater<>{});
+
+        std::vector<walk_unit> units;
+
+        for (auto& [size, path] : below_sizes)
+            units.push_back({{std::move(path)}, true});
+
+        // Single collections are grouped into in-lists of bounded length.
+        constexpr std::size_t max_group_size = 32;
+        constexpr std::size_t max_group_chars = 2048;
+
+        std::size_t chars = 0;
+
+        for (auto& path : single)
+        {
+            if (units.empty() || units.back().below || units.back().collections.size() == max_group_size ||
+                chars + path.size() > max_group_chars)
+            {
+                units.push_back({{}, false});
+                chars = 0;
             }
+
+            chars += path.size() + 4;
+            units.back().collections.push_back(std::move(path));
         }
+
+        return units;
     }
 
-    std::cout << __func__ << " :: invalid directory.\n";
+    auto for_each_modified_child(irods_context& _ctx,
+                                 const std::string& _collection,
+                                 long long _since,
+                                 const std::function<void(std::string_view, const irods_stat_info&)>& _func) -> error_code
+    {
+        // The catalog stores times as zero-padded strings and compares them as such.
+        char since[32];
+        std::snprintf(since, sizeof(since), "%011lld", _since);
+
+        const auto data_sql = "select DATA_NAME, DATA_SIZE, DATA_MODE, DATA_OWNER_NAME, DATA_OWNER_ZONE, DATA_CREATE_TIME, "
+                              "DATA_MODIFY_TIME where COLL_NAME = '" + _collection + "' and DATA_MODIFY_TIME >= '" + since + "'";
+
+        auto ec = irods::smb::for_each_page(_ctx.conn, data_sql, [&_func](irods::smb::column_page& _page) {
+            const auto names = _page.strings(0);
+            const auto sizes = _page.int64s(1);
+            const auto modes = _page.int64s(2);
+            const auto owner_names = _page.strings(3);
+            const auto owner_zones = _page.strings(4);
+            const auto ctimes = _page.int64s(5);
+            const auto mtimes = _page.int64s(6);
+
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+            {
+                _func(names[i], make_stat_info(IOT_DATA_OBJECT, sizes[i], static_cast<int>(modes[i]),
+                                               owner_names[i], owner_zones[i], ctimes[i], mtimes[i]));
+            }
 
-    return -1;
-}
+            return true;
+        });
+
+        if (ec < 0)
+            return ec;
+
+        const auto coll_sql = "select COLL_NAME, COLL_OWNER_NAME, COLL_OWNER_ZONE, COLL_CREATE_TIME, COLL_MODIFY_TIME "
+                              "where COLL_PARENT_NAME = '" + _collection + "' and COLL_MODIFY_TIME >= '" + since + "'";
+
+        ec = irods::smb::for_each_page(_ctx.conn, coll_sql, [&](irods::smb::column_page& _page) {
+            const auto paths = _page.strings(0);
+            const auto owner_names = _page.strings(1);
+            const auto owner_zones = _page.strings(2);
+            const auto ctimes = _page.int64s(3);
+            const auto mtimes = _page.int64s(4);
+
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+            {
+                // The root collection is its own parent.
+                if (paths[i] == _collection)
+                    continue;
+
+                auto name = paths[i];
+                name.remove_prefix(name.find_last_of('/') + 1);
+
+                _func(name, make_stat_info(IOT_COLLECTION, 0, 0, owner_names[i], owner_zones[i], ctimes[i], mtimes[i]));
+            }
+
+            return true;
+        });
+
+        return ec < 0 ? ec : 0;
+    }
+
+    auto fetch_child_names(irods_context& _ctx,
+                           const std::string& _collection,
+                           std::unordered_map<std::string, irods_object_type>& _names) -> error_code
+    {
+        const auto data_sql = "select DATA_NAME where COLL_NAME = '" + _collection + "'";
+
+        auto ec = irods::smb::for_each_page(_ctx.conn, data_sql, [&_names](irods::smb::column_page& _page) {
+            const auto names = _page.strings(0);
+
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+                _names.emplace(names[i], IOT_DATA_OBJECT);
+
+            return true;
+        });
+
+        if (ec < 0)
+            return ec;
+
+        ec = irods::smb::for_each_page(_ctx.conn, "select COLL_NAME where COLL_PARENT_NAME = '" + _collection + "'", [&](irods::smb::column_page& _page) {
+            const auto paths = _page.strings(0);
+
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+            {
+                if (paths[i] == _collection)
+                    continue;
+
+                auto name = paths[i];
+                name.remove_prefix(name.find_last_of('/') + 1);
+                _names[std::string{name}] = IOT_COLLECTION;
+            }
+
+            return true;
+        });
+
+        return ec < 0 ? ec : 0;
+    }
+
+    template <typename Function>
+    auto run_query(irods_context& _ctx, const std::string& _sql, Function _func, irods::query::query_type _type) -> void
+    {
+        if (!_ctx.queries.enabled())
+        {
+            for (const auto& row : irods::query{_ctx.conn, _sql, MAX_SQL_ROWS, _type})
+                _func(row);
+
+            return;
+        }
+
+        irods::smb::query_cache::rows_type rows;
+
+        if (!_ctx.queries.lookup(_type, _sql, rows))
+        {
+            for (const auto& row : irods::query{_ctx.conn, _sql, MAX_SQL_ROWS, _type})
+                rows.push_back(row);
+
+            _ctx.queries.insert(_type, _sql, rows);
+        }
+
+        for (const auto& row : rows)
+            _func(row);
+    }
+
+    auto warm_from_snapshot(irods_context& _ctx, const std::string& _abs_path) -> bool
+    {
+        if (!_ctx.snapshot || !_ctx.snapshot->mapped() || !_ctx.attrs.enabled())
+            return false;
+
+        const auto collection = boost::filesystem::path{_abs_path}.parent_path().generic_string();
+
+        // Each collection is revalidated once per session, all of its entries at a time.
+        if (!_ctx.snapshot_checked.insert(collection).second)
+            return false;
+
+        std::unordered_map<std::string, const irods::smb::inode_snapshot::record*> candidates;
+
+        _ctx.snapshot->for_each_child(collection, [&candidates](std::string_view _name, const auto& _record) {
+            if (_record.has_stat_info)
+                candidates.emplace(_name, &_record);
+        });
+
+        if (candidates.empty())
+            return false;
+
+        const auto prefix = collection == "/" ? collection : collection + '/';
+        std::size_t revalidated = 0;
+
+        // An entry is still good when the object has not been modified since the
+        // snapshot was taken. Objects have a row per replica. Only good replicas
+        // count: a stale one keeps the modify time and size of the old content.
+        // Collections have no size (_size < 0).
+        const auto revalidate = [&](irods_object_type _type, std::string_view _name, std::int64_t _modified_time, std::int64_t _size) {
+            auto iter = candidates.find(std::string{_name});
+
+            if (iter == std::end(candidates))
+                return;
+
+            const auto& stat_info = iter->second->stat_info;
+
+            if (stat_info.type != _type || stat_info.modified_time != _modified_time || (_size >= 0 && stat_info.size != _size))
+                return;
+
+            const auto path = prefix + iter->first;
+            auto fresh = stat_info;
+            fresh.id = _ctx.fsys.insert(path);
+            _ctx.attrs.insert(path, fresh);
+            ++revalidated;
+
+            candidates.erase(iter);
+        };
+
+        auto ec = irods::smb::for_each_page(_ctx.conn,
+                                            "select DATA_NAME, DATA_MODIFY_TIME, DATA_SIZE, DATA_REPL_STATUS where COLL_NAME = '" + collection + "'",
+                                            [&revalidate](irods::smb::column_page& _page) {
+            const auto names = _page.strings(0);
+            const auto modified_times = _page.int64s(1);
+            const auto sizes = _page.int64s(2);
+            const auto statuses = _page.strings(3);
+
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+            {
+                if (statuses[i] == "1")
+                    revalidate(IOT_DATA_OBJECT, names[i], modified_times[i], sizes[i]);
+            }
+
+            return true;
+        });
+
+        if (ec >= 0)
+        {
+            ec = irods::smb::for_each_page(_ctx.conn,
+                                           "select COLL_NAME, COLL_MODIFY_TIME where COLL_PARENT_NAME = '" + collection + "'",
+                                           [&revalidate](irods::smb::column_page& _page) {
+                const auto paths = _page.strings(0);
+                const auto modified_times = _page.int64s(1);
+
+                for (std::size_t i = 0; i < _page.rows(); ++i)
+                {
+                    auto name = paths[i];
+                    name.remove_prefix(name.find_last_of('/') + 1);
+                    revalidate(IOT_COLLECTION, name, modified_times[i], -1);
+                }
+
+                return true;
+            });
+        }
+
+        std::cout << __func__ << " :: revalidated " << revalidated << " entries of [" << collection << "].\n";
+
+        return ec >= 0 && revalidated > 0;
+    }
+
+    auto write_snapshot(irods_context& _ctx, bool _force) -> void
+    {
+        if (_ctx.snapshot_path.empty())
+            return;
+
+        const auto now = std::chrono::steady_clock::now();
+
+        if (!_force && now - _ctx.snapshot_written_at < _ctx.opts.snapshot_interval)
+            return;
+
+        std::map<std::string, irods_stat_info> attributes;
+
+        _ctx.attrs.for_each([&attributes](const std::string& _path, const irods_stat_info& _stat_info) {
+            attributes.emplace(_path, _stat_info);
+        });
+
+        std::vector<irods::smb::inode_snapshot::entry> entries;
+
+        _ctx.fsys.for_each([&entries, &attributes](const std::string& _path, std::int64_t _inode) {
+            if (auto iter = attributes.find(_path); iter != std::end(attributes))
+                entries.push_back({_path, _inode, true, iter->second});
+            else
+                entries.push_back({_path, _inode, false, {}});
+        });
+
+        if (_ctx.snapshot_writes.start(_ctx.snapshot_path, std::move(entries), _ctx.fsys.next_free()))
+            _ctx.snapshot_written_at = now;
+    }
+
+    auto fetch_avus(irods_context& _ctx, const std::string& _abs_path, avu_list& _avus) -> error_code
+    {
+        if (_ctx.attrs.lookup_avus(_abs_path, _avus))
+            return 0;
+
+        irods_stat_info stat_info{};
+
+        if (const auto ec = stat_path(_ctx, _abs_path, &stat_info); ec < 0)
+            return ec;
+
+        const auto parent = boost::filesystem::path{_abs_path}.parent_path().generic_string();
+
+        // Clients that display metadata ask for every entry of the folder being
+        // shown, so a miss on a data object fetches the AVUs of all its siblings.
+        if (stat_info.type == IOT_DATA_OBJECT && _ctx.attrs.enabled() && !_ctx.attrs.avu_prefetch_skipped(parent))
+        {
+            const auto ec = prefetch_avus(_ctx, parent);
+
+            if (ec == SYS_NOT_SUPPORTED)
+                _ctx.attrs.skip_avu_prefetch(parent);
+            else if (ec == 0 && _ctx.attrs.lookup_avus(_abs_path, _avus))
+                return 0;
+        }
+
+        std::string sql;
+
+        if (stat_info.type == IOT_COLLECTION)
+            sql = "select META_COLL_ATTR_NAME, META_COLL_ATTR_VALUE where COLL_NAME = '" + _abs_path + "'";
+        else
+            sql = "select META_DATA_ATTR_NAME, META_DATA_ATTR_VALUE where COLL_NAME = '" + parent + "' and DATA_NAME = '" + filename(_abs_path) + "'";
 
-auto ismb_getwd(irods_context* _ctx, char** _dir) -> void
-{
-    *_dir = new char[_ctx->cwd.length() + 1] {};
-    std::strncpy(*_dir, _ctx->cwd.c_str(), _ctx->cwd.length());
-}
+        try
+        {
+            _avus.clear();
 
-auto ismb_opendir(irods_context* _ctx,
-                  const char* _path,
-                  irods_collection_stream** _coll_stream) -> error_code
-{
-    std::cout << __func__ << " :: _path = " << _path << '\n';
+            run_query(_ctx, sql, [&_avus](const auto& _row) {
+                _avus.emplace_back(_row[0], _row[1]);
+            });
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << __func__ << " :: " << e.what() << '\n';
+            return SYS_INVALID_INPUT_PARAM;
+        }
 
-    std::string path;
+        _ctx.attrs.insert_avus(_abs_path, _avus);
 
-    if (!_path || std::strcmp(_path, ".") == 0)
-    {
-        path = _ctx->cwd;
-    }
-    else if (boost::starts_with(_path, "./"))
-    {
-        path = _path;
-        boost::replace_first(path, "./", _ctx->cwd + '/');
-    }
-    else if (boost::starts_with(_path, "/"))
-    {
-        path = _path;
-        boost::replace_first(path, "/", get_root_path(_ctx->env) + '/');
+        return 0;
     }
-    else
+
+    auto prefetch_avus(irods_context& _ctx, const std::string& _collection) -> error_code
     {
-        path = _ctx->cwd;
-        path += '/';
-        path += _path;
-    }
+        if (!_ctx.attrs.enabled())
+            return 0;
+
+        std::map<std::string, avu_list> avus;
+
+        // Large collections are not worth it. The caller falls back to fetching
+        // the AVUs of the one object. Stopping early also ends the query on the
+        // server. Each query may fetch up to the limit.
+        int rows = 0;
+        bool truncated = false;
+
+        const auto within_budget = [&rows, &truncated, &_ctx](std::size_t _page_rows) {
+            rows += static_cast<int>(_page_rows);
+            truncated = rows > _ctx.opts.prefetch_max_rows;
+            return !truncated;
+        };
+
+        // Objects without metadata are missing from the join. They are seeded
+        // with an empty list so that they are cached as well.
+        auto ec = irods::smb::for_each_page(_ctx.conn, "select DATA_NAME where COLL_NAME = '" + _collection + "'", [&](irods::smb::column_page& _page) {
+            if (!within_budget(_page.rows()))
+                return false;
 
-    std::cout << __func__ << " :: path  = " << path << '\n';
+            const auto names = _page.strings(0);
 
-    //path.erase(path.find_last_of("/."));
-    //path.erase(path.find_last_of("/.."));
-    while ('/' == path.back() || '.' == path.back())
-        path.erase(path.length() - 1);
+            for (std::size_t i = 0; i < _page.rows(); ++i)
+                avus[std::string{names[i]}];
 
-    std::cout << __func__ << " :: path  = " << path << '\n';
+            return true;
+        });
 
-    collInp_t coll_input{};
-    coll_input.flags = LONG_METADATA_FG;
-    std::strncpy(coll_input.collName, path.c_str(), path.length());
+        if (ec >= 0 && !truncated)
+        {
+            rows = 0;
 
-    auto handle = rcOpenCollection(_ctx->conn, &coll_input);
+            const auto sql = "select DATA_NAME, META_DATA_ATTR_NAME, META_DATA_ATTR_VALUE where COLL_NAME = '" + _collection + "'";
 
-    if (handle < 0)
-    {
-        std::cout << __func__ << " :: failed to open collection.\n";
-        return -1;
-    }
+            ec = irods::smb::for_each_page(_ctx.conn, sql, [&](irods::smb::column_page& _page) {
+                if (!within_budget(_page.rows()))
+                    return false;
 
-    _ctx->dir.reset(new irods_collection_stream{handle});
-    *_coll_stream = _ctx->dir.get();
+                const auto names = _page.strings(0);
+                const auto attribute_names = _page.strings(1);
+                const auto attribute_values = _page.strings(2);
 
-    return 0;
-}
+                for (std::size_t i = 0; i < _page.rows(); ++i)
+                    avus[std::string{names[i]}].emplace_back(attribute_names[i], attribute_values[i]);
 
-auto ismb_fdopendir(irods_context* _ctx,
-                    const char* _path,
-                    irods_collection_stream** _coll_stream) -> error_code
-{
-    return ismb_opendir(_ctx, _path, _coll_stream);
-}
+                return true;
+            });
+        }
 
-auto ismb_readdir(irods_context* _ctx, irods_collection_stream* _coll_stream) -> dirent*
-{
-    collEnt_t* coll_entry{};
+        if (ec < 0)
+            return ec;
 
-    _ctx->read_coll_ec = rcReadCollection(_ctx->conn, *_coll_stream, &coll_entry);
+        if (truncated)
+            return SYS_NOT_SUPPORTED;
 
-    if (_ctx->read_coll_ec < 0)
-    {
-        return nullptr;
-    }
+        const auto prefix = _collection == "/" ? _collection : _collection + '/';
 
-    _ctx->dir_entry = {}; // Clear old data.
+        for (auto& [name, list] : avus)
+            _ctx.attrs.insert_avus(prefix + name, std::move(list));
 
-    if (coll_entry->objType == DATA_OBJ_T)
-    {
-        const auto length = std::strlen(coll_entry->dataName);
-        std::strncpy(_ctx->dir_entry.d_name, coll_entry->dataName, length);
+        return 0;
     }
-    else if (coll_entry->objType == COLL_OBJ_T)
+
+    auto modify_avu(irods_context& _ctx, const char* _operation, const std::string& _abs_path, const std::string& _name, const std::string& _value) -> error_code
     {
-        std::string name = coll_entry->collName;
+        irods_stat_info stat_info{};
 
-        if (auto pos = name.find_last_of('/'); pos != std::string::npos)
-            name.erase(0, pos + 1);
+        if (const auto ec = stat_path(_ctx, _abs_path, &stat_info); ec < 0)
+            return ec;
 
-        std::strncpy(_ctx->dir_entry.d_name, name.c_str(), name.length());
-    }
+        auto path = _abs_path;
+        auto name = _name;
+        auto value = _value;
 
-    _ctx->dir_entry.d_ino = _ctx->fsys.insert(_ctx->dir_entry.d_name);
+        modAVUMetadataInp_t input{};
+        input.arg0 = const_cast<char*>(_operation);
+        input.arg1 = const_cast<char*>(stat_info.type == IOT_COLLECTION ? "-C" : "-d");
+        input.arg2 = path.data();
+        input.arg3 = name.data();
+        input.arg4 = value.data();
+        input.arg5 = const_cast<char*>("");
 
-    freeCollEnt(coll_entry);
+        const auto ec = irods::smb::in_span("rcModAVUMetadata", input.arg2, [&] {
+            return rcModAVUMetadata(_ctx.conn, &input);
+        });
 
-    return &_ctx->dir_entry;
-}
+        _ctx.attrs.erase(_abs_path);
+        _ctx.queries.invalidate(_abs_path);
 
-error_code ismb_seekdir(irods_context* _ctx, const char* _path)
-{
-    return 0;
-}
+        return ec;
+    }
 
-error_code ismb_telldir(irods_context* _ctx)
-{
-    return _ctx->read_coll_ec >= 0 ? 0 : -1;
-}
+    auto query_usage(irods_context& _ctx, const std::string& _key, const std::string& _condition) -> std::optional<usage_info>
+    {
+        if (usage_info usage{}; _ctx.usage.lookup(_key, usage))
+            return usage;
 
-error_code ismb_rewind_dir(irods_context* _ctx, const char* _path)
-{
-    return 0;
-}
+        // A single aggregate query. The catalog does the summing, no matter how
+        // many objects are involved.
+        const auto sql = "select sum(DATA_SIZE), count(DATA_ID) where " + _condition;
 
-error_code ismb_mkdir(irods_context* _ctx, const char* _path)
-{
-    std::cout << __func__ << " :: _path = " << _path << '\n';
+        try
+        {
+            usage_info usage{};
 
-    auto abs_path = _ctx->cwd;
-    abs_path += '/';
-    abs_path += _path;
+            for (const auto& row : irods::query{_ctx.conn, sql, 1})
+            {
+                usage.bytes = row[0].empty() ? 0 : std::stoll(row[0]);
+                usage.objects = row[1].empty() ? 0 : std::stoll(row[1]);
+                break;
+            }
 
-    std::cout << __func__ << " :: abs_path = " << abs_path << '\n';
+            _ctx.usage.insert(_key, usage, _ctx.opts.usage_cache_ttl);
 
-    char coll_path[1024]{};
-    std::strncpy(coll_path, abs_path.c_str(), abs_path.length());
+            return usage;
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << __func__ << " :: " << e.what() << '\n';
+            return std::nullopt;
+        }
+    }
 
-    if (auto ec = mkColl(_ctx->conn, coll_path); ec != 0)
+    auto query_free_space(irods_context& _ctx, const std::string& _resource) -> long long
     {
-        std::cout << __func__ << " :: mkColl() failed.\n";
-        return -1;
-    }
+        struct resource_info
+        {
+            std::string id;
+            std::string name;
+            std::string type;
+            std::string parent;
+            std::string free_space;
+        };
 
-    _ctx->fsys.insert(abs_path);
+        std::vector<resource_info> resources;
 
-    return 0;
-}
+        try
+        {
+            for (const auto& row : irods::query{_ctx.conn, "select RESC_ID, RESC_NAME, RESC_TYPE_NAME, RESC_PARENT, RESC_FREE_SPACE"})
+                resources.push_back({row[0], row[1], row[2], row[3], row[4]});
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << __func__ << " :: " << e.what() << '\n';
+            return -1;
+        }
 
-error_code ismb_rmdir(irods_context* _ctx, const char* _path)
-{
-    std::cout << __func__ << " :: _path = " << _path << '\n';
+        // Older servers record the parent's name rather than its id.
+        const auto is_child = [](const resource_info& _child, const resource_info& _parent) {
+            return !_child.parent.empty() && (_child.parent == _parent.id || _child.parent == _parent.name);
+        };
 
-    auto abs_path = _ctx->cwd;
-    abs_path += '/';
-    abs_path += _path;
+        // Coordinating resources record no free space of their own. Data written
+        // to a replication (or compound) resource lands on every child, so the
+        // fullest child limits it. Otherwise (e.g. random, round robin, passthru),
+        // data lands on one child and the space of the children adds up.
+        // Returns -1 if no leaf below _r records its free space.
+        const std::function<long long(const resource_info&, int)> free_space_of = [&](const resource_info& _r, int _depth) {
+            constexpr int max_depth = 16; // Guards against cycles in a corrupt catalog.
 
-    std::cout << __func__ << " :: abs_path = " << abs_path << '\n';
+            const bool all_children = _r.type == "replication" || _r.type == "compound";
+            bool leaf = true;
+            long long free_bytes = -1;
 
-    char coll_path[1024]{};
-    std::strncpy(coll_path, abs_path.c_str(), abs_path.length());
+            for (const auto& c : resources)
+            {
+                if (!is_child(c, _r))
+                    continue;
 
-    collInp_t coll_input{};
-    std::strncpy(coll_input.collName, abs_path.c_str(), abs_path.length());
+                leaf = false;
 
-    //addKeyVal(&coll_input.condInput, FORCE_FLAG_KW, "");
-    //addKeyVal(&coll_input.condInput, RECURSIVE_OPR__KW, "");
+                if (_depth >= max_depth)
+                    continue;
+
+                if (const auto child_bytes = free_space_of(c, _depth + 1); child_bytes >= 0)
+                {
+                    if (free_bytes < 0)
+                        free_bytes = child_bytes;
+                    else
+                        free_bytes = all_children ? std::min(free_bytes, child_bytes) : free_bytes + child_bytes;
+                }
+            }
+
+            if (leaf && !_r.free_space.empty())
+                free_bytes = std::strtoll(_r.free_space.c_str(), nullptr, 10);
+
+            return free_bytes;
+        };
+
+        for (const auto& r : resources)
+        {
+            if (r.name == _resource)
+                return free_space_of(r, 0);
+        }
 
-    constexpr int verbose = 0;
-    if (auto ec = rcRmColl(_ctx->conn, &coll_input, verbose); ec < 0)
-    {
-        std::cout << __func__ << " :: rcRmColl() failed.\n";
         return -1;
     }
 
-    _ctx->fsys.erase(abs_path);
-    std::cout << __func__ << " :: collection removed.\n";
-
-    return 0;
-}
+    auto lookup_replicas(irods_context& _ctx, const std::string& _abs_path) -> std::vector<replica_info>
+    {
+        using namespace std::string_literals;
 
-void ismb_closedir(irods_context* _ctx, irods_collection_stream* _coll_stream)
-{
-    rcCloseCollection(_ctx->conn, *_coll_stream);
-    _ctx->dir.reset();
-}
+        std::vector<replica_info> replicas;
 
-//
-// File Operations
-//
+        const auto sql = "select DATA_ID, DATA_REPL_NUM, DATA_MODIFY_TIME, DATA_RESC_HIER, DATA_SIZE, DATA_CHECKSUM where COLL_NAME = '"s +
+                         boost::filesystem::path{_abs_path}.parent_path().generic_string() + "' and DATA_NAME = '" +
+                         filename(_abs_path) + "' and DATA_REPL_STATUS = '1'";
 
-auto ismb_open(irods_context* _ctx, const char* _filename, int _flags, int _mode) -> int
-{
-    namespace fs = boost::filesystem;
+        // Never memoized. After an overwrite, a stale modify time would let the
+        // block cache serve the old content.
+        try
+        {
+            for (const auto& row : irods::query{_ctx.conn, sql})
+            {
+                // Statistics are kept per root resource.
+                const auto& hier = row[3];
+                replicas.push_back({row[0], std::stoi(row[1]), row[2], hier.substr(0, hier.find(';')), std::stoll(row[4]), row[5]});
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << __func__ << " :: replica lookup failed [" << e.what() << "].\n";
+        }
 
-    std::cout << __func__ << " :: _filename = " << _filename << '\n';
-    std::cout << __func__ << " :: _flags    = " << _flags << '\n';
-    std::cout << __func__ << " :: _mode     = " << _mode << '\n';
+        return replicas;
+    }
 
-    dataObjInp_t args{};
+    auto select_replica(irods_context& _ctx, const std::vector<replica_info>& _replicas) -> std::optional<replica_info>
+    {
+        if (_replicas.empty())
+            return std::nullopt;
 
-    args.createMode = _mode;
-    args.openFlags = _flags;
+        // Estimate the time for a typical read rather than the whole object.
+        constexpr std::int64_t typical_read_size = 4 * 1024 * 1024;
 
-    auto abs_path = _ctx->cwd;
-    abs_path += '/';
-    abs_path += fs::path{_filename}.filename().generic_string();
-    std::cout << __func__ << " :: abs_path  = " << abs_path << '\n';
-    rstrcpy(args.objPath, abs_path.c_str(), MAX_NAME_LEN);
+        const replica_info* best = nullptr;
+        double best_estimate = -1;
 
-    // FIXME The client must have a default resource defined for this to work!
-    addKeyVal(&args.condInput, RESC_NAME_KW, _ctx->env.rodsDefResource);
-    std::cout << __func__ << " :: def. resc = " << _ctx->env.rodsDefResource << '\n';
+        for (const auto& r : _replicas)
+        {
+            const auto estimate = _ctx.resource_stats.estimate(r.resource, std::min(r.size, typical_read_size));
 
-    if (const auto fd = rcDataObjOpen(_ctx->conn, &args); fd >= 0)
-    {
-        _ctx->fd.map(abs_path, fd);
-        return fd;
-    }
+            if (estimate >= 0 && (!best || best_estimate < 0 || estimate < best_estimate))
+            {
+                best = &r;
+                best_estimate = estimate;
+            }
+        }
 
-    return -1;
-}
+        // Now and then, try a resource that has not been measured yet so that a
+        // faster tier can be discovered.
+        if (_ctx.resource_stats.explore())
+        {
+            for (const auto& r : _replicas)
+            {
+                if (_ctx.resource_stats.estimate(r.resource, 0) < 0)
+                    return r;
+            }
+        }
 
-auto ismb_close(irods_context* _ctx, int _fd) -> int
-{
-    openedDataObjInp_t args{};
+        // Without measurements, behave as before and read from the default resource.
+        if (!best || _ctx.resource_stats.estimate(_ctx.env.rodsDefResource, 0) < 0)
+        {
+            for (const auto& r : _replicas)
+            {
+                if (r.resource == _ctx.env.rodsDefResource)
+                    return r;
+            }
+        }
 
-    args.l1descInx = _fd;
+        return best ? *best : _replicas.front();
+    }
 
-    if (rcDataObjClose(_ctx->conn, &args) < 0)
-        return -1;
+    auto load_environment(rodsEnv& _env) -> int
+    {
+        static const auto env = [] {
+            std::pair<int, rodsEnv> result{};
+            result.first = getRodsEnv(&result.second);
+            return result;
+        }();
 
-    return 0;
-}
+        if (env.first < 0)
+            return env.first;
 
-auto ismb_write(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size) -> int
-{
-    openedDataObjInp_t obj_args{};
-    obj_args.l1descInx = _fd;
+        _env = env.second;
 
-    bytesBuf_t buf_args{};
-    buf_args.buf = _buffer;
-    buf_args.len = _buffer_size;
+        return 0;
+    }
 
-    return rcDataObjWrite(_ctx->conn, &obj_args, &buf_args);
-}
+    auto login(rcComm_t* _conn) -> int
+    {
+        // An explicit password takes precedence. Otherwise, authenticate using the
+        // scheme and credentials (e.g. the .irodsA file) from the iRODS environment.
+        if (const auto* password = std::getenv("IRODS_PASSWORD"); password)
+        {
+            std::string buffer = password;
+            return clientLoginWithPassword(_conn, buffer.data());
+        }
 
-auto ismb_fstat(irods_context* _ctx, int _fd, irods_stat_info* _stat_info) -> error_code
-{
-    namespace fs = boost::filesystem;
-    const auto filename = fs::path{_ctx->fd.path(_fd)}.filename().generic_string();
-    return ismb_stat(_ctx, filename.c_str(), _stat_info);
-}
+        return clientLogin(_conn);
+    }
 
-auto ismb_unlink(irods_context* _ctx, const char* _filename) -> error_code
-{
-    std::cout << __func__ << " :: _filename = " << _filename << '\n';
+    auto connect(const rodsEnv& _env) -> rcComm_t*
+    {
+        irods::smb::span_scope span{"connect", _env.rodsHost};
 
-    auto abs_path = _ctx->cwd;
-    abs_path += '/';
-    abs_path += _filename;
+        rErrMsg_t errors;
+        auto* conn = rcConnect(_env.rodsHost,
+                               _env.rodsPort,
+                               _env.rodsUserName,
+                               _env.rodsZone,
+                               0, //NO_RECONN,
+                               &errors);
 
-    dataObjInp_t args{};
-    rstrcpy(args.objPath, abs_path.c_str(), MAX_NAME_LEN);
+        if (!conn)
+            return nullptr;
 
-    // Permanently deletes data object instead of moving it to the
-    // trash collection.
-    //addKeyVal(&args.condInput, FORCE_FLAG_KW, "");
+        if (login(conn) != 0)
+        {
+            rcDisconnect(conn);
+            return nullptr;
+        }
 
-    return rcDataObjUnlink(_ctx->conn, &args);
-}
+        return conn;
+    }
 
-namespace
-{
     auto get_root_path(const rodsEnv& _env) -> std::string
     {
         std::string root = "/";
@@ -666,25 +5670,93 @@ namespace
         return root;
     }
 
+    auto absolute_path(const irods_context& _ctx, const char* _path) -> std::string
+    {
+        std::string abs_path;
+
+        if (!_path || std::strcmp(_path, ".") == 0)
+        {
+            abs_path = _ctx.cwd;
+        }
+        else if (boost::starts_with(_path, "./"))
+        {
+            abs_path = _path;
+            boost::replace_first(abs_path, "./", _ctx.cwd + '/');
+        }
+        else if (boost::starts_with(_path, "/"))
+        {
+            abs_path = _path;
+            boost::replace_first(abs_path, "/", get_root_path(_ctx.env) + '/');
+        }
+        else
+        {
+            abs_path = _ctx.cwd;
+            abs_path += '/';
+            abs_path += _path;
+        }
+
+        boost::replace_first(abs_path, _ctx.smb_path, ""); // Remove the samba share root.
+
+        while (abs_path.size() > 1 && '/' == abs_path.back())
+            abs_path.pop_back();
+
+        return abs_path;
+    }
+
+    auto make_stat_info(irods_object_type _type, long long _size, int _mode, std::string_view _owner_name,
+                        std::string_view _owner_zone, long long _ctime, long long _mtime) -> irods_stat_info
+    {
+        irods_stat_info stat_info{};
+        stat_info.size = _size;
+        stat_info.type = _type;
+        stat_info.mode = _mode;
+        _owner_name.copy(stat_info.owner_name, sizeof(stat_info.owner_name) - 1);
+        _owner_zone.copy(stat_info.owner_zone, sizeof(stat_info.owner_zone) - 1);
+        stat_info.creation_time = _ctime;
+        stat_info.modified_time = _mtime;
+        return stat_info;
+    }
+
     auto filename(const std::string& _path) -> std::string
     {
         return boost::filesystem::path{_path}.filename().generic_string();
     }
 
-    auto list(rcComm_t* _conn, const std::string& _path) -> std::vector<std::string>
+    auto list(rcComm_t* _conn, const std::string& _path) -> name_list
     {
         using namespace std::string_literals;
 
-        std::vector<std::string> entries;
+        name_list entries;
 
-        for (const auto& sql : {"select DATA_NAME where DATA_NAME = '"s + filename(_path) + "'",
-                                "select DATA_NAME where COLL_NAME = '"s + _path + "'",
-                                "select COLL_NAME where COLL_NAME like '"s + _path + "%'"})
+        const auto append = [&entries](const std::string& _name) {
+            entries.offsets.push_back(entries.names.size());
+            entries.names += _name;
+            entries.names += '\0';
+        };
+
+        // Only direct children are requested. Each query is consumed one page at
+        // a time as the rows arrive.
+        for (const auto& row : irods::query{_conn, "select DATA_NAME where COLL_NAME = '"s + _path + "'"})
+            append(row[0]);
+
+        for (const auto& row : irods::query{_conn, "select COLL_NAME where COLL_PARENT_NAME = '"s + _path + "'"})
+        {
+            if (row[0] != _path) // The root collection is its own parent.
+                append(filename(row[0]));
+        }
+
+        // The path may name a data object rather than a collection.
+        if (entries.offsets.empty())
         {
-            for (const auto& row : irods::query{_conn, sql})
-                for (const auto& value : row)
-                    if (_path != value)
-                        entries.push_back(filename(value));
+            const auto parent = boost::filesystem::path{_path}.parent_path().generic_string();
+            const auto name = filename(_path);
+            const auto sql = "select DATA_NAME where COLL_NAME = '"s + parent + "' and DATA_NAME = '" + name + "'";
+
+            for (const auto& row : irods::query{_conn, sql, 1})
+            {
+                append(row[0]);
+                break;
+            }
         }
 
         return entries;
@@ -14,6 +14,35 @@ typedef int irods_object_type;
 #define IOT_DATA_OBJECT 1
 #define IOT_COLLECTION  2
 
+typedef int irods_change_type;
+#define ICT_CREATED  1
+#define ICT_MODIFIED 2
+#define ICT_DELETED  3
+
+typedef int irods_option;
+#define IOPT_ATTRIBUTE_CACHE_TTL 1 // Milliseconds stat results are cached. Zero (the default) disables.
+#define IOPT_STREAMING_CHECKSUM  2 // Non-zero computes SHA-256 checksums while writing.
+#define IOPT_SHARED_ATTRIBUTE_CACHE_SIZE 3 // Number of entries in the shared attribute cache.
+#define IOPT_SHARED_ATTRIBUTE_CACHE      4 // String. Name of the shared memory segment (e.g. "/irods_smb"). Needs IOPT_ATTRIBUTE_CACHE_TTL.
+#define IOPT_BLOCK_CACHE_DIRECTORY  5 // String. Enables the local read cache in this directory.
+#define IOPT_BLOCK_CACHE_BLOCK_SIZE 6 // Bytes. Default is 1 MiB.
+#define IOPT_BLOCK_CACHE_SIZE       7 // Bytes. Shared by all processes using the directory. Default is 10 GiB.
+#define IOPT_INLINE_READ_SIZE       8 // Bytes. Objects up to this size are read whole at open. Zero (the default) disables. Needs IOPT_ATTRIBUTE_CACHE_TTL.
+#define IOPT_DEFERRED_CLOSE         9 // Milliseconds read-only descriptors stay open after ismb_close. Zero disables.
+#define IOPT_REPLICA_ROUTING       10 // Non-zero reads from the good replica on the fastest measured resource.
+#define IOPT_USAGE_CACHE_TTL       11 // Milliseconds usage aggregates are cached. Default is 60 seconds.
+#define IOPT_VOLUME_SIZE           12 // Bytes reported as capacity when the resource has no free space recorded.
+#define IOPT_PREFETCH_CHILDREN     13 // Child collections prefetched after a listing. Zero (the default) disables.
+#define IOPT_PREFETCH_MAX_ROWS     14 // Rows each prefetch query (listings or AVUs) may fetch before giving up. Default is 10000.
+#define IOPT_QUERY_CACHE_TTL       15 // Milliseconds small query results are memoized. Zero (the default) disables.
+#define IOPT_QUERY_CACHE_SIZE      16 // Bytes. Default is 1 MiB.
+#define IOPT_SNAPSHOT_FILE         17 // String. Enables the persistent inode and attribute snapshot at this path.
+#define IOPT_SNAPSHOT_INTERVAL     18 // Milliseconds between background snapshot writes. Default is 5 minutes.
+#define IOPT_TRACE_FILE            19 // String. Records every call to this file, suffixed with the pid (see ismb_replay).
+#define IOPT_SPAN_BUFFER_SIZE      20 // Spans kept per thread for ismb_export_spans. Default is 0 (disabled).
+#define IOPT_STARVATION_LIMIT      21 // Milliseconds a call may wait behind higher priority calls. Default is 200.
+#define IOPT_TRANSFER_CHUNK_SIZE   22 // Largest read or write RPC. Interactive calls may run in between. Default is 4 MiB.
+
 typedef struct _irods_stat_info
 {
     long long size;
@@ -26,6 +55,53 @@ typedef struct _irods_stat_info
     long long modified_time;
 } irods_stat_info;
 
+typedef struct _irods_statvfs_info
+{
+    long long block_size;
+    long long total_blocks;
+    long long free_blocks;
+    long long available_blocks;
+    long long total_files;
+    long long free_files;
+} irods_statvfs_info;
+
+typedef struct _irods_prefetch_stats
+{
+    long long scheduled;  // Listings that requested a prefetch.
+    long long dropped;    // Requests replaced by a newer one before they started.
+    long long completed;
+    long long truncated;  // Stopped by the row budget or an error.
+    long long failed;     // No connection was available.
+    long long entries;    // Stat results fetched.
+    long long discarded;  // Entries thrown away because the tree changed meanwhile.
+    long long hits;       // Stat requests answered by a prefetched entry.
+} irods_prefetch_stats;
+
+typedef struct _irods_walk_options
+{
+    int max_depth; // Entries deeper than this below the root are skipped. Zero walks the whole tree.
+    int threads;   // Queries run in parallel, each on a connection of its own. Zero means 4.
+    int page_size; // Rows per query page. Zero means the server maximum.
+} irods_walk_options;
+
+// Receives the path of an entry relative to the root of the walk. _stat_info->id
+// is the entry's inode number. Returning non-zero stops the walk.
+typedef int (*irods_walk_callback)(const char* _path, const irods_stat_info* _stat_info, void* _user_data);
+
+typedef struct _irods_change
+{
+    irods_change_type type;
+    const char* name;          // Name of the entry within the collection.
+    irods_stat_info stat_info; // Zeroed for deletions.
+} irods_change;
+
+typedef struct _irods_change_list
+{
+    irods_change* changes;
+    long size;
+    int rescan; // Non-zero when the changes since the cookie are unknown. The collection must be listed again.
+} irods_change_list;
+
 typedef struct _irods_char_array
 {
     char* data;
@@ -62,8 +138,18 @@ irods_context* ismb_create_context(const char* _smb_path);
 
 void ismb_destroy_context(irods_context* _ctx);
 
+error_code ismb_set_option(irods_context* _ctx, irods_option _option, long long _value);
+
+error_code ismb_set_string_option(irods_context* _ctx, irods_option _option, const char* _value);
+
 error_code ismb_connect(irods_context* _ctx);
 
+// Connects and authenticates up to _count connections ahead of time. Intended to be
+// called by the parent process before forking. Each fork hands one connection to the
+// child, where ismb_connect picks it up instead of logging in again. A background
+// thread in the parent refills the pool after forks and replaces idle connections.
+error_code ismb_prewarm_connections(int _count);
+
 error_code ismb_disconnect(irods_context* _ctx);
 
 void ismb_list(irods_context* _ctx, const char* _path, irods_string_array* _entries);
@@ -100,6 +186,10 @@ error_code ismb_mkdir(irods_context* _ctx, const char* _path);
 
 error_code ismb_rmdir(irods_context* _ctx, const char* _path);
 
+// Removes the collection and everything below it in a single request.
+// A non-zero _no_trash deletes permanently instead of moving to the trash.
+error_code ismb_rmtree(irods_context* _ctx, const char* _path, int _no_trash);
+
 void ismb_closedir(irods_context* _ctx, irods_collection_stream* _coll_stream);
 
 //
@@ -110,14 +200,91 @@ int ismb_open(irods_context* _ctx, const char* _filename, int _flags, int _mode)
 
 int ismb_close(irods_context* _ctx, int _fd);
 
+int ismb_read(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size);
+
+int ismb_pread(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size, long long _offset);
+
 int ismb_write(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size);
 
+int ismb_pwrite(irods_context* _ctx, int _fd, void* _buffer, int _buffer_size, long long _offset);
+
+long long ismb_lseek(irods_context* _ctx, int _fd, long long _offset, int _whence);
+
+// The server can only truncate objects that are not open for write. The object
+// is closed, truncated and opened again behind _fd, which stays valid.
+error_code ismb_ftruncate(irods_context* _ctx, int _fd, long long _length);
+
 error_code ismb_stat(irods_context* _ctx, const char* _path, irods_stat_info* _stat_info);
 
 error_code ismb_fstat(irods_context* _ctx, int _fd, irods_stat_info* _stat_info);
 
 error_code ismb_unlink(irods_context* _ctx, const char* _filename);
 
+// Copies [_offset, _offset + _length) of _src_path into _dst_path at the same offset.
+// Bytes of _dst_path outside the range are kept. Copying the whole object
+// (_offset == 0 and _length < 0 or >= size) is performed entirely on the server
+// unless _dst_path is longer than _src_path. Returns SYS_COPY_LEN_ERR if _offset
+// is past the end of _src_path.
+error_code ismb_copy(irods_context* _ctx,
+                     const char* _src_path,
+                     const char* _dst_path,
+                     long long _offset,
+                     long long _length);
+
+// Renames a data object or collection. This is a catalog-only operation.
+error_code ismb_rename(irods_context* _ctx, const char* _old_path, const char* _new_path);
+
+// Total size and number of data objects in the collection tree rooted at _path.
+error_code ismb_dir_usage(irods_context* _ctx, const char* _path, long long* _total_bytes, long long* _object_count);
+
+// Usage and free space of the user's default resource (rodsDefResource),
+// regardless of _path. Free space is that of the leaf resources below it.
+error_code ismb_statvfs(irods_context* _ctx, const char* _path, irods_statvfs_info* _statvfs_info);
+
+// Finds the entry of _parent whose name matches _name ignoring case. On success,
+// _real_name receives the name as stored in iRODS (release with ismb_free_string).
+error_code ismb_lookup_nocase(irods_context* _ctx, const char* _parent, const char* _name, char** _real_name);
+
+// Extended attributes map to AVUs, one attribute per name. Values are not NUL
+// terminated. Passing a _size of zero returns the required buffer size.
+int ismb_getxattr(irods_context* _ctx, const char* _path, const char* _name, char* _value, int _size);
+
+// Writes the attribute names as a sequence of NUL terminated strings.
+int ismb_listxattr(irods_context* _ctx, const char* _path, char* _list, int _size);
+
+error_code ismb_setxattr(irods_context* _ctx, const char* _path, const char* _name, const char* _value, int _size);
+
+error_code ismb_removexattr(irods_context* _ctx, const char* _path, const char* _name);
+
+// Fetches the AVUs of every data object in the collection in a single query.
+// Returns SYS_NOT_SUPPORTED when a query takes more than IOPT_PREFETCH_MAX_ROWS rows.
+error_code ismb_prefetch_xattrs(irods_context* _ctx, const char* _path);
+
+error_code ismb_prefetch_statistics(irods_context* _ctx, irods_prefetch_stats* _stats);
+
+// Writes the most recent spans of every thread (public calls and the RPCs they
+// made) to _path in Chrome's trace event format, for Perfetto or chrome://tracing.
+error_code ismb_export_spans(irods_context* _ctx, const char* _path);
+
+// Reports every collection and data object below _root, in no particular order.
+// The tree is listed with paged queries running in parallel and the results feed
+// the attribute and inode caches. _options may be NULL. Callbacks are made on the
+// calling thread. Returns zero when the walk completes or the callback stops it.
+error_code ismb_walk(irods_context* _ctx,
+                     const char* _root,
+                     irods_walk_callback _callback,
+                     const irods_walk_options* _options,
+                     void* _user_data);
+
+// Reports the entries of _collection created, modified or deleted by anyone since
+// the call that returned *_cookie, and patches the caches to match. A cookie of
+// zero starts watching the collection and reports nothing. *_cookie receives the
+// cookie for the next call. Several watchers may poll the same collection, each
+// with its own cookies. Release the list with ismb_free_change_list.
+error_code ismb_changes_since(irods_context* _ctx, const char* _collection, long long* _cookie, irods_change_list* _changes);
+
+void ismb_free_change_list(irods_change_list* _changes);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -77,7 +77,14 @@ int main(int _argc, char* _argv[])
                 irods_stat_info stats;
                 printf("ismb_fstat :: error code = %i\n", ismb_fstat(ctx, fd, &stats));
 
+                printf("ismb_ftruncate (extend to 1024) :: error code = %i\n", ismb_ftruncate(ctx, fd, 1024));
+                printf("ismb_ftruncate (shrink to 4) :: error code = %i\n", ismb_ftruncate(ctx, fd, 4));
+                printf("wrote %d bytes to file.\n", ismb_pwrite(ctx, fd, (void*) buf, 2, 4));
+
                 printf("closed file descriptor = %s\n", (ismb_close(ctx, fd) == 0 ? "true" : "false"));
+
+                ec = ismb_stat(ctx, _argv[3], &stats);
+                printf("ismb_stat :: error code = %i, size = %lld (expected 6)\n", ec, stats.size);
             }
         }
     }
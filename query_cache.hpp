@@ -0,0 +1,206 @@
+#ifndef IRODS_SMB_QUERY_CACHE_HPP
+#define IRODS_SMB_QUERY_CACHE_HPP
+
+#include "irods_query.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace irods::smb
+{
+    // Memoizes the complete results of small catalog queries for a short time.
+    //
+    // Entries are keyed by the query type and the query text, with whitespace
+    // outside of string literals collapsed so that formatting differences between
+    // call sites do not defeat the cache. Total size is capped in bytes and the
+    // least recently used entries are evicted first.
+    //
+    // Invalidation is textual. A change to a path drops every entry whose query
+    // mentions the path, names its parent exactly or matches it through a like
+    // pattern on one of its ancestors. This errs on the side of dropping too much.
+    class query_cache
+    {
+    public:
+        using row_type = std::vector<std::string>;
+        using rows_type = std::vector<row_type>;
+        using clock_type = std::chrono::steady_clock;
+
+        // Results larger than capacity / max_entry_fraction are not stored.
+        static constexpr std::size_t max_entry_fraction = 8;
+
+        auto set_ttl(std::chrono::milliseconds _ttl) -> void
+        {
+            ttl_ = _ttl;
+
+            if (!enabled())
+                clear();
+        }
+
+        auto set_capacity(std::size_t _capacity) -> void
+        {
+            capacity_ = _capacity;
+            evict();
+        }
+
+        auto enabled() const noexcept -> bool
+        {
+            return ttl_.count() > 0 && capacity_ > 0;
+        }
+
+        auto lookup(irods::query::query_type _type, const std::string& _query, rows_type& _rows) -> bool
+        {
+            if (!enabled())
+                return false;
+
+            auto iter = entries_.find(make_key(_type, _query));
+
+            if (iter == std::end(entries_))
+                return false;
+
+            if (clock_type::now() >= iter->second.expires_at)
+            {
+                erase(iter);
+                return false;
+            }
+
+            lru_.splice(std::end(lru_), lru_, iter->second.lru_position);
+            _rows = iter->second.rows;
+
+            return true;
+        }
+
+        auto insert(irods::query::query_type _type, const std::string& _query, const rows_type& _rows) -> void
+        {
+            if (!enabled())
+                return;
+
+            auto key = make_key(_type, _query);
+            auto bytes = key.size() + sizeof(entry);
+
+            for (const auto& row : _rows)
+            {
+                bytes += sizeof(row_type);
+
+                for (const auto& value : row)
+                    bytes += sizeof(std::string) + value.size();
+            }
+
+            if (bytes > capacity_ / max_entry_fraction)
+                return;
+
+            if (auto iter = entries_.find(key); iter != std::end(entries_))
+                erase(iter);
+
+            auto position = lru_.insert(std::end(lru_), key);
+            entries_.emplace(std::move(key), entry{_rows, bytes, clock_type::now() + ttl_, position});
+            size_ += bytes;
+
+            evict();
+        }
+
+        auto invalidate(const std::string& _path) -> void
+        {
+            if (entries_.empty())
+                return;
+
+            std::vector<std::string> patterns{_path};
+
+            // Every ancestor, from the parent up to the root.
+            for (auto pos = _path.find_last_of('/'); pos != std::string::npos && pos > 0; pos = _path.find_last_of('/', pos - 1))
+            {
+                const auto ancestor = _path.substr(0, pos);
+
+                if (patterns.size() == 1)
+                    patterns.push_back('\'' + ancestor + '\'');
+
+                patterns.push_back('\'' + ancestor + "/%'");
+            }
+
+            for (auto iter = std::begin(entries_); iter != std::end(entries_);)
+            {
+                const auto& key = iter->first;
+
+                const auto matches = std::any_of(std::begin(patterns), std::end(patterns), [&key](const auto& _pattern) {
+                    return key.find(_pattern) != std::string::npos;
+                });
+
+                iter = matches ? erase(iter) : std::next(iter);
+            }
+        }
+
+        auto clear() -> void
+        {
+            entries_.clear();
+            lru_.clear();
+            size_ = 0;
+        }
+
+    private:
+        struct entry
+        {
+            rows_type rows;
+            std::size_t bytes;
+            clock_type::time_point expires_at;
+            std::list<std::string>::iterator lru_position;
+        };
+
+        using map_type = std::unordered_map<std::string, entry>;
+
+        static auto make_key(irods::query::query_type _type, const std::string& _query) -> std::string
+        {
+            std::string key = _type == irods::query::SPECIFIC ? "S:" : "G:";
+            key.reserve(key.size() + _query.size());
+
+            bool quoted = false;
+            bool space = false;
+
+            for (char c : _query)
+            {
+                if (!quoted && (c == ' ' || c == '\t' || c == '\n' || c == '\r'))
+                {
+                    space = true;
+                    continue;
+                }
+
+                if (space && key.size() > 2)
+                    key += ' ';
+
+                space = false;
+
+                if (c == '\'')
+                    quoted = !quoted;
+
+                key += c;
+            }
+
+            return key;
+        }
+
+        auto erase(map_type::iterator _iter) -> map_type::iterator
+        {
+            size_ -= _iter->second.bytes;
+            lru_.erase(_iter->second.lru_position);
+            return entries_.erase(_iter);
+        }
+
+        auto evict() -> void
+        {
+            while (size_ > capacity_ && !lru_.empty())
+                erase(entries_.find(lru_.front()));
+        }
+
+        std::chrono::milliseconds ttl_{0};
+        std::size_t capacity_ = 1024 * 1024;
+        std::size_t size_ = 0;
+        std::list<std::string> lru_;
+        map_type entries_;
+    };
+} // namespace irods::smb
+
+#endif // IRODS_SMB_QUERY_CACHE_HPP
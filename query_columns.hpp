@@ -0,0 +1,316 @@
+#ifndef IRODS_SMB_QUERY_COLUMNS_HPP
+#define IRODS_SMB_QUERY_COLUMNS_HPP
+
+#include <irods/rodsClient.h>
+#include <irods/genQuery.h>
+#include <irods/rcMisc.h>
+
+#include "span_trace.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace irods::smb
+{
+    namespace detail
+    {
+        inline auto parse_int64_scalar(const char* _s, std::size_t _max_size) -> std::int64_t
+        {
+            std::size_t i = 0;
+            bool negative = false;
+
+            if (i < _max_size && _s[i] == '-')
+            {
+                negative = true;
+                ++i;
+            }
+
+            std::uint64_t value = 0;
+
+            for (; i < _max_size && _s[i] >= '0' && _s[i] <= '9'; ++i)
+                value = value * 10 + static_cast<std::uint64_t>(_s[i] - '0');
+
+            return negative ? -static_cast<std::int64_t>(value) : static_cast<std::int64_t>(value);
+        }
+
+#if defined(__SSE2__)
+        // Returns the number of leading decimal digits in the 16 bytes at _s.
+        inline auto count_digits(__m128i _v) -> int
+        {
+            const auto below = _mm_cmplt_epi8(_v, _mm_set1_epi8('0'));
+            const auto above = _mm_cmpgt_epi8(_v, _mm_set1_epi8('9'));
+            const auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(below, above))) | 0x10000u;
+
+            return __builtin_ctz(mask);
+        }
+
+        // Converts 16 digit characters, most significant first, by combining
+        // neighbouring digits with multiply-adds (1 -> 2 -> 4 -> 8 digits).
+        inline auto combine_digits(__m128i _digits) -> std::uint64_t
+        {
+            const auto zero = _mm_setzero_si128();
+            const auto d = _mm_sub_epi8(_digits, _mm_set1_epi8('0'));
+
+            const auto by_10 = _mm_set_epi16(1, 10, 1, 10, 1, 10, 1, 10);
+            const auto by_100 = _mm_set_epi16(1, 100, 1, 100, 1, 100, 1, 100);
+            const auto by_10000 = _mm_set_epi16(1, 10000, 1, 10000, 1, 10000, 1, 10000);
+
+            const auto pairs = _mm_packs_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(d, zero), by_10),
+                                               _mm_madd_epi16(_mm_unpackhi_epi8(d, zero), by_10));
+            const auto quads = _mm_madd_epi16(pairs, by_100);
+            const auto octets = _mm_madd_epi16(_mm_packs_epi32(quads, quads), by_10000);
+
+            const auto high = static_cast<std::uint32_t>(_mm_cvtsi128_si32(octets));
+            const auto low = static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(octets, 4)));
+
+            return std::uint64_t{high} * 100000000 + low;
+        }
+#endif
+    } // namespace detail
+
+    // Parses every value of a fixed-stride column of decimal strings (as stored
+    // in genQueryOut_t) into _out. Empty and non-numeric values become zero.
+    //
+    // With SSE2, values of up to 16 digits are converted 16 bytes at a time. The
+    // digits are right-aligned by loading the block that ends with them and
+    // padding whatever precedes them with '0'. Values too close to the start or
+    // end of the buffer for that, negative values and longer values take the
+    // scalar path.
+    inline auto parse_int64_column(const char* _data, std::size_t _stride, std::size_t _count, std::int64_t* _out) -> void
+    {
+#if defined(__SSE2__)
+        // Sliding window of byte masks. Loading 16 bytes at offset n keeps the
+        // last n bytes of a block.
+        alignas(16) static constexpr unsigned char keep_last[32] = {
+            0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,    0,
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+        const auto buffer_size = _stride * _count;
+        const auto pad = _mm_set1_epi8('0');
+
+        for (std::size_t i = 0; i < _count; ++i)
+        {
+            const auto offset = i * _stride;
+            const char* s = _data + offset;
+
+            if (offset + 16 > buffer_size)
+            {
+                _out[i] = detail::parse_int64_scalar(s, _stride);
+                continue;
+            }
+
+            const auto n = static_cast<std::size_t>(detail::count_digits(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s))));
+
+            if (n == 0 || n == 16 || n >= _stride || offset + n < 16)
+            {
+                _out[i] = detail::parse_int64_scalar(s, _stride);
+                continue;
+            }
+
+            const auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + n - 16));
+            const auto keep = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keep_last + n));
+            const auto digits = _mm_or_si128(_mm_and_si128(keep, block), _mm_andnot_si128(keep, pad));
+
+            _out[i] = static_cast<std::int64_t>(detail::combine_digits(digits));
+        }
+#else
+        for (std::size_t i = 0; i < _count; ++i)
+            _out[i] = detail::parse_int64_scalar(_data + i * _stride, _stride);
+#endif
+    }
+
+    // One column of a page viewed in place. Values are NUL terminated within
+    // their fixed-size slot.
+    class string_column
+    {
+    public:
+        string_column(const char* _data, std::size_t _stride, std::size_t _size)
+            : data_{_data}
+            , stride_{_stride}
+            , size_{_size}
+        {
+        }
+
+        auto size() const noexcept -> std::size_t
+        {
+            return size_;
+        }
+
+        auto operator[](std::size_t _row) const -> std::string_view
+        {
+            const char* s = data_ + _row * stride_;
+            return {s, ::strnlen(s, stride_)};
+        }
+
+    private:
+        const char* data_;
+        std::size_t stride_;
+        std::size_t size_;
+    };
+
+    // A numeric column converted into contiguous memory.
+    class int64_column
+    {
+    public:
+        int64_column(const std::int64_t* _data, std::size_t _size)
+            : data_{_data}
+            , size_{_size}
+        {
+        }
+
+        auto data() const noexcept -> const std::int64_t*
+        {
+            return data_;
+        }
+
+        auto size() const noexcept -> std::size_t
+        {
+            return size_;
+        }
+
+        auto begin() const noexcept -> const std::int64_t*
+        {
+            return data_;
+        }
+
+        auto end() const noexcept -> const std::int64_t*
+        {
+            return data_ + size_;
+        }
+
+        auto operator[](std::size_t _row) const -> std::int64_t
+        {
+            return data_[_row];
+        }
+
+    private:
+        const std::int64_t* data_;
+        std::size_t size_;
+    };
+
+    // A page of GenQuery results exposed column by column, the way the server
+    // sends them. Numeric columns are parsed on first access and kept for the
+    // lifetime of the page.
+    class column_page
+    {
+    public:
+        explicit column_page(const genQueryOut_t& _output)
+            : output_{_output}
+            , numbers_(static_cast<std::size_t>(_output.attriCnt))
+        {
+        }
+
+        auto rows() const noexcept -> std::size_t
+        {
+            return static_cast<std::size_t>(output_.rowCnt);
+        }
+
+        auto columns() const noexcept -> std::size_t
+        {
+            return static_cast<std::size_t>(output_.attriCnt);
+        }
+
+        auto strings(std::size_t _column) const -> string_column
+        {
+            const auto& result = output_.sqlResult[_column];
+            return {result.value, static_cast<std::size_t>(result.len), rows()};
+        }
+
+        auto int64s(std::size_t _column) -> int64_column
+        {
+            auto& values = numbers_[_column];
+
+            if (values.size() != rows())
+            {
+                const auto& result = output_.sqlResult[_column];
+                values.resize(rows());
+                parse_int64_column(result.value, static_cast<std::size_t>(result.len), rows(), values.data());
+            }
+
+            return {values.data(), values.size()};
+        }
+
+    private:
+        const genQueryOut_t& output_;
+        std::vector<std::vector<std::int64_t>> numbers_;
+    };
+
+    // Runs a general query and calls _func with every page of results. _func
+    // returns false to stop early. Returns zero or an iRODS error code. A query
+    // without matching rows is not an error.
+    template <typename Function>
+    auto for_each_page(rcComm_t* _conn, const std::string& _query, Function _func, int _page_size = MAX_SQL_ROWS) -> int
+    {
+        genQueryInp_t input{};
+        input.maxRows = _page_size;
+
+        if (const auto ec = fillGenQueryInpFromStrCond(const_cast<char*>(_query.c_str()), &input); ec < 0)
+            return ec;
+
+        genQueryOut_t* output{};
+        int ec = 0;
+
+        for (;;)
+        {
+            {
+                span_scope span{"rcGenQuery", _query.c_str()};
+
+                if (ec = rcGenQuery(_conn, &input, &output); ec >= 0)
+                {
+                    std::int64_t bytes = 0;
+
+                    for (int i = 0; i < output->attriCnt; ++i)
+                        bytes += std::int64_t{output->sqlResult[i].len} * output->rowCnt;
+
+                    span.set_bytes(bytes);
+                }
+            }
+
+            if (ec < 0)
+            {
+                if (ec == CAT_NO_ROWS_FOUND)
+                    ec = 0;
+
+                break;
+            }
+
+            const auto continue_index = output->continueInx;
+            column_page page{*output};
+
+            if (!_func(page))
+            {
+                // Asking for zero rows releases the statement on the server.
+                if (continue_index > 0)
+                {
+                    input.maxRows = 0;
+                    input.continueInx = continue_index;
+                    freeGenQueryOut(&output);
+                    rcGenQuery(_conn, &input, &output);
+                }
+
+                break;
+            }
+
+            if (continue_index <= 0)
+                break;
+
+            input.continueInx = continue_index;
+            freeGenQueryOut(&output);
+        }
+
+        freeGenQueryOut(&output);
+        clearGenQueryInp(&input);
+
+        return ec;
+    }
+} // namespace irods::smb
+
+#endif // IRODS_SMB_QUERY_COLUMNS_HPP
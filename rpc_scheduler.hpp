@@ -0,0 +1,225 @@
+#ifndef IRODS_SMB_RPC_SCHEDULER_HPP
+#define IRODS_SMB_RPC_SCHEDULER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace irods::smb
+{
+    // Priority classes, highest first.
+    enum class rpc_class
+    {
+        interactive, // Metadata a user is waiting on (e.g. stat, readdir).
+        foreground,  // Data transfers and namespace changes.
+        background   // Work nobody is waiting on (e.g. prefetching, usage scans).
+    };
+
+    // Decides who uses a shared resource (e.g. a connection) next.
+    //
+    // Callers wait in one FIFO queue per class. When a slot frees up, the head of
+    // the highest class below its concurrency limit is admitted. A caller that has
+    // waited longer than the starvation limit is admitted ahead of every class, so
+    // a steady stream of interactive calls cannot block data transfers forever.
+    //
+    // Long operations call yield() between steps to let waiting callers of a
+    // higher class run. The yielding caller resumes ahead of its own class.
+    class rpc_scheduler
+    {
+    public:
+        using clock_type = std::chrono::steady_clock;
+
+        static constexpr std::size_t class_count = 3;
+
+        // Releases its slot on destruction.
+        class slot
+        {
+        public:
+            slot(rpc_scheduler* _scheduler, rpc_class _class)
+                : scheduler_{_scheduler}
+                , class_{_class}
+            {
+            }
+
+            slot(slot&& _other) noexcept
+                : scheduler_{_other.scheduler_}
+                , class_{_other.class_}
+            {
+                _other.scheduler_ = nullptr;
+            }
+
+            slot(const slot&) = delete;
+            auto operator=(const slot&) -> slot& = delete;
+            auto operator=(slot&&) -> slot& = delete;
+
+            ~slot()
+            {
+                if (scheduler_)
+                    scheduler_->release(class_);
+            }
+
+        private:
+            rpc_scheduler* scheduler_;
+            rpc_class class_;
+        };
+
+        explicit rpc_scheduler(std::size_t _slots = 1)
+            : slots_{std::max<std::size_t>(_slots, 1)}
+        {
+            std::fill(std::begin(limits_), std::end(limits_), slots_);
+        }
+
+        rpc_scheduler(const rpc_scheduler&) = delete;
+        auto operator=(const rpc_scheduler&) -> rpc_scheduler& = delete;
+
+        // Caps the number of slots a class may hold at once.
+        auto set_limit(rpc_class _class, std::size_t _limit) -> void
+        {
+            std::lock_guard lock{mutex_};
+            limits_[index(_class)] = std::clamp<std::size_t>(_limit, 1, slots_);
+            decide();
+        }
+
+        auto set_starvation_limit(std::chrono::milliseconds _limit) -> void
+        {
+            std::lock_guard lock{mutex_};
+            starvation_limit_ = _limit;
+        }
+
+        auto acquire(rpc_class _class) -> slot
+        {
+            std::unique_lock lock{mutex_};
+            wait(lock, _class, false);
+            return {this, _class};
+        }
+
+        // Gives the slot held for _class to waiting callers of a higher class and
+        // waits to get it back. Returns immediately when there are none.
+        auto yield(rpc_class _class) -> void
+        {
+            std::unique_lock lock{mutex_};
+
+            const auto c = index(_class);
+            const auto higher_waiting = std::any_of(std::begin(queues_), std::begin(queues_) + c, [](const auto& _queue) {
+                return !_queue.empty();
+            });
+
+            if (!higher_waiting)
+                return;
+
+            release_locked(c);
+            wait(lock, _class, true);
+        }
+
+    private:
+        struct waiter
+        {
+            std::uint64_t ticket;
+            clock_type::time_point since;
+        };
+
+        static auto index(rpc_class _class) noexcept -> std::size_t
+        {
+            return static_cast<std::size_t>(_class);
+        }
+
+        auto wait(std::unique_lock<std::mutex>& _lock, rpc_class _class, bool _resume) -> void
+        {
+            const auto c = index(_class);
+            const auto ticket = next_ticket_++;
+            auto& queue = queues_[c];
+
+            if (_resume)
+                queue.push_front({ticket, clock_type::now()});
+            else
+                queue.push_back({ticket, clock_type::now()});
+
+            decide();
+
+            ready_.wait(_lock, [&] {
+                return next_ == static_cast<int>(c) && queue.front().ticket == ticket;
+            });
+
+            queue.pop_front();
+            ++running_[c];
+            ++running_total_;
+
+            // Another slot may still be free.
+            decide();
+        }
+
+        auto release(rpc_class _class) -> void
+        {
+            std::lock_guard lock{mutex_};
+            release_locked(index(_class));
+        }
+
+        auto release_locked(std::size_t _class) -> void
+        {
+            --running_[_class];
+            --running_total_;
+            decide();
+        }
+
+        // Chooses the class admitted next. Waiters only compare against the
+        // stored choice, so they all agree on it even though starvation depends
+        // on the time of the check.
+        auto decide() -> void
+        {
+            next_ = next_class();
+
+            if (next_ >= 0)
+                ready_.notify_all();
+        }
+
+        // Returns the class whose oldest waiter is admitted next, or -1.
+        auto next_class() const -> int
+        {
+            if (running_total_ >= slots_)
+                return -1;
+
+            const auto now = clock_type::now();
+            int starved = -1;
+
+            for (std::size_t c = 0; c < class_count; ++c)
+            {
+                if (queues_[c].empty() || running_[c] >= limits_[c])
+                    continue;
+
+                if (now - queues_[c].front().since < starvation_limit_)
+                    continue;
+
+                if (starved < 0 || queues_[c].front().since < queues_[starved].front().since)
+                    starved = static_cast<int>(c);
+            }
+
+            if (starved >= 0)
+                return starved;
+
+            for (std::size_t c = 0; c < class_count; ++c)
+            {
+                if (!queues_[c].empty() && running_[c] < limits_[c])
+                    return static_cast<int>(c);
+            }
+
+            return -1;
+        }
+
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::deque<waiter> queues_[class_count];
+        std::size_t running_[class_count]{};
+        std::size_t limits_[class_count]{};
+        std::size_t running_total_ = 0;
+        std::size_t slots_;
+        std::chrono::milliseconds starvation_limit_{200};
+        std::uint64_t next_ticket_ = 0;
+        int next_ = -1;
+    };
+} // namespace irods::smb
+
+#endif // IRODS_SMB_RPC_SCHEDULER_HPP
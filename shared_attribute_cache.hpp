@@ -0,0 +1,399 @@
+#ifndef IRODS_SMB_SHARED_ATTRIBUTE_CACHE_HPP
+#define IRODS_SMB_SHARED_ATTRIBUTE_CACHE_HPP
+
+#include "libirods_smb.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace irods::smb
+{
+    // A fixed-size hash table of stat results living in a POSIX shared memory
+    // segment. Every smbd process on the gateway attaches to the same segment, so
+    // an attribute fetched for one client is available to all of them.
+    //
+    // Readers never take a lock. Each slot is protected by a sequence counter
+    // (seqlock): writers make the counter odd while updating the slot and readers
+    // retry a few times and then treat the slot as a miss. Writers that lose the
+    // race for a slot simply skip the update, it is only a cache. An odd counter
+    // carries the writer's pid, so a slot left odd by a process that died while
+    // writing it is taken over by the next writer.
+    //
+    // Keys include the iRODS user and zone, so entries are only shared between
+    // sessions that have the same permissions. They end with the absolute path of
+    // the entry, which starts at the first '/'.
+    //
+    // Dropping everything below a collection bumps a stamp in a small table of
+    // stamps keyed by the hash of the collection's path. An entry is stale when
+    // the stamp of any of its ancestors is newer than the entry. Collisions only
+    // invalidate more than needed.
+    class shared_attribute_cache
+    {
+    public:
+        static constexpr std::size_t max_key_size = 512;
+
+        shared_attribute_cache() = default;
+
+        shared_attribute_cache(const shared_attribute_cache&) = delete;
+        auto operator=(const shared_attribute_cache&) -> shared_attribute_cache& = delete;
+
+        ~shared_attribute_cache()
+        {
+            detach();
+        }
+
+        // Attaches to (or creates) the segment named _name. All processes must
+        // agree on _capacity.
+        auto attach(const std::string& _name, std::uint32_t _capacity) -> bool
+        {
+            detach();
+
+            if (_capacity == 0)
+                return false;
+
+            const auto size = sizeof(header) + sizeof(slot) * _capacity;
+
+            bool creator = true;
+            int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+
+            if (fd < 0 && errno == EEXIST)
+            {
+                creator = false;
+                fd = shm_open(_name.c_str(), O_RDWR, 0660);
+            }
+
+            if (fd < 0)
+                return false;
+
+            if (creator && ftruncate(fd, static_cast<off_t>(size)) != 0)
+            {
+                close(fd);
+                shm_unlink(_name.c_str());
+                return false;
+            }
+
+            // Wait for the creator to size the segment.
+            struct stat st{};
+            for (int i = 0; i < 100 && fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) < size; ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+            if (static_cast<std::size_t>(st.st_size) < size && !creator)
+            {
+                close(fd);
+                return false;
+            }
+
+            void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (addr == MAP_FAILED)
+                return false;
+
+            header_ = static_cast<header*>(addr);
+            slots_ = reinterpret_cast<slot*>(static_cast<char*>(addr) + sizeof(header));
+            size_ = size;
+
+            if (creator)
+            {
+                // The segment is zero-filled by ftruncate, i.e. every slot is empty.
+                header_->capacity = _capacity;
+                header_->magic.store(magic, std::memory_order_release);
+            }
+            else
+            {
+                for (int i = 0; i < 100 && header_->magic.load(std::memory_order_acquire) != magic; ++i)
+                    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+                if (header_->magic.load(std::memory_order_acquire) != magic || header_->capacity != _capacity)
+                {
+                    detach();
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        auto detach() -> void
+        {
+            if (header_)
+                munmap(header_, size_);
+
+            header_ = nullptr;
+            slots_ = nullptr;
+            size_ = 0;
+        }
+
+        auto attached() const noexcept -> bool
+        {
+            return header_ != nullptr;
+        }
+
+        auto lookup(const std::string& _key, irods_stat_info& _stat_info) const -> bool
+        {
+            if (!header_ || _key.size() >= max_key_size)
+                return false;
+
+            const auto hash = hash_key(_key);
+            const auto now = now_ms();
+            const auto generation = header_->generation.load(std::memory_order_acquire);
+
+            for (std::uint32_t i = 0; i < probe_length; ++i)
+            {
+                const auto& s = slots_[(hash + i) % header_->capacity];
+
+                if (s.hash.load(std::memory_order_relaxed) != hash)
+                    continue;
+
+                char key[max_key_size];
+                irods_stat_info stat_info;
+                std::int64_t expires_at = 0;
+                std::uint32_t slot_generation = 0;
+                std::uint64_t stamp = 0;
+                bool consistent = false;
+
+                for (int attempt = 0; attempt < max_read_attempts && !consistent; ++attempt)
+                {
+                    if (attempt > 0)
+                        std::this_thread::yield();
+
+                    const auto seq = s.seq.load(std::memory_order_acquire);
+
+                    if (seq & 1)
+                        continue; // Being written.
+
+                    std::memcpy(key, s.key, sizeof(key));
+                    std::memcpy(&stat_info, &s.stat_info, sizeof(stat_info));
+                    expires_at = s.expires_at;
+                    slot_generation = s.generation;
+                    stamp = s.stamp;
+
+                    std::atomic_thread_fence(std::memory_order_acquire);
+
+                    consistent = s.seq.load(std::memory_order_relaxed) == seq;
+                }
+
+                if (!consistent)
+                    return false;
+
+                key[max_key_size - 1] = '\0';
+
+                if (_key != key)
+                    continue;
+
+                if (expires_at <= now || slot_generation != generation || cleared_since(_key, stamp))
+                    return false;
+
+                _stat_info = stat_info;
+
+                return true;
+            }
+
+            return false;
+        }
+
+        auto insert(const std::string& _key, const irods_stat_info& _stat_info, std::chrono::milliseconds _ttl) -> void
+        {
+            if (!header_ || _key.size() >= max_key_size)
+                return;
+
+            const auto hash = hash_key(_key);
+            const auto now = now_ms();
+
+            // Prefer the slot already holding the key, then an expired one, then
+            // the one closest to expiring.
+            slot* victim = nullptr;
+
+            for (std::uint32_t i = 0; i < probe_length; ++i)
+            {
+                auto& s = slots_[(hash + i) % header_->capacity];
+
+                if (s.hash.load(std::memory_order_relaxed) == hash && key_equals(s, _key))
+                {
+                    victim = &s;
+                    break;
+                }
+
+                if (!victim || s.expires_at < victim->expires_at)
+                    victim = &s;
+            }
+
+            write(*victim, [&](slot& _s) {
+                _s.hash.store(hash, std::memory_order_relaxed);
+                std::memset(_s.key, 0, sizeof(_s.key));
+                std::memcpy(_s.key, _key.data(), _key.size());
+                _s.stat_info = _stat_info;
+                _s.expires_at = now + _ttl.count();
+                _s.generation = header_->generation.load(std::memory_order_relaxed);
+                _s.stamp = header_->clock.load(std::memory_order_acquire);
+            });
+        }
+
+        auto erase(const std::string& _key) -> void
+        {
+            if (!header_ || _key.size() >= max_key_size)
+                return;
+
+            const auto hash = hash_key(_key);
+
+            for (std::uint32_t i = 0; i < probe_length; ++i)
+            {
+                auto& s = slots_[(hash + i) % header_->capacity];
+
+                if (s.hash.load(std::memory_order_relaxed) == hash && key_equals(s, _key))
+                {
+                    write(s, [](slot& _s) {
+                        _s.hash.store(0, std::memory_order_relaxed);
+                        _s.expires_at = 0;
+                    });
+                }
+            }
+        }
+
+        // Invalidates every entry in the segment.
+        auto clear() -> void
+        {
+            if (header_)
+                header_->generation.fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        // Invalidates the entries below the collection _path (e.g. after renaming
+        // or removing it), for every user.
+        auto clear_below(const std::string& _path) -> void
+        {
+            if (!header_)
+                return;
+
+            const auto stamp = header_->clock.fetch_add(1, std::memory_order_acq_rel) + 1;
+            auto& bucket = header_->stamps[hash_key(_path) % stamp_buckets];
+
+            for (auto current = bucket.load(std::memory_order_relaxed);
+                 current < stamp && !bucket.compare_exchange_weak(current, stamp, std::memory_order_acq_rel);)
+            {
+            }
+        }
+
+    private:
+        friend struct shared_attribute_cache_test; // Simulates writers that die mid-update.
+
+        static constexpr std::uint64_t magic = 0x69736d6261747233; // "ismbatr3"
+        static constexpr std::uint32_t probe_length = 8;
+        static constexpr std::size_t stamp_buckets = 4096;
+        static constexpr int max_read_attempts = 4;
+
+        struct header
+        {
+            std::atomic<std::uint64_t> magic;
+            std::uint32_t capacity;
+            std::atomic<std::uint32_t> generation;
+            std::atomic<std::uint64_t> clock;
+            std::atomic<std::uint64_t> stamps[stamp_buckets]; // See clear_below.
+        };
+
+        struct slot
+        {
+            // The low half counts writes. While odd, the high half holds the
+            // writer's pid.
+            std::atomic<std::uint64_t> seq;
+            std::uint32_t generation;
+            std::atomic<std::uint64_t> hash;
+            std::uint64_t stamp; // The clock when the entry was written.
+            std::int64_t expires_at;
+            irods_stat_info stat_info;
+            char key[max_key_size];
+        };
+
+        static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+        template <typename Function>
+        static auto write(slot& _s, Function _func) -> void
+        {
+            auto seq = _s.seq.load(std::memory_order_relaxed);
+
+            // Only take over from a writer that no longer exists. The slot may be
+            // torn, but _func rewrites everything readers look at.
+            if ((seq & 1) && !owner_died(seq))
+                return; // Another writer owns the slot.
+
+            const auto counter = ((seq & 0xffffffff) + 1) & 0xffffffff;
+            const auto held = (static_cast<std::uint64_t>(::getpid()) << 32) | counter | 1;
+
+            if (!_s.seq.compare_exchange_strong(seq, held, std::memory_order_acquire))
+                return;
+
+            std::atomic_thread_fence(std::memory_order_release);
+            _func(_s);
+            _s.seq.store(((held & 0xffffffff) + 1) & 0xffffffff, std::memory_order_release);
+        }
+
+        static auto owner_died(std::uint64_t _seq) -> bool
+        {
+            const auto pid = static_cast<pid_t>(_seq >> 32);
+            return pid > 0 && ::kill(pid, 0) != 0 && errno == ESRCH;
+        }
+
+        // Returns true if a collection above the path in _key was cleared after
+        // the clock read _stamp.
+        auto cleared_since(const std::string& _key, std::uint64_t _stamp) const -> bool
+        {
+            const auto root = _key.find('/');
+
+            if (root == std::string::npos)
+                return false;
+
+            const std::string path = _key.substr(root);
+
+            for (auto pos = path.find_last_of('/'); pos != std::string::npos && pos > 0; pos = path.find_last_of('/', pos - 1))
+            {
+                if (header_->stamps[hash_key(path.substr(0, pos)) % stamp_buckets].load(std::memory_order_acquire) > _stamp)
+                    return true;
+            }
+
+            return header_->stamps[hash_key("/") % stamp_buckets].load(std::memory_order_acquire) > _stamp;
+        }
+
+        static auto key_equals(const slot& _s, const std::string& _key) -> bool
+        {
+            return std::strncmp(_s.key, _key.c_str(), max_key_size) == 0;
+        }
+
+        static auto hash_key(const std::string& _key) -> std::uint64_t
+        {
+            // FNV-1a. Zero marks an empty slot.
+            std::uint64_t hash = 0xcbf29ce484222325ULL;
+
+            for (unsigned char c : _key)
+            {
+                hash ^= c;
+                hash *= 0x100000001b3ULL;
+            }
+
+            return hash ? hash : 1;
+        }
+
+        static auto now_ms() -> std::int64_t
+        {
+            // CLOCK_MONOTONIC is system-wide, so all processes agree on it.
+            using namespace std::chrono;
+            return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+        }
+
+        header* header_ = nullptr;
+        slot* slots_ = nullptr;
+        std::size_t size_ = 0;
+    };
+} // namespace irods::smb
+
+#endif // IRODS_SMB_SHARED_ATTRIBUTE_CACHE_HPP
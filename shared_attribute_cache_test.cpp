@@ -0,0 +1,227 @@
+// Exercises shared_attribute_cache across processes. Needs no iRODS server.
+//
+// Usage: shared_attribute_cache_test
+
+#include "shared_attribute_cache.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace irods::smb
+{
+    // Leaves slots in the state a writer that dies mid-update leaves them in.
+    struct shared_attribute_cache_test
+    {
+        static auto die_while_writing(shared_attribute_cache& _cache, const std::string& _key) -> void
+        {
+            const auto hash = shared_attribute_cache::hash_key(_key);
+
+            for (std::uint32_t i = 0; i < shared_attribute_cache::probe_length; ++i)
+            {
+                auto& s = _cache.slots_[(hash + i) % _cache.header_->capacity];
+
+                if (s.hash.load() == hash)
+                    shared_attribute_cache::write(s, [](shared_attribute_cache::slot&) { std::_Exit(0); });
+            }
+        }
+    };
+} // namespace irods::smb
+
+namespace
+{
+    using irods::smb::shared_attribute_cache;
+
+    constexpr std::uint32_t capacity = 8192;
+    constexpr int objects_per_writer = 500;
+    constexpr auto ttl = std::chrono::seconds{60};
+
+    int failures = 0;
+
+    auto check(bool _condition, const char* _what) -> void
+    {
+        if (!_condition)
+        {
+            std::printf("FAILED: %s\n", _what);
+            ++failures;
+        }
+    }
+
+    auto key_of(int _writer, int _object) -> std::string
+    {
+        return "rods#tempZone:/tempZone/w" + std::to_string(_writer) + "/obj" + std::to_string(_object);
+    }
+
+    // Every field is derived from the object number, so torn copies are detectable.
+    auto stat_info_of(int _object) -> irods_stat_info
+    {
+        irods_stat_info stat_info{};
+        stat_info.size = _object;
+        stat_info.type = IOT_DATA_OBJECT;
+        stat_info.mode = _object;
+        stat_info.id = _object;
+        std::snprintf(stat_info.owner_name, sizeof(stat_info.owner_name), "owner%d", _object);
+        stat_info.creation_time = _object;
+        stat_info.modified_time = _object;
+        return stat_info;
+    }
+
+    auto consistent(const irods_stat_info& _stat_info) -> bool
+    {
+        const auto expected = stat_info_of(static_cast<int>(_stat_info.size));
+        return std::memcmp(&expected, &_stat_info, sizeof(expected)) == 0;
+    }
+
+    auto test_concurrent_writers(const std::string& _name) -> void
+    {
+        pid_t writers[2];
+
+        for (int w = 0; w < 2; ++w)
+        {
+            if ((writers[w] = fork()) == 0)
+            {
+                shared_attribute_cache cache;
+
+                if (!cache.attach(_name, capacity))
+                    std::_Exit(1);
+
+                for (int round = 0; round < 200; ++round)
+                {
+                    for (int i = 0; i < objects_per_writer; ++i)
+                        cache.insert(key_of(w, i), stat_info_of(i), ttl);
+                }
+
+                std::_Exit(0);
+            }
+        }
+
+        shared_attribute_cache reader;
+        check(reader.attach(_name, capacity), "reader attaches");
+
+        bool torn = false;
+        int running = 2;
+
+        while (running > 0)
+        {
+            for (int w = 0; w < 2; ++w)
+            {
+                for (int i = 0; i < objects_per_writer; ++i)
+                {
+                    irods_stat_info stat_info{};
+
+                    if (reader.lookup(key_of(w, i), stat_info) && (!consistent(stat_info) || stat_info.size != i))
+                        torn = true;
+                }
+            }
+
+            for (auto& pid : writers)
+            {
+                int status = 0;
+
+                if (pid > 0 && waitpid(pid, &status, WNOHANG) == pid)
+                {
+                    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "writer exits cleanly");
+                    pid = 0;
+                    --running;
+                }
+            }
+        }
+
+        check(!torn, "readers never see torn entries");
+
+        int found = 0;
+
+        for (int w = 0; w < 2; ++w)
+        {
+            for (int i = 0; i < objects_per_writer; ++i)
+            {
+                irods_stat_info stat_info{};
+                found += reader.lookup(key_of(w, i), stat_info) ? 1 : 0;
+            }
+        }
+
+        check(found == 2 * objects_per_writer, "entries of both writers are visible");
+    }
+
+    auto test_invalidation(const std::string& _name) -> void
+    {
+        shared_attribute_cache cache;
+        check(cache.attach(_name, capacity), "attaches");
+
+        irods_stat_info stat_info{};
+
+        cache.clear_below("/tempZone/w0");
+        check(!cache.lookup(key_of(0, 1), stat_info), "clear_below drops entries below the collection");
+        check(cache.lookup(key_of(1, 1), stat_info), "clear_below keeps entries elsewhere");
+
+        cache.insert(key_of(0, 1), stat_info_of(1), ttl);
+        check(cache.lookup(key_of(0, 1), stat_info), "entries written after clear_below are visible");
+
+        cache.clear();
+        check(!cache.lookup(key_of(0, 1), stat_info) && !cache.lookup(key_of(1, 1), stat_info), "clear drops every entry");
+
+        cache.insert(key_of(1, 1), stat_info_of(1), ttl);
+        check(cache.lookup(key_of(1, 1), stat_info), "entries written after clear are visible");
+
+        cache.erase(key_of(1, 1));
+        check(!cache.lookup(key_of(1, 1), stat_info), "erase drops the entry");
+
+        cache.insert(key_of(1, 2), stat_info_of(2), std::chrono::milliseconds{1});
+        usleep(5000);
+        check(!cache.lookup(key_of(1, 2), stat_info), "entries expire");
+    }
+
+    auto test_dead_writer(const std::string& _name) -> void
+    {
+        shared_attribute_cache cache;
+        check(cache.attach(_name, capacity), "attaches");
+
+        const auto key = key_of(2, 0);
+        cache.insert(key, stat_info_of(7), ttl);
+
+        if (const auto pid = fork(); pid == 0)
+        {
+            shared_attribute_cache child;
+
+            if (child.attach(_name, capacity))
+                irods::smb::shared_attribute_cache_test::die_while_writing(child, key);
+
+            std::_Exit(1);
+        }
+        else
+        {
+            int status = 0;
+            waitpid(pid, &status, 0);
+            check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "writer died holding the slot");
+        }
+
+        irods_stat_info stat_info{};
+        check(!cache.lookup(key, stat_info), "a slot being written is a miss");
+
+        cache.insert(key, stat_info_of(8), ttl);
+        check(cache.lookup(key, stat_info) && stat_info.size == 8, "the slot of a dead writer is taken over");
+    }
+} // anonymous namespace
+
+int main()
+{
+    const auto name = "/ismb_attr_test." + std::to_string(getpid());
+
+    shm_unlink(name.c_str());
+
+    test_concurrent_writers(name);
+    test_invalidation(name);
+    test_dead_writer(name);
+
+    shm_unlink(name.c_str());
+
+    std::printf("%s\n", failures == 0 ? "OK" : "FAILED");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,264 @@
+#ifndef IRODS_SMB_SPAN_TRACE_HPP
+#define IRODS_SMB_SPAN_TRACE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+namespace irods::smb
+{
+    // A timed region of work, e.g. one public call or one RPC made on its behalf.
+    // Spans of the same thread nest by time.
+    struct span
+    {
+        const char* name;      // Must have static storage duration.
+        std::int64_t start_ns; // Steady clock.
+        std::int64_t end_ns;
+        std::int64_t bytes;    // Negative when not applicable.
+        char path[128];        // Truncated.
+    };
+
+    // Keeps the most recent spans of every thread in per-thread ring buffers and
+    // writes them out in Chrome's trace event format, which Perfetto and
+    // chrome://tracing load directly.
+    //
+    // Recording is disabled until a capacity is set. Disabled recording costs a
+    // relaxed atomic load per span.
+    class span_recorder
+    {
+    public:
+        static auto instance() -> span_recorder&
+        {
+            static span_recorder recorder;
+            return recorder;
+        }
+
+        static auto now_ns() noexcept -> std::int64_t
+        {
+            using namespace std::chrono;
+            return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        }
+
+        // Sets the number of spans kept per thread. Zero disables recording and
+        // drops everything recorded so far.
+        auto set_capacity(std::size_t _spans_per_thread) -> void
+        {
+            std::lock_guard lock{mutex_};
+
+            capacity_.store(_spans_per_thread, std::memory_order_relaxed);
+
+            for (auto& buffer : buffers_)
+            {
+                std::lock_guard buffer_lock{buffer->mutex};
+                buffer->spans.clear();
+                buffer->spans.shrink_to_fit();
+                buffer->next = 0;
+            }
+        }
+
+        auto enabled() const noexcept -> bool
+        {
+            return capacity_.load(std::memory_order_relaxed) > 0;
+        }
+
+        auto record(const span& _span) -> void
+        {
+            const auto capacity = capacity_.load(std::memory_order_relaxed);
+
+            if (capacity == 0)
+                return;
+
+            auto& buffer = local_buffer();
+            std::lock_guard lock{buffer.mutex};
+
+            if (buffer.spans.size() < capacity)
+                buffer.spans.push_back(_span);
+            else
+                buffer.spans[buffer.next % buffer.spans.size()] = _span;
+
+            ++buffer.next;
+        }
+
+        // Writes every buffered span as a complete ("X") event. Returns false
+        // if the file could not be written.
+        auto export_chrome_trace(const std::string& _path) -> bool
+        {
+            auto* file = std::fopen(_path.c_str(), "w");
+
+            if (!file)
+                return false;
+
+            const auto pid = static_cast<long>(::getpid());
+            bool first = true;
+
+            std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+
+            std::lock_guard lock{mutex_};
+
+            for (const auto& buffer : buffers_)
+            {
+                std::vector<span> spans;
+
+                {
+                    std::lock_guard buffer_lock{buffer->mutex};
+                    spans = buffer->spans;
+                }
+
+                for (const auto& s : spans)
+                {
+                    std::fprintf(file,
+                                 "%s\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%ld,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"path\":\"",
+                                 first ? "" : ",",
+                                 s.name,
+                                 pid,
+                                 buffer->tid,
+                                 static_cast<double>(s.start_ns) / 1000.0,
+                                 static_cast<double>(s.end_ns - s.start_ns) / 1000.0);
+
+                    write_escaped(file, s.path);
+                    std::fputc('"', file);
+
+                    if (s.bytes >= 0)
+                        std::fprintf(file, ",\"bytes\":%lld", static_cast<long long>(s.bytes));
+
+                    std::fputs("}}", file);
+                    first = false;
+                }
+            }
+
+            std::fputs("\n]}\n", file);
+
+            return std::fclose(file) == 0;
+        }
+
+    private:
+        struct thread_buffer
+        {
+            std::mutex mutex;
+            std::vector<span> spans;
+            std::size_t next = 0;
+            int tid = 0;
+        };
+
+        span_recorder() = default;
+
+        auto local_buffer() -> thread_buffer&
+        {
+            thread_local std::shared_ptr<thread_buffer> buffer;
+
+            if (!buffer)
+            {
+                buffer = std::make_shared<thread_buffer>();
+
+                std::lock_guard lock{mutex_};
+                buffer->tid = static_cast<int>(buffers_.size()) + 1;
+                buffers_.push_back(buffer);
+            }
+
+            return *buffer;
+        }
+
+        static auto write_escaped(std::FILE* _file, const char* _s) -> void
+        {
+            for (; *_s; ++_s)
+            {
+                const auto c = static_cast<unsigned char>(*_s);
+
+                if (c == '"' || c == '\\')
+                {
+                    std::fputc('\\', _file);
+                    std::fputc(c, _file);
+                }
+                else if (c < 0x20)
+                    std::fprintf(_file, "\\u%04x", c);
+                else
+                    std::fputc(c, _file);
+            }
+        }
+
+        std::atomic<std::size_t> capacity_{0};
+        std::mutex mutex_;
+        std::vector<std::shared_ptr<thread_buffer>> buffers_;
+    };
+
+    // Records a span covering the lifetime of the object.
+    class span_scope
+    {
+    public:
+        explicit span_scope(const char* _name, const char* _path = nullptr)
+            : active_{span_recorder::instance().enabled()}
+        {
+            if (!active_)
+                return;
+
+            span_.name = _name;
+            span_.bytes = -1;
+            span_.path[0] = '\0';
+
+            if (_path)
+            {
+                std::strncpy(span_.path, _path, sizeof(span_.path) - 1);
+                span_.path[sizeof(span_.path) - 1] = '\0';
+            }
+
+            span_.start_ns = span_recorder::now_ns();
+        }
+
+        span_scope(const span_scope&) = delete;
+        auto operator=(const span_scope&) -> span_scope& = delete;
+
+        ~span_scope()
+        {
+            if (!active_)
+                return;
+
+            span_.end_ns = span_recorder::now_ns();
+            span_recorder::instance().record(span_);
+        }
+
+        auto set_bytes(std::int64_t _bytes) noexcept -> void
+        {
+            if (active_)
+                span_.bytes = _bytes;
+        }
+
+    private:
+        bool active_;
+        span span_;
+    };
+
+    // Runs _func inside a span named _name. Non-negative results of byte
+    // transfers (_returns_bytes) are recorded as the span's byte count.
+    template <typename Function>
+    auto in_span(const char* _name, const char* _path, Function _func, bool _returns_bytes = false) -> decltype(_func())
+    {
+        span_scope scope{_name, _path};
+
+        if constexpr (std::is_void_v<decltype(_func())>)
+            _func();
+        else
+        {
+            auto result = _func();
+
+            if constexpr (std::is_integral_v<decltype(result)>)
+            {
+                if (_returns_bytes && result >= 0)
+                    scope.set_bytes(static_cast<std::int64_t>(result));
+            }
+
+            return result;
+        }
+    }
+} // namespace irods::smb
+
+#endif // IRODS_SMB_SPAN_TRACE_HPP
@@ -0,0 +1,228 @@
+#ifndef IRODS_SMB_TRACE_HPP
+#define IRODS_SMB_TRACE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace irods::smb
+{
+    // Operations recorded in a trace. The values are part of the file format.
+    enum class trace_op : std::uint16_t
+    {
+        stat = 1,
+        list,
+        chdir,
+        opendir,
+        readdir,
+        closedir,
+        mkdir,
+        rmdir,
+        rmtree,
+        open,
+        close,
+        read,
+        pread,
+        write,
+        pwrite,
+        lseek,
+        ftruncate,
+        fstat,
+        unlink,
+        copy,
+        rename,
+        dir_usage,
+        statvfs,
+        lookup_nocase,
+        getxattr,
+        listxattr,
+        setxattr,
+        removexattr,
+        walk,
+        changes_since
+    };
+
+    inline auto trace_op_name(trace_op _op) -> const char*
+    {
+        static constexpr const char* names[] = {
+            "unknown", "stat", "list", "chdir", "opendir", "readdir", "closedir", "mkdir", "rmdir", "rmtree",
+            "open", "close", "read", "pread", "write", "pwrite", "lseek", "ftruncate", "fstat", "unlink",
+            "copy", "rename", "dir_usage", "statvfs", "lookup_nocase", "getxattr", "listxattr", "setxattr",
+            "removexattr", "walk", "changes_since"};
+
+        const auto i = static_cast<std::size_t>(_op);
+
+        return i < sizeof(names) / sizeof(names[0]) ? names[i] : names[0];
+    }
+
+    // One recorded call. The meaning of args depends on the operation (e.g.
+    // descriptor, size and offset for pread). Paths are as passed by the caller.
+    // Data buffers are never recorded, only their sizes.
+    struct trace_record
+    {
+        trace_op op;
+        std::int64_t start_ns; // Relative to the start of the trace.
+        std::int64_t duration_ns;
+        std::int64_t result;
+        std::int64_t args[3];
+        std::string path;
+        std::string path2;
+    };
+
+    namespace detail
+    {
+        constexpr std::uint64_t trace_magic = 0x69736d6274726331; // "ismbtrc1"
+
+        struct trace_file_header
+        {
+            std::uint64_t magic;
+            std::int64_t start_unix_ns;
+        };
+
+        struct trace_record_header
+        {
+            std::uint16_t op;
+            std::uint16_t path_size;
+            std::uint16_t path2_size;
+            std::uint16_t reserved;
+            std::int64_t start_ns;
+            std::int64_t duration_ns;
+            std::int64_t result;
+            std::int64_t args[3];
+        };
+    } // namespace detail
+
+    // Appends records to a binary trace file. Writes go through a large stdio
+    // buffer, so recording a call costs a memcpy in the common case.
+    class trace_writer
+    {
+    public:
+        trace_writer() = default;
+
+        trace_writer(const trace_writer&) = delete;
+        auto operator=(const trace_writer&) -> trace_writer& = delete;
+
+        ~trace_writer()
+        {
+            close();
+        }
+
+        auto open(const std::string& _path, std::int64_t _start_unix_ns) -> bool
+        {
+            close();
+
+            file_ = std::fopen(_path.c_str(), "wb");
+
+            if (!file_)
+                return false;
+
+            std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+            const detail::trace_file_header header{detail::trace_magic, _start_unix_ns};
+
+            return std::fwrite(&header, sizeof(header), 1, file_) == 1;
+        }
+
+        auto record(const trace_record& _record) -> void
+        {
+            if (!file_)
+                return;
+
+            detail::trace_record_header header{};
+            header.op = static_cast<std::uint16_t>(_record.op);
+            header.path_size = static_cast<std::uint16_t>(std::min<std::size_t>(_record.path.size(), UINT16_MAX));
+            header.path2_size = static_cast<std::uint16_t>(std::min<std::size_t>(_record.path2.size(), UINT16_MAX));
+            header.start_ns = _record.start_ns;
+            header.duration_ns = _record.duration_ns;
+            header.result = _record.result;
+            std::memcpy(header.args, _record.args, sizeof(header.args));
+
+            std::fwrite(&header, sizeof(header), 1, file_);
+            std::fwrite(_record.path.data(), 1, header.path_size, file_);
+            std::fwrite(_record.path2.data(), 1, header.path2_size, file_);
+        }
+
+        auto close() -> void
+        {
+            if (file_)
+                std::fclose(file_);
+
+            file_ = nullptr;
+        }
+
+    private:
+        std::FILE* file_ = nullptr;
+    };
+
+    class trace_reader
+    {
+    public:
+        trace_reader() = default;
+
+        trace_reader(const trace_reader&) = delete;
+        auto operator=(const trace_reader&) -> trace_reader& = delete;
+
+        ~trace_reader()
+        {
+            if (file_)
+                std::fclose(file_);
+        }
+
+        auto open(const std::string& _path) -> bool
+        {
+            file_ = std::fopen(_path.c_str(), "rb");
+
+            if (!file_)
+                return false;
+
+            detail::trace_file_header header{};
+
+            if (std::fread(&header, sizeof(header), 1, file_) != 1 || header.magic != detail::trace_magic)
+                return false;
+
+            start_unix_ns_ = header.start_unix_ns;
+
+            return true;
+        }
+
+        auto start_unix_ns() const noexcept -> std::int64_t
+        {
+            return start_unix_ns_;
+        }
+
+        // Returns false at the end of the trace or on a truncated record, which
+        // is what a trace of a process that was killed ends with.
+        auto next(trace_record& _record) -> bool
+        {
+            detail::trace_record_header header{};
+
+            if (!file_ || std::fread(&header, sizeof(header), 1, file_) != 1)
+                return false;
+
+            _record.op = static_cast<trace_op>(header.op);
+            _record.start_ns = header.start_ns;
+            _record.duration_ns = header.duration_ns;
+            _record.result = header.result;
+            std::memcpy(_record.args, header.args, sizeof(header.args));
+
+            _record.path.resize(header.path_size);
+            _record.path2.resize(header.path2_size);
+
+            if (header.path_size > 0 && std::fread(_record.path.data(), 1, header.path_size, file_) != header.path_size)
+                return false;
+
+            if (header.path2_size > 0 && std::fread(_record.path2.data(), 1, header.path2_size, file_) != header.path2_size)
+                return false;
+
+            return true;
+        }
+
+    private:
+        std::FILE* file_ = nullptr;
+        std::int64_t start_unix_ns_ = 0;
+    };
+} // namespace irods::smb
+
+#endif // IRODS_SMB_TRACE_HPP